@@ -34,6 +34,7 @@
 #include <mips/trapframe.h>
 #include <cpu.h>
 #include <spl.h>
+#include <clock.h>
 #include <thread.h>
 #include <current.h>
 #include <vm.h>
@@ -123,6 +124,31 @@ kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr)
 	panic("Thread termination failed\n");
 }
 
+/*
+ * On the way back to user mode: if another thread of the process has
+ * called _exit, leave instead of going back.
+ */
+static
+void
+mips_checkexit(void)
+{
+#if OPT_C2
+	struct proc *p = curproc;
+	int spl;
+
+	if (p == NULL || p == kproc || !p->p_exiting) {
+		return;
+	}
+	/* as if we'd come in for a syscall */
+	spl = splhigh();
+	cputime_enter(CPUSTATE_SYS);
+	splx(spl);
+
+	proc_thread_exit();
+	thread_exit();
+#endif
+}
+
 /*
  * General trap (exception) handling function for mips.
  * This is called by the assembly-language exception handler once
@@ -135,6 +161,7 @@ mips_trap(struct trapframe *tf)
 	/*bool isutlb; -- not used */
 	bool iskern;
 	int spl;
+	int cpustate;
 
 	/* The trap frame is supposed to be 35 registers long. */
 	KASSERT(sizeof(struct trapframe)==(35*4));
@@ -191,8 +218,13 @@ mips_trap(struct trapframe *tf)
 			doadjust = false;
 		}
 
+		/* Interrupt time is accounted separately. */
+		cpustate = cputime_enter(CPUSTATE_INTR);
+
 		mainbus_interrupt(tf);
 
+		cputime_enter(cpustate);
+
 		if (doadjust) {
 			KASSERT(curthread->t_curspl == IPL_HIGH);
 			KASSERT(curthread->t_iplhigh_count == 1);
@@ -201,6 +233,9 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+		if (!iskern) {
+			mips_checkexit();
+		}
 		goto done2;
 	}
 
@@ -216,6 +251,8 @@ mips_trap(struct trapframe *tf)
 	 * sync, then restoring the previous state.
 	 */
 	spl = splhigh();
+	/* Start charging time to the kernel. */
+	cpustate = cputime_enter(CPUSTATE_SYS);
 	splx(spl);
 
 	/* Syscall? Call the syscall handler and return. */
@@ -321,6 +358,13 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	if (!iskern) {
+		mips_checkexit();
+	}
+
+	/* Go back to charging time to whatever we interrupted. */
+	cputime_enter(cpustate);
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
@@ -380,6 +424,7 @@ mips_usermode(struct trapframe *tf)
 	 * be on. To interact properly with the spl-handling logic
 	 * above, we explicitly call spl0() and then call cpu_irqoff().
 	 */
+	cputime_enter(CPUSTATE_USER);
 	spl0();
 	cpu_irqoff();
 
@@ -442,3 +487,22 @@ enter_new_process(int argc, userptr_t argv, userptr_t env,
 
 	mips_usermode(&tf);
 }
+
+/*
+ * enter_new_thread: go to user mode in a new thread of an existing
+ * process, calling ENTRY with the argument ARG on the stack STACK.
+ */
+void
+enter_new_thread(userptr_t arg, vaddr_t stack, vaddr_t entry)
+{
+	struct trapframe tf;
+
+	bzero(&tf, sizeof(tf));
+
+	tf.tf_status = CST_IRQMASK | CST_IEp | CST_KUp;
+	tf.tf_epc = entry;
+	tf.tf_a0 = (vaddr_t)arg;
+	tf.tf_sp = stack;
+
+	mips_usermode(&tf);
+}
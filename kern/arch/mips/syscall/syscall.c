@@ -109,6 +109,23 @@ syscall(struct trapframe *tf)
 				 (userptr_t)tf->tf_a1);
 		break;
 
+	    case SYS_nanosleep:
+		err = sys_nanosleep((const_userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_futex:
+		err = sys_futex((userptr_t)tf->tf_a0,
+				(int)tf->tf_a1,
+				(int)tf->tf_a2,
+				&retval);
+		break;
+
+	    case SYS_execv:
+		err = sys_execv((userptr_t)tf->tf_a0,
+				(userptr_t)tf->tf_a1);
+		break;
+
 	    /* Add stuff here */
 #if OPT_C2
 	    case SYS_write:
@@ -144,11 +161,10 @@ syscall(struct trapframe *tf)
  	        sys__exit((int)tf->tf_a0);
                 break;
 	    case SYS_waitpid:
-	        retval = sys_waitpid((pid_t)tf->tf_a0,
+	        err = sys_waitpid((pid_t)tf->tf_a0,
 				(userptr_t)tf->tf_a1,
-				(int)tf->tf_a2);
-                if (retval<0) err = ENOSYS; 
-		else err = 0;
+				(int)tf->tf_a2,
+				&retval);
                 break;
 	    case SYS_getpid:
 	        retval = sys_getpid();
@@ -158,6 +174,38 @@ syscall(struct trapframe *tf)
 	    case SYS_fork:
 	        err = sys_fork(tf,&retval);
                 break;
+	    case SYS_vfork:
+	        err = sys_vfork(tf,&retval);
+                break;
+	    case SYS_thread_create:
+	        err = sys_thread_create((userptr_t)tf->tf_a0,
+					(userptr_t)tf->tf_a1,
+					&retval);
+                break;
+	    case SYS_thread_exit:
+	        sys_thread_exit();
+                break;
+	    case SYS_spawn:
+	        err = sys_spawn((userptr_t)tf->tf_a0,
+				(userptr_t)tf->tf_a1,
+				(userptr_t)tf->tf_a2,
+				(unsigned)tf->tf_a3,
+				&retval);
+                break;
+	    case SYS_setpriority:
+	        err = sys_setpriority((int)tf->tf_a0,
+				      (pid_t)tf->tf_a1,
+				      (int)tf->tf_a2);
+                break;
+	    case SYS_getpriority:
+	        err = sys_getpriority((int)tf->tf_a0,
+				      (pid_t)tf->tf_a1,
+				      &retval);
+                break;
+	    case SYS_getrusage:
+	        err = sys_getrusage((int)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+                break;
 #endif
 
 	    default:
@@ -209,6 +257,7 @@ enter_forked_process(struct trapframe *tf)
 #if OPT_C2
 	// Duplicate frame so it's on stack
 	struct trapframe forkedTf = *tf; // copy trap frame onto kernel stack
+	kfree(tf); // the parent's copy was made for us with kmalloc
 
 	forkedTf.tf_v0 = 0; // return value is 0
         forkedTf.tf_a3 = 0; // return with success
@@ -65,6 +65,21 @@
  */
 #define DUMBVM_WITH_FREE 1
 
+/*
+ * Stacks for extra threads of a process: 16k each, one after the
+ * other downwards from the bottom of the first thread's stack. The
+ * memory for one is allocated when it is first used and kept until
+ * the address space goes away, so no other cpu can be left with a
+ * TLB entry for a page that's been freed.
+ */
+#define DUMBVM_TSTACKPAGES   4
+
+static void dumbvm_tstack_init(struct addrspace *as);
+static void dumbvm_tstack_cleanup(struct addrspace *as);
+static int dumbvm_tstack_copy(struct addrspace *old, struct addrspace *new);
+static bool dumbvm_tstack_fault(struct addrspace *as, vaddr_t faultaddress,
+				paddr_t *paddr);
+
 /*
  * Wrap ram_stealmem in a spinlock.
  */
@@ -310,6 +325,9 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	else if (faultaddress >= stackbase && faultaddress < stacktop) {
 		paddr = (faultaddress - stackbase) + as->as_stackpbase;
 	}
+	else if (dumbvm_tstack_fault(as, faultaddress, &paddr)) {
+		/* a thread stack; paddr is set */
+	}
 	else {
 		return EFAULT;
 	}
@@ -353,6 +371,7 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
+	dumbvm_tstack_init(as);
 
 	return as;
 }
@@ -362,6 +381,7 @@ void as_destroy(struct addrspace *as){
   freeppages(as->as_pbase1, as->as_npages1);
   freeppages(as->as_pbase2, as->as_npages2);
   freeppages(as->as_stackpbase, DUMBVM_STACKPAGES);
+  dumbvm_tstack_cleanup(as);
   kfree(as);
 }
 
@@ -527,6 +547,11 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
 
+	if (dumbvm_tstack_copy(old, new)) {
+		as_destroy(new);
+		return ENOMEM;
+	}
+
 	*ret = new;
 	return 0;
 }
@@ -678,6 +703,9 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	else if (faultaddress >= stackbase && faultaddress < stacktop) {
 		paddr = (faultaddress - stackbase) + as->as_stackpbase;
 	}
+	else if (dumbvm_tstack_fault(as, faultaddress, &paddr)) {
+		/* a thread stack; paddr is set */
+	}
 	else {
 		return EFAULT;
 	}
@@ -721,6 +749,7 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
+	dumbvm_tstack_init(as);
 
 	return as;
 }
@@ -729,6 +758,7 @@ void
 as_destroy(struct addrspace *as)
 {
 	dumbvm_can_sleep();
+	dumbvm_tstack_cleanup(as);
 	kfree(as);
 }
 
@@ -894,8 +924,156 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
 
+	if (dumbvm_tstack_copy(old, new)) {
+		as_destroy(new);
+		return ENOMEM;
+	}
+
 	*ret = new;
 	return 0;
 }
 
 #endif
+
+/*
+ * Thread stacks. These are the same with or without DUMBVM_WITH_FREE.
+ */
+
+static
+vaddr_t
+dumbvm_tstack_base(int slot)
+{
+	return USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE
+		- (slot + 1) * DUMBVM_TSTACKPAGES * PAGE_SIZE;
+}
+
+static
+void
+dumbvm_tstack_init(struct addrspace *as)
+{
+	int i;
+
+	spinlock_init(&as->as_tstacklock);
+	for (i=0; i<DUMBVM_MAXTSTACKS; i++) {
+		as->as_tstackused[i] = false;
+		as->as_tstackpbase[i] = 0;
+	}
+}
+
+static
+void
+dumbvm_tstack_cleanup(struct addrspace *as)
+{
+	int i;
+
+	for (i=0; i<DUMBVM_MAXTSTACKS; i++) {
+		if (as->as_tstackpbase[i] != 0) {
+#if DUMBVM_WITH_FREE
+			freeppages(as->as_tstackpbase[i], DUMBVM_TSTACKPAGES);
+#endif
+			as->as_tstackpbase[i] = 0;
+		}
+	}
+	spinlock_cleanup(&as->as_tstacklock);
+}
+
+/*
+ * Copy the thread stacks that are in use, for fork (which might be
+ * called from any thread). Only the forking thread goes on to use its
+ * copy; the others stay taken until the address space goes away.
+ */
+static
+int
+dumbvm_tstack_copy(struct addrspace *old, struct addrspace *new)
+{
+	int i;
+
+	for (i=0; i<DUMBVM_MAXTSTACKS; i++) {
+		if (!old->as_tstackused[i] || old->as_tstackpbase[i] == 0) {
+			continue;
+		}
+		new->as_tstackpbase[i] = getppages(DUMBVM_TSTACKPAGES);
+		if (new->as_tstackpbase[i] == 0) {
+			return ENOMEM;
+		}
+		new->as_tstackused[i] = true;
+		memmove((void *)PADDR_TO_KVADDR(new->as_tstackpbase[i]),
+			(const void *)PADDR_TO_KVADDR(old->as_tstackpbase[i]),
+			DUMBVM_TSTACKPAGES*PAGE_SIZE);
+	}
+	return 0;
+}
+
+/*
+ * Find the physical address for FAULTADDRESS if it's in a thread
+ * stack. Returns false if it isn't.
+ */
+static
+bool
+dumbvm_tstack_fault(struct addrspace *as, vaddr_t faultaddress,
+		    paddr_t *paddr)
+{
+	vaddr_t bottom, base;
+	int slot;
+
+	bottom = dumbvm_tstack_base(DUMBVM_MAXTSTACKS - 1);
+	if (faultaddress < bottom || faultaddress >= dumbvm_tstack_base(-1)) {
+		return false;
+	}
+	slot = (dumbvm_tstack_base(-1) - 1 - faultaddress)
+		/ (DUMBVM_TSTACKPAGES * PAGE_SIZE);
+	if (as->as_tstackpbase[slot] == 0) {
+		return false;
+	}
+	base = dumbvm_tstack_base(slot);
+	*paddr = (faultaddress - base) + as->as_tstackpbase[slot];
+	return true;
+}
+
+int
+as_define_tstack(struct addrspace *as, int *slotret, vaddr_t *stackptr)
+{
+	paddr_t pbase;
+	int slot;
+
+	dumbvm_can_sleep();
+
+	spinlock_acquire(&as->as_tstacklock);
+	for (slot=0; slot<DUMBVM_MAXTSTACKS; slot++) {
+		if (!as->as_tstackused[slot]) {
+			as->as_tstackused[slot] = true;
+			break;
+		}
+	}
+	spinlock_release(&as->as_tstacklock);
+	if (slot == DUMBVM_MAXTSTACKS) {
+		return EAGAIN;
+	}
+
+	/* the slot is ours, so nothing else looks at its memory */
+	if (as->as_tstackpbase[slot] == 0) {
+		pbase = getppages(DUMBVM_TSTACKPAGES);
+		if (pbase == 0) {
+			as_release_tstack(as, slot);
+			return ENOMEM;
+		}
+		as->as_tstackpbase[slot] = pbase;
+	}
+	as_zero_region(as->as_tstackpbase[slot], DUMBVM_TSTACKPAGES);
+
+	*slotret = slot;
+	/* (the top of one stack is the base of the one above) */
+	*stackptr = dumbvm_tstack_base(slot - 1);
+	return 0;
+}
+
+void
+as_release_tstack(struct addrspace *as, int slot)
+{
+	KASSERT(slot >= 0 && slot < DUMBVM_MAXTSTACKS);
+
+	spinlock_acquire(&as->as_tstacklock);
+	KASSERT(as->as_tstackused[slot]);
+	as->as_tstackused[slot] = false;
+	spinlock_release(&as->as_tstacklock);
+}
@@ -53,6 +53,11 @@
  */
 #define CPU_FREQUENCY 25000000 /* 25 MHz */
 
+/* Wiring of LAMEbus interrupts to bits in the cause register */
+#define LAMEBUS_IRQ_BIT  0x00000400	/* all system bus slots */
+#define LAMEBUS_IPI_BIT  0x00000800	/* inter-processor interrupt */
+#define MIPS_TIMER_BIT   0x00008000	/* on-chip timer */
+
 /*
  * Access to the on-chip timer.
  *
@@ -76,6 +81,71 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Reset the cycle counter, so a new c0_compare value takes effect as
+ * an interval from now.
+ */
+static
+void
+mips_timer_reset(void)
+{
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mtc0 $0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		);
+}
+
+/*
+ * Read the cycle counter. It restarts from 0 whenever it reaches
+ * c0_compare, so this is the number of cycles since the last timer
+ * interrupt or mips_timer_reset.
+ */
+static
+uint32_t
+mips_timer_get(void)
+{
+	uint32_t count;
+
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
+/*
+ * Read the cause register, to see if a timer interrupt is pending.
+ */
+static
+uint32_t
+mips_cause_get(void)
+{
+	uint32_t cause;
+
+	/* $13 == c0_cause */
+	__asm volatile("mfc0 %0, $13" : "=r" (cause));
+	return cause;
+}
+
+/*
+ * The longest interval the on-chip timer can be set to; used for
+ * turning it "off". At 25 MHz this is nearly three minutes.
+ */
+#define MIPS_TIMER_OFF	0xffffffff
+
+/*
+ * The interval the current cpu's timer is set to, which is how far
+ * the cycle counter gets before it restarts from 0.
+ */
+#define MIPS_TIMER_INTERVAL() \
+	(curcpu->c_tickstopped ? MIPS_TIMER_OFF : CPU_FREQUENCY / HZ)
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -119,6 +189,64 @@ mainbus_bootstrap(void)
 	mips_timer_set(CPU_FREQUENCY / HZ);
 }
 
+/*
+ * Turn the on-chip timer of the current cpu on and off. Called with
+ * interrupts off.
+ */
+void
+mainbus_hardclock_start(void)
+{
+	/* keep mainbus_cycles counting across the reset */
+	curcpu->c_cyclebase += mips_timer_get();
+	mips_timer_reset();
+	mips_timer_set(CPU_FREQUENCY / HZ);
+}
+
+void
+mainbus_hardclock_stop(void)
+{
+	mips_timer_set(MIPS_TIMER_OFF);
+}
+
+unsigned
+mainbus_hardclock_elapsed(void)
+{
+	return mips_timer_get() / (CPU_FREQUENCY / HZ);
+}
+
+/*
+ * The cycle counter restarts from 0 on every timer interrupt (and in
+ * mainbus_hardclock_start); c_cyclebase adds up the cycles counted
+ * before each restart. If the counter has restarted but the interrupt
+ * hasn't been taken yet, because interrupts are off, count the
+ * interval it finished here.
+ */
+uint64_t
+mainbus_cycles(void)
+{
+	uint64_t base;
+	uint32_t count;
+
+	KASSERT(curthread->t_curspl > 0);
+
+	base = curcpu->c_cyclebase;
+	count = mips_timer_get();
+	if (mips_cause_get() & MIPS_TIMER_BIT) {
+		/* read again, in case it restarted after the first read */
+		count = mips_timer_get();
+		base += MIPS_TIMER_INTERVAL();
+	}
+	return base + count;
+}
+
+void
+mainbus_cycles_to_time(uint64_t cycles, struct timespec *ts)
+{
+	ts->tv_sec = cycles / CPU_FREQUENCY;
+	ts->tv_nsec = (cycles % CPU_FREQUENCY) *
+		(1000000000 / CPU_FREQUENCY);
+}
+
 /*
  * Start all secondary CPUs.
  */
@@ -289,11 +417,6 @@ mainbus_debugger(void)
  * Interrupt dispatcher.
  */
 
-/* Wiring of LAMEbus interrupts to bits in the cause register */
-#define LAMEBUS_IRQ_BIT  0x00000400	/* all system bus slots */
-#define LAMEBUS_IPI_BIT  0x00000800	/* inter-processor interrupt */
-#define MIPS_TIMER_BIT   0x00008000	/* on-chip timer */
-
 void
 mainbus_interrupt(struct trapframe *tf)
 {
@@ -314,8 +437,15 @@ mainbus_interrupt(struct trapframe *tf)
 		seen = true;
 	}
 	if (cause & MIPS_TIMER_BIT) {
+		/* The cycle counter restarted (see mainbus_cycles) */
+		curcpu->c_cyclebase += MIPS_TIMER_INTERVAL();
 		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
+		if (curcpu->c_tickstopped) {
+			mips_timer_set(MIPS_TIMER_OFF);
+		}
+		else {
+			mips_timer_set(CPU_FREQUENCY / HZ);
+		}
 		/* and call hardclock */
 		hardclock();
 		seen = true;
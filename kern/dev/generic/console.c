@@ -49,12 +49,14 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
 #include <lib.h>
 #include <uio.h>
 #include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <proc.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -133,6 +135,22 @@ putch_intr(struct con_softc *cs, int ch)
 	cs->cs_send(cs->cs_devdata, ch);
 }
 
+/*
+ * Take the next character out of the input buffer. The caller has
+ * already done P on cs_rsem for it.
+ */
+static
+char
+getch_take(struct con_softc *cs)
+{
+	char ret;
+
+	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
+	cs->cs_gotchars_tail =
+		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+	return ret;
+}
+
 /*
  * Read a character, using interrupts to wait for I/O completion.
  */
@@ -143,12 +161,40 @@ getch_intr(struct con_softc *cs)
 	unsigned char ret;
 
 	P(cs->cs_rsem);
-	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
-	cs->cs_gotchars_tail =
-		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+	ret = getch_take(cs);
 	return ret;
 }
 
+#if OPT_C2
+/*
+ * How often a user read waiting for input checks whether its process
+ * is exiting (in ns).
+ */
+#define CON_EXITCHECK	100000000
+
+/*
+ * Like getch_intr, for a read from userland: give up with EINTR if
+ * another thread of the process calls _exit meanwhile. Nothing wakes
+ * the semaphore for that, so wake up every so often to check.
+ */
+static
+int
+getch_intr_user(struct con_softc *cs, char *ret)
+{
+	struct timespec check;
+
+	check.tv_sec = 0;
+	check.tv_nsec = CON_EXITCHECK;
+	while (P_timed(cs->cs_rsem, &check)) {
+		if (curproc->p_exiting) {
+			return EINTR;
+		}
+	}
+	*ret = getch_take(cs);
+	return 0;
+}
+#endif
+
 /*
  * Called from underlying device when a read-ready interrupt occurs.
  *
@@ -225,6 +271,18 @@ getch(void)
 	return getch_intr(cs);
 }
 
+#if OPT_C2
+int
+getch_user(char *ret)
+{
+	struct con_softc *cs = the_console;
+	KASSERT(cs != NULL);
+	KASSERT(!curthread->t_in_interrupt && curthread->t_iplhigh_count == 0);
+
+	return getch_intr_user(cs, ret);
+}
+#endif
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -262,7 +320,16 @@ con_io(struct device *dev, struct uio *uio)
 
 	while (uio->uio_resid > 0) {
 		if (uio->uio_rw==UIO_READ) {
+#if OPT_C2
+			KASSERT(the_console != NULL);
+			result = getch_intr_user(the_console, &ch);
+			if (result) {
+				lock_release(lk);
+				return result;
+			}
+#else
 			ch = getch();
+#endif
 			if (ch=='\r') {
 				ch = '\n';
 			}
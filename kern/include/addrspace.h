@@ -36,10 +36,16 @@
 
 
 #include <vm.h>
+#include <spinlock.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
 
+#if OPT_DUMBVM
+/* Stacks for threads other than the first, below the first one's */
+#define DUMBVM_MAXTSTACKS    32
+#endif
+
 
 /*
  * Address space - data structure associated with the virtual memory
@@ -57,6 +63,9 @@ struct addrspace {
         paddr_t as_pbase2;
         size_t as_npages2;
         paddr_t as_stackpbase;
+        struct spinlock as_tstacklock;   /* for as_tstackused */
+        bool as_tstackused[DUMBVM_MAXTSTACKS];
+        paddr_t as_tstackpbase[DUMBVM_MAXTSTACKS]; /* 0 until first used */
 #else
         /* Put stuff here for your VM system */
 #endif
@@ -99,6 +108,13 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_define_tstack - set up a stack for another thread of the
+ *                process. Hands back a number for the stack and its
+ *                initial stack pointer.
+ *
+ *    as_release_tstack - the thread using stack number SLOT is done
+ *                with it. It may be reused.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -117,6 +133,9 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_tstack(struct addrspace *as, int *slotret,
+                                   vaddr_t *initstackptr);
+void              as_release_tstack(struct addrspace *as, int slot);
 
 
 /*
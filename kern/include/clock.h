@@ -35,15 +35,25 @@
  */
 
 #include <kern/time.h>
+#include "opt-tickless.h"
+#include "opt-hz250.h"
+#include "opt-hz1000.h"
 
 
 /*
  * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * when the CPU is not idle, for scheduling. With the tickless option,
+ * it is called only while the CPU has more than one thread to run.
  */
 
-/* hardclocks per second */
+/* hardclocks per second, chosen by kernel config options */
+#if OPT_HZ1000
+#define HZ  1000
+#elif OPT_HZ250
+#define HZ  250
+#else
 #define HZ  100
+#endif
 
 void hardclock_bootstrap(void);
 void hardclock(void);
@@ -55,9 +65,12 @@ void hardclock(void);
 void timerclock(void);
 
 /*
- * gettime() may be used to fetch the current time of day.
+ * gettime() may be used to fetch the current time of day, once
+ * gettime_available() returns true (that is, once the clock device
+ * has been attached).
  */
 void gettime(struct timespec *ret);
+bool gettime_available(void);
 
 /*
  * arithmetic on times
@@ -79,5 +92,82 @@ void timespec_sub(const struct timespec *t1,
  */
 void clocksleep(int seconds);
 
+/*
+ * One-shot timers, run from hardclock() on CPU 0. They expire at the
+ * first hardclock at or after the requested time of day, so they are
+ * accurate to a tick.
+ *
+ * A struct timer is supplied by the caller, usually embedded in some
+ * other structure, and set up with timer_init. FUNC is called with
+ * DATA when the timer expires, in interrupt context and without any
+ * timer-internal locks held; it must not sleep.
+ *
+ * timer_start arms the timer to expire at absolute time WHEN (as per
+ * gettime); it must not already be pending.
+ *
+ * timer_stop disarms the timer if it is pending and returns true;
+ * the function is then not called. If it returns false the timer had
+ * already expired, and the function may still be running on another
+ * CPU.
+ *
+ * timer_anypending returns true if any timer is pending; it is only
+ * a hint, for the scheduler.
+ *
+ * thread_sleep_until suspends the current thread until time WHEN.
+ */
+struct timer {
+	uint64_t tm_tick;		/* Tick number to expire at */
+	bool tm_pending;		/* True while on the timer wheel */
+	void (*tm_func)(void *);	/* Called on expiry, or NULL */
+	void *tm_data;			/* Argument for tm_func */
+	struct timer *tm_next;		/* Timer wheel linkage */
+	struct timer *tm_prev;
+};
+
+void timer_init(struct timer *tm, void (*func)(void *), void *data);
+void timer_start(struct timer *tm, const struct timespec *when);
+bool timer_stop(struct timer *tm);
+bool timer_anypending(void);
+
+void thread_sleep_until(const struct timespec *when);
+
+/*
+ * CPU time accounting.
+ *
+ * Each CPU is always in one of the CPUSTATE_* states below, and
+ * cputime_enter is called at each change of state: by the trap code
+ * on entry and exit, and by thread_switch. It charges the time since
+ * the previous change to the CPU, and (unless the CPU is idle) to its
+ * current thread, according to the old state; it then returns the old
+ * state so the caller can go back to it later.
+ *
+ * Interrupt time is charged to whichever thread was interrupted.
+ * Idle time is charged only to the CPU.
+ *
+ * Times are kept in cycles of the CPU's cycle counter (see
+ * mainbus_cycles), since this happens on every trap and switch and
+ * reading the real-time clock is much slower. cputime_totime converts
+ * them when they're reported.
+ *
+ * cputimes_add adds the times and counts in CT to TOTAL.
+ */
+#define CPUSTATE_USER	0	/* Running user code */
+#define CPUSTATE_SYS	1	/* Running in the kernel */
+#define CPUSTATE_INTR	2	/* Handling an interrupt */
+#define CPUSTATE_IDLE	3	/* Idle */
+
+struct cputimes {
+	uint64_t ct_ucycles;		/* Time in user mode */
+	uint64_t ct_scycles;		/* Time in the kernel */
+	uint64_t ct_icycles;		/* Time handling interrupts */
+	unsigned ct_nvcsw;		/* Voluntary context switches */
+	unsigned ct_nivcsw;		/* Involuntary context switches */
+};
+
+void cputimes_init(struct cputimes *ct);
+void cputimes_add(struct cputimes *total, const struct cputimes *ct);
+int cputime_enter(int state);
+void cputime_totime(uint64_t cycles, struct timespec *ts);
+
 
 #endif /* _CLOCK_H_ */
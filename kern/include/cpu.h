@@ -33,6 +33,7 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
+#include <clock.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
@@ -59,14 +60,29 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_threadcache; /* Exited threads for reuse */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_lastschedule;	/* c_hardclocks at last schedule() */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	uint64_t c_cyclebase;		/* See mainbus_cycles */
+	struct cputimes c_times;	/* Time used, see cputime_enter */
+	uint64_t c_idlecycles;		/* Time spent idle */
+	uint64_t c_acctstamp;		/* Time of last cputime_enter */
+	int c_cpustate;			/* Current CPUSTATE_* */
+
+	/*
+	 * Written only by this cpu; read by others without locking.
+	 */
+	volatile unsigned c_rcu_qs;	/* Quiescent states, for rcu.c */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
+	bool c_tickstopped;		/* True if hardclock is turned off */
+	bool c_tickbusy;		/* Busy with hardclock off, since: */
+	unsigned c_tickbusystart;	/* (see mainbus_hardclock_elapsed) */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
 
@@ -92,6 +108,11 @@ struct cpu {
 	 * Accessed by other cpus. Protected inside hangman.c.
 	 */
 	HANGMAN_ACTOR(c_hangman);
+
+	/*
+	 * Accessed by other cpus. Protected inside workqueue.c.
+	 */
+	struct workqueue *c_workqueue;
 };
 
 /*
@@ -112,6 +133,14 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * cpu_count returns the number of cpus, and cpu_bynumber the one whose
+ * c_number is NUM. The set of cpus is fixed once they've been started
+ * by thread_start_cpus.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_bynumber(unsigned num);
+
 /*
  * Produce a string describing the CPU type.
  */
@@ -33,37 +33,76 @@
 /*
  * Simple deadlock detector. Enable with "options hangman" in the
  * kernel config.
+ *
+ * Actors (cpus for spinlocks, threads for sleep locks) hold and wait
+ * for lockables. When an actor is about to wait for a lockable that
+ * is held, hangman follows the chain of holders and what they are
+ * waiting for, and panics if it leads back to the actor. Nothing is
+ * locked on the uncontended path, so it's cheap enough to leave on.
+ *
+ * Sleep locks and CVs are also "ordered" lockables: hangman keeps a
+ * graph of the order they are taken in, and warns the first time a
+ * new edge closes a cycle, that is, about lock order reversals that
+ * could deadlock but may not have yet. Edges are cached, so after the
+ * first time each pair of locks is seen this costs a hash lookup.
+ * For CVs, waiting while holding L means L comes before the CV, and
+ * signalling while holding L means the CV comes before L. Spinlocks
+ * are not ordered; they are taken far too often.
  */
 
 #include "opt-hangman.h"
 
 #if OPT_HANGMAN
 
+#define HANGMAN_MAXHELD		16	/* Ordered lockables tracked per actor */
+
+struct hangman_edge;	/* Opaque */
+
 struct hangman_actor {
 	const char *a_name;
-	const struct hangman_lockable *a_waiting;
+	const struct hangman_lockable *volatile a_waiting;
+	struct hangman_lockable *a_held[HANGMAN_MAXHELD]; /* Ordered, held */
+	unsigned a_numheld;
 };
 
 struct hangman_lockable {
 	const char *l_name;
-	const struct hangman_actor *l_holding;
+	const struct hangman_actor *volatile l_holding;
+	bool l_ordered;			/* In the lock order graph */
+	struct hangman_edge *l_after;	/* Edges to things taken after */
+	struct hangman_edge *l_before;	/* Edges from things taken before */
+	unsigned l_visit;		/* Graph search generation */
+	struct hangman_edge *l_visitedge; /* How the search got here */
 };
 
+void hangman_actorinit(struct hangman_actor *a, const char *name);
+void hangman_lockableinit(struct hangman_lockable *l, const char *name,
+			  bool ordered);
+void hangman_forget(struct hangman_lockable *l);
+
 void hangman_wait(struct hangman_actor *a, struct hangman_lockable *l);
 void hangman_acquire(struct hangman_actor *a, struct hangman_lockable *l);
 void hangman_release(struct hangman_actor *a, struct hangman_lockable *l);
+void hangman_waitevent(struct hangman_actor *a, struct hangman_lockable *l,
+		       const struct hangman_lockable *released);
+void hangman_signal(struct hangman_actor *a, struct hangman_lockable *l);
 
 #define HANGMAN_ACTOR(sym)	struct hangman_actor sym
 #define HANGMAN_LOCKABLE(sym)	struct hangman_lockable sym
 
-#define HANGMAN_ACTORINIT(a, n)	    ((a)->a_name = (n), (a)->a_waiting = NULL)
-#define HANGMAN_LOCKABLEINIT(l, n)  ((l)->l_name = (n), (l)->l_holding = NULL)
+#define HANGMAN_ACTORINIT(a, n)	    hangman_actorinit(a, n)
+#define HANGMAN_LOCKABLEINIT(l, n)  hangman_lockableinit(l, n, false)
+#define HANGMAN_ORDEREDINIT(l, n)   hangman_lockableinit(l, n, true)
+#define HANGMAN_FORGET(l)	    hangman_forget(l)
 
-#define HANGMAN_LOCKABLE_INITIALIZER	{ "spinlock", NULL }
+#define HANGMAN_LOCKABLE_INITIALIZER \
+	{ "spinlock", NULL, false, NULL, NULL, 0, NULL }
 
 #define HANGMAN_WAIT(a, l)	hangman_wait(a, l)
 #define HANGMAN_ACQUIRE(a, l)	hangman_acquire(a, l)
 #define HANGMAN_RELEASE(a, l)	hangman_release(a, l)
+#define HANGMAN_WAITEVENT(a, l, r) hangman_waitevent(a, l, r)
+#define HANGMAN_SIGNAL(a, l)	hangman_signal(a, l)
 
 #else
 
@@ -72,12 +111,16 @@ void hangman_release(struct hangman_actor *a, struct hangman_lockable *l);
 
 #define HANGMAN_ACTORINIT(a, name)
 #define HANGMAN_LOCKABLEINIT(a, name)
+#define HANGMAN_ORDEREDINIT(l, name)
+#define HANGMAN_FORGET(l)
 
 #define HANGMAN_LOCKABLE_INITIALIZER
 
 #define HANGMAN_WAIT(a, l)
 #define HANGMAN_ACQUIRE(a, l)
 #define HANGMAN_RELEASE(a, l)
+#define HANGMAN_WAITEVENT(a, l, r)
+#define HANGMAN_SIGNAL(a, l)
 
 #endif
 
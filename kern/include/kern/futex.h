@@ -0,0 +1,17 @@
+#ifndef _KERN_FUTEX_H_
+#define _KERN_FUTEX_H_
+
+/*
+ * Operations for futex(int *uaddr, int op, int val).
+ *
+ * FUTEX_WAIT sleeps if *uaddr still contains VAL, and fails with
+ * EAGAIN straight away if it doesn't; the check and going to sleep
+ * are atomic with respect to FUTEX_WAKE. FUTEX_WAKE wakes up to VAL
+ * threads sleeping on UADDR and returns how many it woke.
+ *
+ * Futexes are private to the process (address space) using them.
+ */
+#define FUTEX_WAIT	0
+#define FUTEX_WAKE	1
+
+#endif /* _KERN_FUTEX_H_ */
@@ -0,0 +1,32 @@
+#ifndef _KERN_SPAWN_H_
+#define _KERN_SPAWN_H_
+
+/*
+ * Definitions for spawn(path, argv, actions, nactions): create a
+ * child process running the program PATH with arguments ARGV, in one
+ * call, without copying the caller's address space.
+ *
+ * The child's file table starts as a copy of the caller's, and then
+ * the NACTIONS file actions are applied to it in order. If PATH
+ * can't be opened, or an action fails, spawn fails and no child is
+ * created; if the program then fails to load, the child exits with
+ * status 127.
+ */
+
+/* File actions. */
+#define SPAWN_CLOSE	0	/* close sa_fd */
+#define SPAWN_DUP2	1	/* make sa_fd a copy of sa_srcfd */
+#define SPAWN_OPEN	2	/* open sa_path with sa_flags as sa_fd */
+
+/* Most actions one spawn can take. */
+#define SPAWN_MAXACTIONS 16
+
+struct spawn_action {
+	int sa_action;
+	int sa_fd;
+	int sa_srcfd;		/* SPAWN_DUP2 only */
+	int sa_flags;		/* SPAWN_OPEN only */
+	const char *sa_path;	/* SPAWN_OPEN only */
+};
+
+#endif /* _KERN_SPAWN_H_ */
@@ -125,6 +125,7 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ * Likewise kheap_printprofile and resetprofile need heap profiling.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
@@ -132,6 +133,8 @@ void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_printprofile(void);
+void kheap_resetprofile(void);
 
 /*
  * C string functions.
@@ -163,6 +166,7 @@ const char *strerror(int errcode);
  */
 void putch(int ch);
 int getch(void);
+int getch_user(char *ret);	/* for userland reads; may fail (c2) */
 void beep(void);
 
 /*
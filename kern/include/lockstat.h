@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef LOCKSTAT_H
+#define LOCKSTAT_H
+
+/*
+ * Lock contention statistics. Enable with "options lockstat" in the
+ * kernel config.
+ *
+ * Each spinlock and sleep lock carries a struct lockstat naming its
+ * class. Locks with the same name and kind share a class; for each
+ * class we count acquisitions, how many of those had to wait, the
+ * spin iterations spent waiting, and the total time spent waiting
+ * for and holding the lock. The "lockstat" menu command prints the
+ * classes with the most waiting.
+ *
+ * Spinlocks are named with spinlock_setname (or initialized with
+ * SPINLOCK_NAMED_INITIALIZER); unnamed ones all count as "spinlock".
+ * Sleep locks use their own names.
+ *
+ * Compiled out, none of this takes any space or time.
+ */
+
+#include "opt-lockstat.h"
+
+#if OPT_LOCKSTAT
+
+#include <kern/time.h>
+
+/* Kinds of lock */
+#define LOCKSTAT_SPIN	0
+#define LOCKSTAT_SLEEP	1
+
+struct lockstat_class;
+
+struct lockstat {
+	const char *ls_name;		/* Class name */
+	unsigned ls_kind;		/* LOCKSTAT_SPIN or LOCKSTAT_SLEEP */
+	struct lockstat_class *ls_class;	/* Looked up on first use */
+	struct timespec ls_acquired;	/* When the holder got it */
+};
+
+void lockstat_init(struct lockstat *ls, const char *name, unsigned kind);
+void lockstat_waitstart(struct timespec *ts);
+void lockstat_acquire(struct lockstat *ls,
+		      const struct timespec *waitstart, unsigned spins);
+void lockstat_release(struct lockstat *ls);
+
+void lockstat_print(unsigned max);
+void lockstat_reset(void);
+
+#define LOCKSTAT(sym)		struct lockstat sym
+#define LOCKSTAT_INITIALIZER(name)	{ name, LOCKSTAT_SPIN, NULL, { 0, 0 } }
+
+#else
+
+#define LOCKSTAT(sym)
+
+#endif
+
+#endif /* LOCKSTAT_H */
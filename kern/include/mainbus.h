@@ -37,6 +37,7 @@
 
 struct cpu;       /* from <cpu.h> */
 struct trapframe; /* from <machine/trapframe.h> */
+struct timespec;  /* from <kern/time.h> */
 
 
 /* Initialize the system bus and probe and attach hardware devices. */
@@ -55,6 +56,28 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Start or stop the current cpu's hardclock timer. (Low-level; see
+ * the tickless option.) A stopped timer may still fire very rarely.
+ */
+void mainbus_hardclock_start(void);
+void mainbus_hardclock_stop(void);
+
+/*
+ * Number of hardclock periods since the current cpu's hardclock last
+ * ran (or was started), whether or not it is stopped. Cheap: it reads
+ * the timer, not the real-time clock.
+ */
+unsigned mainbus_hardclock_elapsed(void);
+
+/*
+ * Cycle counter of the current cpu: counts up from boot, and is
+ * cheap to read (unlike the real-time clock). Call with interrupts
+ * off. mainbus_cycles_to_time converts a number of cycles to time.
+ */
+uint64_t mainbus_cycles(void);
+void mainbus_cycles_to_time(uint64_t cycles, struct timespec *ts);
+
 /* Request breaking into the debugger, where available. */
 void mainbus_debugger(void);
 
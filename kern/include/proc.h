@@ -39,6 +39,7 @@
 #include <spinlock.h>
 #include <thread.h>
 #include <limits.h>
+#include <rcu.h>
 #include "opt-c2.h"
 
 struct addrspace;
@@ -64,9 +65,14 @@ struct vnode;
  */
 
 #if OPT_C2
-/* G.Cabodi - 2019 - implement waitpid: 
-   synch with semaphore (1) or cond.var.(0) */
-#define USE_SEMAPHORE_FOR_WAITPID 1
+/*
+ * A parent waiting for a vforked child to let go of its address
+ * space. Lives on the parent's stack.
+ */
+struct vforkwait {
+	struct proc *vw_parent;
+	bool vw_done;
+};
 #endif
 
 #if OPT_C2 
@@ -87,19 +93,28 @@ struct proc {
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
 
+	/* CPU time accounting; protected by p_lock */
+	struct cputimes p_times;	/* time used by exited threads */
+	struct cputimes p_ctimes;	/* time used by waited-for children */
+
 	/* add more material here as needed */
 #if OPT_C2
         /* G.Cabodi - 2019 - implement waitpid: synchro, and exit status */
 		struct thread_node *p_thread_list; //head of the list of threads 
         int p_status;                   /* status as obtained by exit() */
         pid_t p_pid;                    /* process pid */
-#if USE_SEMAPHORE_FOR_WAITPID
-	struct semaphore *p_sem;
-#else
-        struct cv *p_cv;
-        struct lock *p_lock;
-#endif
+
+	/* Family; protected by the family lock in proc.c */
+	struct proc *p_parent;		/* NULL if orphaned or kernel */
+	struct proc *p_children;	/* live children */
+	struct proc *p_zombies;		/* exited children not yet waited */
+	struct proc *p_sibling;		/* next on parent's list */
+	bool p_exited;			/* has called proc_exit */
+	struct vforkwait *p_vfork;	/* parent, if using its addrspace */
+	bool p_exiting;			/* _exit called; protected by p_lock */
+	struct spinlock p_filelock;	/* Lock for fileTable */
 	struct openfile *fileTable[OPEN_MAX];
+	struct rcu_head p_rcu;		/* for freeing, see proc_destroy */
 #endif
 };
 
@@ -110,7 +125,7 @@ extern struct proc *kproc;
 void proc_bootstrap(void);
 
 /* Create a fresh process for use by runprogram(). */
-struct proc *proc_create_runprogram(const char *name);
+int proc_create_runprogram(const char *name, struct proc **ret);
 
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
@@ -118,8 +133,8 @@ void proc_destroy(struct proc *proc);
 /* Attach a thread to a process. Must not already have a process. */
 int proc_addthread(struct proc *proc, struct thread *t);
 
-/* Detach a thread from its process. */
-void proc_remthread(struct thread *t);
+/* Detach a thread from its process. Returns how many are left. */
+unsigned proc_remthread(struct thread *t);
 
 /* Fetch the address space of the current process. */
 struct addrspace *proc_getas(void);
@@ -130,10 +145,19 @@ struct addrspace *proc_setas(struct addrspace *);
 /* wait for process termination, and return exit status */
 #if OPT_C2
 int proc_wait(struct proc *proc);
+/* wait for a child of the current process, as per waitpid() */
+int proc_waitpid(pid_t pid, int options, pid_t *retpid, int *retstatus);
+/* exit the current process, leaving a zombie for the parent */
+void proc_exit(int status);
+/* exit the current thread of a (maybe) multithreaded process */
+void proc_thread_exit(void);
+/* lend the current process's address space to a new child (vfork) */
+void proc_vfork_lend(struct proc *child, struct vforkwait *vw);
+void proc_vfork_wait(struct vforkwait *vw);
+bool proc_vfork_release(struct proc *proc);
 void proc_remove_all_threads(struct proc *p);
-/* get proc from pid */
+/* get proc from pid, in an RCU read section (see proc.c) */
 struct proc *proc_search_pid(pid_t pid);
-void proc_signal_end(struct proc *proc);
 void proc_file_table_copy(struct proc *psrc, struct proc *pdest);
 #endif
 #endif /* _PROC_H_ */
\ No newline at end of file
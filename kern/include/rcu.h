@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _RCU_H_
+#define _RCU_H_
+
+/*
+ * Read-copy-update, for read-mostly data.
+ *
+ * Readers bracket their accesses with rcu_read_lock/rcu_read_unlock
+ * and take no locks. A read section just turns interrupts off on the
+ * current cpu: it must be short and must not sleep, and the thread
+ * can't be preempted or switched out inside it.
+ *
+ * Writers serialize among themselves with an ordinary lock. To
+ * publish something, initialize it completely and then store the
+ * pointer with rcu_assign_pointer. To retire something, unlink it
+ * and call rcu_synchronize before freeing it; that waits for a grace
+ * period, after which no reader can still be looking at it.
+ *
+ * Instead of waiting, a writer can hand the freeing to rcu_call. It
+ * returns at once; FUNC(DATA) is called after a grace period, in
+ * thread context on a work queue worker. RH is supplied by the
+ * caller, usually embedded in the thing being freed, and must stay
+ * put until FUNC runs. Calls queued close together share one grace
+ * period.
+ *
+ * A grace period has passed once every other cpu has gone through a
+ * quiescent state: a context switch, an interrupt (readers keep
+ * interrupts off, so taking one means the cpu is not reading), or
+ * being idle. Each cpu counts these in c_rcu_qs.
+ */
+
+#include <spl.h>
+#include <membar.h>
+
+static inline
+int
+rcu_read_lock(void)
+{
+	return splhigh();
+}
+
+static inline
+void
+rcu_read_unlock(int spl)
+{
+	splx(spl);
+}
+
+#define rcu_assign_pointer(p, v) \
+	do { membar_store_store(); (p) = (v); } while (0)
+
+struct rcu_head {
+	void (*rh_func)(void *);	/* Function to call */
+	void *rh_data;			/* Argument for rh_func */
+	struct rcu_head *rh_next;	/* Pending list linkage */
+};
+
+void rcu_synchronize(void);
+void rcu_call(struct rcu_head *rh, void (*func)(void *), void *data);
+
+#endif /* _RCU_H_ */
@@ -37,6 +37,8 @@
 
 #include <cdefs.h>
 #include <hangman.h>
+#include <lockstat.h>
+#include "opt-ticketlock.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -54,22 +56,46 @@
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
+ *
+ * With the "ticketlock" option, spinlocks are ticket locks: splk_lock
+ * hands out tickets, and a cpu waits until splk_serving reaches its
+ * number. CPUs then get the lock in the order they asked for it,
+ * instead of whichever wins the race when it's released.
  */
 struct spinlock {
 	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
+#if OPT_TICKETLOCK
+	volatile spinlock_data_t splk_serving; /* Ticket now served. */
+#endif
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
 	HANGMAN_LOCKABLE(splk_hangman);     /* Deadlock detector hook. */
+	LOCKSTAT(splk_stat);		    /* Contention statistics. */
 };
 
 /*
- * Initializer for cases where a spinlock needs to be static or global.
+ * Initializers for cases where a spinlock needs to be static or
+ * global. The name is only used for lock statistics.
  */
-#ifdef OPT_HANGMAN
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, \
-				  HANGMAN_LOCKABLE_INITIALIZER }
+#if OPT_TICKETLOCK
+#define SPINLOCK_DATA_INITIALIZERS \
+	SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER
+#else
+#define SPINLOCK_DATA_INITIALIZERS	SPINLOCK_DATA_INITIALIZER
+#endif
+#if OPT_HANGMAN
+#define SPINLOCK_HANGMAN_INITIALIZER	, HANGMAN_LOCKABLE_INITIALIZER
+#else
+#define SPINLOCK_HANGMAN_INITIALIZER
+#endif
+#if OPT_LOCKSTAT
+#define SPINLOCK_LOCKSTAT_INITIALIZER(name)	, LOCKSTAT_INITIALIZER(name)
 #else
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_LOCKSTAT_INITIALIZER(name)
 #endif
+#define SPINLOCK_NAMED_INITIALIZER(name) \
+	{ SPINLOCK_DATA_INITIALIZERS, NULL SPINLOCK_HANGMAN_INITIALIZER \
+	  SPINLOCK_LOCKSTAT_INITIALIZER(name) }
+#define SPINLOCK_INITIALIZER	SPINLOCK_NAMED_INITIALIZER("spinlock")
 
 /*
  * Spinlock functions.
@@ -81,6 +107,10 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * setname	Name the lock for lock statistics (see lockstat.h). The
+ *		name must last as long as the lock. Does nothing unless
+ *		the lockstat option is on.
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -91,5 +121,11 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+#if OPT_LOCKSTAT
+void spinlock_setname(struct spinlock *lk, const char *name);
+#else
+#define spinlock_setname(lk, name)	((void)(lk), (void)(name))
+#endif
+
 
 #endif /* _SPINLOCK_H_ */
@@ -37,6 +37,7 @@
 
 
 #include <spinlock.h>
+#include <thread.h>
 
 /* ------------------------------------------------------------- */
 /* G.Cabodi - 2019 - implementing locks and CVs */
@@ -44,8 +45,10 @@
 #include "opt-synch.h" 
 /* 1: implement lock as a binary semaphore (+ pointer to thread) 
  * 0: lock implemented by wait channel
+ * Priority inheritance needs the wait channel version: the semaphore
+ * version has no owner to inherit while a waiter is inside P.
  */
-#define USE_SEMAPHORE_FOR_LOCK 1
+#define USE_SEMAPHORE_FOR_LOCK 0
 /* ------------------------------------------------------------- */
 
 /*
@@ -73,6 +76,16 @@ void sem_destroy(struct semaphore *);
 void P(struct semaphore *);
 void V(struct semaphore *);
 
+/*
+ * Bounded variants of P:
+ *     P_timed:  like P, but give up after waiting for TIMEOUT; returns
+ *               0 if the count was decremented, ETIMEDOUT if not.
+ *     sem_tryP: decrement the count if that can be done without
+ *               waiting; returns true if it was.
+ */
+int P_timed(struct semaphore *, const struct timespec *timeout);
+bool sem_tryP(struct semaphore *);
+
 
 /*
  * Simple lock for mutual exclusion.
@@ -94,13 +107,40 @@ struct lock {
 	struct wchan *lk_wchan;
 #endif
 	struct spinlock lk_lock;
-        volatile struct thread *lk_owner;
+        struct thread *volatile lk_owner;
+	LOCKSTAT(lk_stat);
+	HANGMAN_LOCKABLE(lk_hangman);	/* Deadlock detector hook */
+
+	/* Priority inheritance; protected by lock_pilock in synch.c */
+	unsigned lk_piwaiters[THREAD_PRI_LEVELS]; /* Waiters per level */
+	unsigned lk_nwaiters;		/* Total waiters */
+	struct lock *lk_heldnext;	/* Next in owner's t_heldlocks */
 #endif
 };
 
 struct lock *lock_create(const char *name);
 void lock_destroy(struct lock *);
 
+/*
+ * Locks are adaptive: if the lock is held by a thread that is running
+ * on another cpu, lock_acquire spins for up to lock_spinlimit
+ * iterations waiting for it to be released, on the grounds that it
+ * soon will be and that is cheaper than sleeping. It sleeps if the
+ * owner is not running or the budget runs out. Setting lock_spinlimit
+ * to 0 turns spinning off.
+ */
+#define LOCK_SPINLIMIT 1000
+extern unsigned lock_spinlimit;
+
+/*
+ * Locks do priority inheritance: while a thread waits for a lock, its
+ * holder is scheduled at least at the waiter's level, so a middling
+ * thread that keeps the cpu busy can't hold up a more important one
+ * indirectly. This follows chains: if the holder is itself waiting
+ * for another lock, that lock's holder is raised too. The holder
+ * drops back when it releases the lock.
+ */
+
 /*
  * Operations:
  *    lock_acquire - Get the lock. Only one thread can hold the lock at the
@@ -138,6 +178,7 @@ struct cv {
 #if OPT_SYNCH
 	struct wchan *cv_wchan;
 	struct spinlock cv_lock;
+	HANGMAN_LOCKABLE(cv_hangman);	/* Deadlock detector hook */
 #endif
 };
 
@@ -161,5 +202,56 @@ void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
+/*
+ * Like cv_wait, but stop waiting after TIMEOUT. The lock is
+ * re-acquired either way. Returns 0 if signalled, ETIMEDOUT if not;
+ * as with cv_wait, the caller must recheck its condition in both
+ * cases.
+ */
+int cv_timedwait(struct cv *cv, struct lock *lock,
+		 const struct timespec *timeout);
+
+
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, new readers wait
+ * too, so a steady stream of readers can't starve writers out. For
+ * the same reason a thread must not take a read lock it already
+ * holds: if a writer arrives in between, that deadlocks.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+struct rwlock {
+	char *rwlock_name;
+	struct spinlock rw_lock;	/* Protects the rest */
+	struct wchan *rw_rwchan;	/* Waiting readers sleep here */
+	struct wchan *rw_wwchan;	/* Waiting writers sleep here */
+	volatile unsigned rw_readers;	/* Readers holding the lock */
+	volatile unsigned rw_wwaiting;	/* Writers waiting for it */
+	volatile struct thread *rw_writer;	/* Writer holding it, if any */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading.
+ *    rwlock_release_read  - Free a lock held for reading.
+ *    rwlock_acquire_write - Get the lock for writing.
+ *    rwlock_release_write - Free a lock held for writing.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                   the lock for writing. (There is no equivalent for
+ *                   readers, which aren't tracked individually.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
 
 #endif /* _SYNCH_H_ */
\ No newline at end of file
@@ -36,6 +36,9 @@
 
 
 struct trapframe; /* from <machine/trapframe.h> */
+struct addrspace;
+struct proc;
+struct vnode;
 
 /*
  * The system call dispatcher.
@@ -54,6 +57,39 @@ void enter_forked_process(struct trapframe *tf);
 __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 		       vaddr_t stackptr, vaddr_t entrypoint);
 
+/* Enter user mode in a new thread of the current process. Does not return. */
+__DEAD void enter_new_thread(userptr_t arg, vaddr_t stackptr,
+			     vaddr_t entrypoint);
+
+/* Set up the futex hash table. */
+void futex_bootstrap(void);
+/* Make futex sleepers in AS recheck, as its process is exiting. */
+void futex_wakeall(struct addrspace *as);
+/* The futex operations; a null AS means UADDR is a kernel address. */
+int futex_wait(struct addrspace *as, userptr_t uaddr, int val);
+int futex_wake(struct addrspace *as, userptr_t uaddr, int max);
+
+/*
+ * Arguments for a new program: ab_argc strings packed back to back,
+ * each with its terminating NUL, in the first ab_len bytes of ab_buf.
+ */
+struct argblock {
+	char *ab_buf;
+	size_t ab_len;		/* bytes used */
+	size_t ab_size;		/* bytes allocated */
+	int ab_argc;
+};
+
+void argblock_init(struct argblock *ab);
+void argblock_cleanup(struct argblock *ab);
+int argblock_fromkernel(struct argblock *ab, int argc, char **argv);
+int argblock_fromuser(struct argblock *ab, userptr_t uargv);
+
+/* Load a program and its arguments for exec; see exec_syscalls.c. */
+int exec_load(char *progname, const struct argblock *args,
+	      struct addrspace **oldasret, vaddr_t *entrypoint,
+	      vaddr_t *stackptr, userptr_t *uargv);
+
 
 /*
  * Prototypes for IN-KERNEL entry points for system call implementations.
@@ -61,17 +97,32 @@ __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t user_req, userptr_t user_rem);
+int sys_futex(userptr_t uaddr, int op, int val, int32_t *retval);
+int sys_execv(userptr_t uprogname, userptr_t uargv);
 #if OPT_C2
 struct openfile;
 void openfileIncrRefCount(struct openfile *of);
+int filetable_close(struct proc *p, int fd);
+int filetable_dup2(struct proc *p, int oldfd, int newfd);
+int filetable_open(struct proc *p, char *path, int openflags, mode_t mode,
+		   int fd);
 int sys_open(userptr_t path, int openflags, mode_t mode, int *errp);
 int sys_close(int fd);
 int sys_write(int fd, userptr_t buf_ptr, size_t size);
 int sys_read(int fd, userptr_t buf_ptr, size_t size);
 void sys__exit(int status);
-int sys_waitpid(pid_t pid, userptr_t statusp, int options);
+int sys_waitpid(pid_t pid, userptr_t statusp, int options, pid_t *retval);
 pid_t sys_getpid(void);
 int sys_fork(struct trapframe *ctf, pid_t *retval);
+int sys_vfork(struct trapframe *ctf, pid_t *retval);
+int sys_spawn(userptr_t uprogname, userptr_t uargv, userptr_t uacts,
+	      unsigned nacts, int32_t *retval);
+int sys_thread_create(userptr_t entry, userptr_t arg, int32_t *retval);
+void sys_thread_exit(void);
+int sys_setpriority(int which, pid_t who, int prio);
+int sys_getpriority(int which, pid_t who, int32_t *retval);
+int sys_getrusage(int who, userptr_t usage);
 
 #endif
 
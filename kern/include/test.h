@@ -50,10 +50,18 @@ int threadlisttest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int threadtest4(int, char **);
+int workqueuetest(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int rwtest(int, char **);
+int pitest(int, char **);
+int timedtest(int, char **);
+int spinlocktest(int, char **);
+int proctest(int, char **);
+int futextest(int, char **);
 
 /* semaphore unit tests */
 int semu1(int, char **);
@@ -96,7 +104,7 @@ int kmalloctest4(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
-int runprogram(char *progname);
+int runprogram(char *progname, int argc, char **argv);
 
 /* Kernel menu system. */
 void menu(char *argstr);
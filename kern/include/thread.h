@@ -39,8 +39,10 @@
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
+#include <clock.h>
 
 struct cpu;
+struct lock;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -56,6 +58,21 @@ struct cpu;
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
 
+/*
+ * Scheduling priorities. The scheduler is a multi-level feedback
+ * queue with THREAD_PRI_LEVELS levels; larger numbers are more
+ * important. A thread's level drops when it uses up its time slice
+ * and rises when it wakes up from sleeping, within bounds set by its
+ * nice value (PRIO_MIN..PRIO_MAX, as for setpriority()).
+ *
+ * A thread holding a lock that more important threads are waiting
+ * for also inherits their level (see synch.c), and is scheduled at
+ * the higher of the two.
+ */
+#define THREAD_PRI_LEVELS	8
+#define THREAD_PRI_MIN		0
+#define THREAD_PRI_MAX		(THREAD_PRI_LEVELS - 1)
+
 /* States a thread can be in. */
 typedef enum {
 	S_RUN,		/* running */
@@ -83,8 +100,36 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	int t_ustack;			/* Extra user stack used, or -1 */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
+	/*
+	 * Scheduler fields. Protected by the runqueue lock of t_cpu,
+	 * except that a thread not on any list may update its own.
+	 */
+	int t_nice;			/* Niceness, PRIO_MIN..PRIO_MAX */
+	int t_priority;			/* Current feedback queue level */
+	unsigned t_quantum;		/* Hardclocks left in time slice */
+	unsigned t_lastrun;		/* t_cpu's c_hardclocks at last switch */
+	bool t_bound;			/* Never moved off t_cpu */
+	int t_inherited;		/* Level inherited through locks */
+
+	/*
+	 * Priority inheritance fields. Protected by the priority
+	 * inheritance lock in synch.c, except t_heldlocks, which only
+	 * the thread itself uses.
+	 */
+	struct lock *t_blockedon;	/* Lock we're waiting for */
+	int t_waitlevel;		/* Level we're counted at there */
+	struct lock *t_heldlocks;	/* Locks we hold */
+
+	/*
+	 * CPU time accounting fields. Updated by cputime_enter on the
+	 * cpu the thread is running on.
+	 */
+	struct cputimes t_times;	/* Time used and switch counts */
+	int t_cpustate;			/* CPUSTATE_* to resume in */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -145,6 +190,14 @@ int thread_fork(const char *name, struct proc *proc,
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2);
 
+/*
+ * Make a new kernel thread that runs only on cpu CPU. Otherwise like
+ * thread_fork.
+ */
+int thread_fork_bound(const char *name, struct cpu *cpu,
+                      void (*func)(void *, unsigned long),
+                      void *data1, unsigned long data2);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
@@ -160,16 +213,37 @@ void thread_yield(void);
 
 void thread_destroy(struct thread *thread);
 
+/*
+ * Set or get the nice value of a thread. The new value takes effect
+ * the next time the thread is queued to run.
+ */
+void thread_setnice(struct thread *t, int nice);
+int thread_getnice(struct thread *t);
+
+/*
+ * Get the level a thread is scheduled at, or set the level it has
+ * inherited through locks (THREAD_PRI_MIN for none). For synch.c.
+ */
+int thread_getpri(struct thread *t);
+void thread_setinherited(struct thread *t, int pri);
+
+/*
+ * Charge a clock tick to the current thread. Returns true if it has
+ * used up its time slice or a more important thread is waiting, in
+ * which case it should yield. Called from the timer interrupt.
+ */
+bool thread_tick(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Make sure the cpu that runs timers is taking clock interrupts.
+ * Called by the timer code; tickless option only.
  */
-void thread_consider_migration(void);
+void thread_tickstart(void);
 
 
 #endif 
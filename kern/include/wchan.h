@@ -36,6 +36,7 @@
 
 
 struct spinlock; /* in spinlock.h */
+struct timespec; /* in kern/time.h */
 struct wchan; /* Opaque */
 
 /*
@@ -66,6 +67,13 @@ bool wchan_isempty(struct wchan *wc, struct spinlock *lk);
  */
 void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Like wchan_sleep, but give up waiting at time WHEN (as per gettime)
+ * if nobody has woken us by then. Returns 0 if woken, or ETIMEDOUT.
+ */
+int wchan_sleep_until(struct wchan *wc, struct spinlock *lk,
+		      const struct timespec *when);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The associated spinlock should be locked.
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Deferred work.
+ *
+ * Each cpu has a work queue served by a fixed set of kernel worker
+ * threads bound to that cpu. A struct work describes a function call
+ * to make later, in thread context, on one of those workers; it is
+ * supplied by the caller, usually embedded in some other structure,
+ * and set up with work_init.
+ *
+ * work_submit queues W on the current cpu and work_submit_cpu on cpu
+ * CPU. Both may be called from interrupt context. They return false,
+ * and do nothing, if W is already queued. Once the function has been
+ * called the work is no longer queued and may be submitted again
+ * (including by the function itself). The queued state is protected
+ * by the queue's lock, so a work item that may be submitted from
+ * several cpus at once should always go to the same one with
+ * work_submit_cpu.
+ *
+ * Workers take everything queued at once and run it as a batch, so a
+ * burst of submissions costs at most one wakeup. Work functions may
+ * sleep, but that holds up the rest of the batch; a second worker per
+ * cpu picks up work submitted in the meantime.
+ *
+ * workqueue_bootstrap starts the workers; call it once all cpus are
+ * running.
+ */
+
+struct cpu;
+
+struct work {
+	void (*w_func)(void *);		/* Function to call */
+	void *w_data;			/* Argument for w_func */
+	struct work *w_next;		/* Queue linkage */
+	bool w_queued;			/* True while on a queue */
+};
+
+void work_init(struct work *w, void (*func)(void *), void *data);
+bool work_submit(struct work *w);
+bool work_submit_cpu(struct work *w, struct cpu *cpu);
+
+void workqueue_bootstrap(void);
+
+
+#endif /* _WORKQUEUE_H_ */
@@ -35,6 +35,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <clock.h>
+#include <cpu.h>
 #include <mainbus.h>
 #include <synch.h>
 #include <thread.h>
@@ -45,6 +46,7 @@
 #include <test.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockstat.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -62,9 +64,8 @@
  * Function for a thread that runs an arbitrary userlevel program by
  * name.
  *
- * Note: this cannot pass arguments to the program. You may wish to
- * change it so it can, because that will make testing much easier
- * in the future.
+ * The arguments, including the program name as argv[0], are passed
+ * to the program.
  *
  * It copies the program name because runprogram destroys the copy
  * it gets by passing it to vfs_open().
@@ -79,16 +80,12 @@ cmd_progthread(void *ptr, unsigned long nargs)
 
 	KASSERT(nargs >= 1);
 
-	if (nargs > 2) {
-		kprintf("Warning: argument passing from menu not supported\n");
-	}
-
 	/* Hope we fit. */
 	KASSERT(strlen(args[0]) < sizeof(progname));
 
 	strcpy(progname, args[0]);
 
-	result = runprogram(progname);
+	result = runprogram(progname, nargs, args);
 	if (result) {
 		kprintf("Running program %s failed: %s\n", args[0],
 			strerror(result));
@@ -118,9 +115,9 @@ common_prog(int nargs, char **args)
 	int result;
 
 	/* Create a process for the new program to run in. */
-	proc = proc_create_runprogram(args[0] /* name */);
-	if (proc == NULL) {
-		return ENOMEM;
+	result = proc_create_runprogram(args[0] /* name */, &proc);
+	if (result) {
+		return result;
 	}
 
 	result = thread_fork(args[0] /* thread name */,
@@ -496,6 +493,88 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapprofile(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kheap_printprofile();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		kheap_resetprofile();
+	}
+	else {
+		kprintf("Usage: khprof [reset]\n");
+	}
+
+	return 0;
+}
+
+/*
+ * Command for showing where the cpus' time has gone.
+ */
+static
+int
+cmd_cpustat(int nargs, char **args)
+{
+	struct cpu *c;
+	struct timespec ut, st, it, idle;
+	unsigned i;
+
+	(void)nargs;
+	(void)args;
+
+	/* Unlocked reads; other cpus may be updating these. */
+	kprintf("cpu       user        system      interrupt   idle"
+		"        vcsw     ivcsw\n");
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_bynumber(i);
+		cputime_totime(c->c_times.ct_ucycles, &ut);
+		cputime_totime(c->c_times.ct_scycles, &st);
+		cputime_totime(c->c_times.ct_icycles, &it);
+		cputime_totime(c->c_idlecycles, &idle);
+		kprintf("%3u %5llu.%06lu %5llu.%06lu %5llu.%06lu %5llu.%06lu"
+			" %8u %8u\n", c->c_number,
+			(unsigned long long) ut.tv_sec,
+			(unsigned long) ut.tv_nsec / 1000,
+			(unsigned long long) st.tv_sec,
+			(unsigned long) st.tv_nsec / 1000,
+			(unsigned long long) it.tv_sec,
+			(unsigned long) it.tv_nsec / 1000,
+			(unsigned long long) idle.tv_sec,
+			(unsigned long) idle.tv_nsec / 1000,
+			c->c_times.ct_nvcsw, c->c_times.ct_nivcsw);
+	}
+
+	return 0;
+}
+
+#if OPT_LOCKSTAT
+/*
+ * Command for showing the most contended locks, or clearing the
+ * counts.
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockstat_reset();
+		return 0;
+	}
+	if (nargs == 1) {
+		lockstat_print(20);
+		return 0;
+	}
+	if (nargs == 2 && atoi(args[1]) > 0) {
+		lockstat_print(atoi(args[1]));
+		return 0;
+	}
+	kprintf("Usage: lockstat [count | reset]\n");
+	return EINVAL;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -565,6 +644,8 @@ static const char *testmenu[] = {
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tt4] Fork/exit latency test        ",
+	"[wq1] Workqueue test                ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
@@ -572,6 +653,14 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy4] CV test #2            (1)     ",
+	"[sy5] RW lock test                  ",
+	"[sy6] Priority inversion test       ",
+	"[sy7] Timed wait test               ",
+	"[sp1] Spinlock contention test      ",
+	"[fx1] Futex test                    ",
+#if OPT_C2
+	"[pt1] Process table test            ",
+#endif
 	"[semu1-22] Semaphore unit tests     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
@@ -603,6 +692,11 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khprof] Kernel heap profile        ",
+	"[cpustat] CPU time accounting       ",
+#if OPT_LOCKSTAT
+	"[lockstat] Lock contention stats    ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -654,6 +748,11 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khprof",     cmd_kheapprofile },
+	{ "cpustat",    cmd_cpustat },
+#if OPT_LOCKSTAT
+	{ "lockstat",   cmd_lockstat },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -670,12 +769,22 @@ static struct {
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tt4",	threadtest4 },
+	{ "wq1",	workqueuetest },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	rwtest },
+	{ "sy6",	pitest },
+	{ "sy7",	timedtest },
+	{ "sp1",	spinlocktest },
+	{ "fx1",	futextest },
+#if OPT_C2
+	{ "pt1",	proctest },
+#endif
 
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
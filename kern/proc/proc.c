@@ -52,16 +52,83 @@
 #include <thread.h>
 
 #if OPT_C2
+#include <kern/errno.h>
+#include <kern/wait.h>
+#include <limits.h>
 #include <synch.h>
+#include <wchan.h>
+#include <cpu.h>
+#include <rcu.h>
+
+/*
+ * The process table maps pids straight to procs: slot i of the
+ * current pidmap is pid i. It starts small and doubles, up to
+ * PID_MAX, whenever it runs out of free pids; readers find the
+ * current map through processTable.map without locking (see rcu.h),
+ * and an old map is freed a grace period after being replaced.
+ *
+ * Free pids are kept in a ring, handed out from the head and given
+ * back at the tail, so allocating and freeing are O(1) and a pid is
+ * not reused until all the others free at the time have been.
+ */
+#define PIDMAP_INITSIZE 128
+
+struct pidmap {
+  unsigned pm_size;           /* number of slots; [0] not used */
+  struct proc **pm_procs;
+  struct rcu_head pm_rcu;     /* for freeing after readers are done */
+};
 
-#define MAX_PROC 100
 static struct _processTable {
-  int active;           /* initial value 0 */
-  struct proc *proc[MAX_PROC+1]; /* [0] not used. pids are >= 1 */
-  int last_i;           /* index of last allocated pid */
-  struct spinlock lk;	/* Lock for this table */
+  int active;                 /* initial value 0 */
+  struct pidmap *map;         /* current map */
+  pid_t *freering;            /* free pids, pm_size-1 of them at most */
+  unsigned freehead;          /* index of next pid to hand out */
+  unsigned nfree;             /* number of free pids in the ring */
+  struct spinlock lk;         /* Lock for all but lock-free reads of map */
 } processTable;
 
+/*
+ * Parent/child links and exit state (the p_parent, p_children,
+ * p_zombies, p_sibling and p_exited fields) are protected by one
+ * lock for the whole system. A process that exits moves from its
+ * parent's list of children to its parent's list of zombies and
+ * wakes the parent; a parent that exits gives away its live
+ * children, which then clean up after themselves when they exit,
+ * and destroys its zombies.
+ *
+ * Parents wait on a channel picked by hashing their pid, so the
+ * processes themselves need no synchronization objects; whoever
+ * shares the channel rechecks and goes back to sleep.
+ *
+ * A proc is never freed without taking the family lock, so holding
+ * it keeps any proc found with proc_search_pid alive; so does staying
+ * in the RCU read section the lookup was done in.
+ */
+#define PROC_NWAITCHANS 32
+
+static struct spinlock proc_familylock = SPINLOCK_INITIALIZER;
+static struct wchan *proc_waitchans[PROC_NWAITCHANS];
+
+static struct wchan *
+proc_waitchan(struct proc *parent) {
+  return proc_waitchans[parent->p_pid % PROC_NWAITCHANS];
+}
+
+/*
+ * Take PROC off the list starting at *LIST. Called with the family
+ * lock held.
+ */
+static void
+proc_unlink(struct proc **list, struct proc *proc) {
+  while (*list != proc) {
+    KASSERT(*list != NULL);
+    list = &(*list)->p_sibling;
+  }
+  *list = proc->p_sibling;
+  proc->p_sibling = NULL;
+}
+
 #endif
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -71,14 +138,24 @@ struct proc *kproc;
 /*
  * G.Cabodi - 2019
  * Initialize support for pid/waitpid.
+ * The table is read without locking (see rcu.h): entries are
+ * published with rcu_assign_pointer and procs are only freed a grace
+ * period after they are removed. So the caller must be in a read
+ * section, or hold a spinlock (which is as good; the family lock
+ * is one), and be done with the proc before leaving it.
  */
 struct proc *
 proc_search_pid(pid_t pid) {
 #if OPT_C2
   struct proc *p;
-  KASSERT(pid>=0&&pid<MAX_PROC);
-  p = processTable.proc[pid];
-  KASSERT(p->p_pid==pid);
+  struct pidmap *map;
+  /* interrupts off: in a read section or holding a spinlock */
+  KASSERT(curthread->t_iplhigh_count > 0);
+  /* pid comes from userland: just fail if there is no such process */
+  if (pid<=0) return NULL;
+  map = processTable.map;
+  p = (unsigned)pid < map->pm_size ? map->pm_procs[pid] : NULL;
+  KASSERT(p==NULL || p->p_pid==pid);
   return p;
 #else
   (void)pid;
@@ -86,44 +163,139 @@ proc_search_pid(pid_t pid) {
 #endif
 }
 
+#if OPT_C2
 /*
- * G.Cabodi - 2019
- * Initialize support for pid/waitpid.
+ * Make an empty pidmap with SIZE slots, and a free ring to go with
+ * it. Returns false if out of memory.
  */
+static bool
+pidmap_alloc(unsigned size, struct pidmap **mapret, pid_t **ringret) {
+  struct pidmap *map;
+  pid_t *ring;
+  unsigned i;
+
+  map = kmalloc(sizeof(*map));
+  if (map == NULL) return false;
+  map->pm_procs = kmalloc(size * sizeof(map->pm_procs[0]));
+  ring = kmalloc(size * sizeof(ring[0]));
+  if (map->pm_procs == NULL || ring == NULL) {
+    kfree(map->pm_procs);
+    kfree(ring);
+    kfree(map);
+    return false;
+  }
+  map->pm_size = size;
+  for (i=0; i<size; i++) {
+    map->pm_procs[i] = NULL;
+  }
+  *mapret = map;
+  *ringret = ring;
+  return true;
+}
+
 static void
-proc_init_waitpid(struct proc *proc, const char *name) {
-#if OPT_C2
-  /* search a free index in table using a circular strategy */
-  int i;
+pidmap_free(void *data) {
+  struct pidmap *map = data;
+  kfree(map->pm_procs);
+  kfree(map);
+}
+
+/*
+ * Double the size of the pid map, if there are still no free pids.
+ * Called without the table lock, since this allocates memory.
+ * Returns ENPROC if the map is as big as it gets, or ENOMEM.
+ */
+static int
+pidmap_grow(void) {
+  struct pidmap *old, *map;
+  pid_t *oldring, *ring;
+  unsigned i, j, size;
+
+  size = processTable.map->pm_size * 2;
+  if (size > (unsigned)PID_MAX + 1) {
+    size = (unsigned)PID_MAX + 1;
+  }
+  /* (allocated at the size seen now; checked again below) */
+  if (size <= processTable.map->pm_size) {
+    return ENPROC;
+  }
+  if (!pidmap_alloc(size, &map, &ring)) {
+    return ENOMEM;
+  }
+
   spinlock_acquire(&processTable.lk);
-  i = processTable.last_i+1;
-  proc->p_pid = 0;
-  if (i>MAX_PROC) i=1;
-  while (i!=processTable.last_i) {
-    if (processTable.proc[i] == NULL) {
-      processTable.proc[i] = proc;
-      processTable.last_i = i;
-      proc->p_pid = i;
-      break;
-    }
-    i++;
-    if (i>MAX_PROC) i=1;
+  old = processTable.map;
+  if (processTable.nfree > 0 || old->pm_size >= size) {
+    /* someone else got there first */
+    spinlock_release(&processTable.lk);
+    pidmap_free(map);
+    kfree(ring);
+    return 0;
+  }
+  for (i=0; i<old->pm_size; i++) {
+    map->pm_procs[i] = old->pm_procs[i];
+  }
+  /* the ring is empty; fill it with the new pids */
+  for (i=old->pm_size, j=0; i<size; i++, j++) {
+    ring[j] = i;
   }
+  oldring = processTable.freering;
+  processTable.freering = ring;
+  processTable.freehead = 0;
+  processTable.nfree = size - old->pm_size;
+  rcu_assign_pointer(processTable.map, map);
   spinlock_release(&processTable.lk);
-  if (proc->p_pid==0) {
-    panic("too many processes. proc table is full\n");
+
+  /* lock-free readers may still be using the old map */
+  rcu_call(&old->pm_rcu, pidmap_free, old);
+  kfree(oldring);
+  return 0;
+}
+#endif
+
+/*
+ * G.Cabodi - 2019
+ * Initialize support for pid/waitpid. Fails with ENPROC if all pids
+ * are in use.
+ */
+static int
+proc_init_waitpid(struct proc *proc) {
+#if OPT_C2
+  struct pidmap *map;
+  pid_t pid;
+  int result;
+
+  /* take the pid at the head of the free ring, growing if need be */
+  spinlock_acquire(&processTable.lk);
+  while (processTable.nfree == 0) {
+    spinlock_release(&processTable.lk);
+    result = pidmap_grow();
+    if (result) {
+      return result;
+    }
+    spinlock_acquire(&processTable.lk);
   }
+  map = processTable.map;
+  pid = processTable.freering[processTable.freehead];
+  processTable.freehead = (processTable.freehead + 1) % (map->pm_size - 1);
+  processTable.nfree--;
+  KASSERT(pid > 0 && (unsigned)pid < map->pm_size);
+  KASSERT(map->pm_procs[pid] == NULL);
+  proc->p_pid = pid;
   proc->p_status = 0;
-#if USE_SEMAPHORE_FOR_WAITPID
-  proc->p_sem = sem_create(name, 0);
-#else
-  proc->p_cv = cv_create(name);
-  proc->p_lock = lock_create(name);
-#endif
+  proc->p_parent = NULL;
+  proc->p_children = NULL;
+  proc->p_zombies = NULL;
+  proc->p_sibling = NULL;
+  proc->p_exited = false;
+  proc->p_vfork = NULL;
+  proc->p_exiting = false;
+  rcu_assign_pointer(map->pm_procs[pid], proc);
+  spinlock_release(&processTable.lk);
 #else
   (void)proc;
-  (void)name;
 #endif
+  return 0;
 }
 
 /*
@@ -133,20 +305,32 @@ proc_init_waitpid(struct proc *proc, const char *name) {
 static void
 proc_end_waitpid(struct proc *proc) {
 #if OPT_C2
-  /* remove the process from the table */
-  int i;
+  /* remove the process from the table, and put its pid on the ring */
+  struct pidmap *map;
+  unsigned tail;
+  pid_t pid;
+
+  /* leave the family; the caller must have dealt with any children */
+  spinlock_acquire(&proc_familylock);
+  KASSERT(proc->p_children == NULL && proc->p_zombies == NULL);
+  if (proc->p_parent != NULL) {
+    proc_unlink(proc->p_exited ? &proc->p_parent->p_zombies :
+		&proc->p_parent->p_children, proc);
+    proc->p_parent = NULL;
+  }
+  spinlock_release(&proc_familylock);
+
   spinlock_acquire(&processTable.lk);
-  i = proc->p_pid;
-  KASSERT(i>0 && i<=MAX_PROC);
-  processTable.proc[i] = NULL;
+  map = processTable.map;
+  pid = proc->p_pid;
+  KASSERT(pid>0 && (unsigned)pid<map->pm_size);
+  KASSERT(map->pm_procs[pid] == proc);
+  map->pm_procs[pid] = NULL;
+  KASSERT(processTable.nfree < map->pm_size - 1);
+  tail = (processTable.freehead + processTable.nfree) % (map->pm_size - 1);
+  processTable.freering[tail] = pid;
+  processTable.nfree++;
   spinlock_release(&processTable.lk);
-
-#if USE_SEMAPHORE_FOR_WAITPID
-  sem_destroy(proc->p_sem);
-#else
-  cv_destroy(proc->p_cv);
-  lock_destroy(proc->p_lock);
-#endif
 #else
   (void)proc;
 #endif
@@ -156,23 +340,25 @@ proc_end_waitpid(struct proc *proc) {
  * Create a proc structure.
  */
 static
-struct proc *
-proc_create(const char *name)
+int
+proc_create(const char *name, struct proc **ret)
 {
 	struct proc *proc;
+	int result;
 
 	proc = kmalloc(sizeof(*proc));
 	if (proc == NULL) {
-		return NULL;
+		return ENOMEM;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
 		kfree(proc);
-		return NULL;
+		return ENOMEM;
 	}
 
 	proc->p_numthreads = 0;
 	spinlock_init(&proc->p_lock);
+	spinlock_setname(&proc->p_lock, "proc");
 	proc->p_thread_list=NULL; //initialization of the thread list to NULL
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -180,11 +366,42 @@ proc_create(const char *name)
 	/* VFS fields */
 	proc->p_cwd = NULL;
 
-	proc_init_waitpid(proc,name);
+	/* Accounting fields */
+	cputimes_init(&proc->p_times);
+	cputimes_init(&proc->p_ctimes);
+
+	result = proc_init_waitpid(proc);
+	if (result) {
+		spinlock_cleanup(&proc->p_lock);
+		kfree(proc->p_name);
+		kfree(proc);
+		return result;
+	}
 #if OPT_C2
+	spinlock_init(&proc->p_filelock);
+	spinlock_setname(&proc->p_filelock, "filetable");
 	bzero(proc->fileTable,OPEN_MAX*sizeof(struct openfile *));
 #endif
-	return proc;
+	*ret = proc;
+	return 0;
+}
+
+/*
+ * Free what is left of a proc structure once proc_destroy is done
+ * with it.
+ */
+static
+void
+proc_free(void *data)
+{
+	struct proc *proc = data;
+
+	spinlock_cleanup(&proc->p_lock);
+#if OPT_C2
+	spinlock_cleanup(&proc->p_filelock);
+#endif
+	kfree(proc->p_name);
+	kfree(proc);
 }
 
 /*
@@ -268,12 +485,17 @@ proc_destroy(struct proc *proc)
 	}
 
 	KASSERT(proc->p_numthreads == 0);
-	spinlock_cleanup(&proc->p_lock);
 
 	proc_end_waitpid(proc);
-
-	kfree(proc->p_name);
-	kfree(proc);
+#if OPT_C2
+	/*
+	 * Lock-free readers that found the proc in the table may still
+	 * take p_lock; free it once they're done, without waiting here.
+	 */
+	rcu_call(&proc->p_rcu, proc_free, proc);
+#else
+	proc_free(proc);
+#endif
 }
 
 /*
@@ -282,15 +504,33 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
-	kproc = proc_create("[kernel]");
-	if (kproc == NULL) {
-		panic("proc_create for kproc failed\n");
-	}
 #if OPT_C2
+	unsigned i;
+
 	spinlock_init(&processTable.lk);
-	/* kernel process is not registered in the table */
+	spinlock_setname(&processTable.lk, "proctable");
+	if (!pidmap_alloc(PIDMAP_INITSIZE, &processTable.map,
+			  &processTable.freering)) {
+		panic("proc_bootstrap: Out of memory\n");
+	}
+	/* pids from 1; the kernel process gets the first */
+	for (i=1; i<PIDMAP_INITSIZE; i++) {
+		processTable.freering[i-1] = i;
+	}
+	processTable.freehead = 0;
+	processTable.nfree = PIDMAP_INITSIZE - 1;
 	processTable.active = 1;
+
+	for (i=0; i<PROC_NWAITCHANS; i++) {
+		proc_waitchans[i] = wchan_create("waitpid");
+		if (proc_waitchans[i] == NULL) {
+			panic("proc_bootstrap: Out of memory\n");
+		}
+	}
 #endif
+	if (proc_create("[kernel]", &kproc)) {
+		panic("proc_create for kproc failed\n");
+	}
 }
 
 
@@ -300,14 +540,15 @@ proc_bootstrap(void)
  * It will have no address space and will inherit the current
  * process's (that is, the kernel menu's) current directory.
  */
-struct proc *
-proc_create_runprogram(const char *name)
+int
+proc_create_runprogram(const char *name, struct proc **ret)
 {
 	struct proc *newproc;
+	int result;
 
-	newproc = proc_create(name);
-	if (newproc == NULL) {
-		return NULL;
+	result = proc_create(name, &newproc);
+	if (result) {
+		return result;
 	}
 
 	/* VM fields */
@@ -328,7 +569,17 @@ proc_create_runprogram(const char *name)
 	}
 	spinlock_release(&curproc->p_lock);
 
-	return newproc;
+#if OPT_C2
+	/* the new process is a child of the current one */
+	spinlock_acquire(&proc_familylock);
+	newproc->p_parent = curproc;
+	newproc->p_sibling = curproc->p_children;
+	curproc->p_children = newproc;
+	spinlock_release(&proc_familylock);
+#endif
+
+	*ret = newproc;
+	return 0;
 }
 
 /*
@@ -368,39 +619,14 @@ proc_addthread(struct proc *proc, struct thread *t)
 }
 #if OPT_C2
 /*
- * When a process has to be killed, all the associated threads must be properly removed
+ * When a process has to be killed, all the associated threads must be properly removed.
+ * The others can't be destroyed from here, as they may be running on other cpus
+ * or asleep; they leave by themselves once the process is exiting (see proc_exit).
  */
 void proc_remove_all_threads(struct proc *p) {
     KASSERT(p != NULL);
+    KASSERT(p == curproc);
 
-    while (true) {
-        spinlock_acquire(&p->p_lock);
-
-        if (p->p_numthreads == 0) {
-            spinlock_release(&p->p_lock);
-            break; // Exit if the number of threads is lower than 1
-        }
-
-        struct thread_node *current = p->p_thread_list;
-        if (current == NULL) {
-            spinlock_release(&p->p_lock);
-            break; // Terminates if the list is empty (there are no remaining threads associated to the process)
-        }
-
-        //Gets the pointer to the thread
-        struct thread *thread_to_remove = current->t;
-
-        // Removes the node from the list
-        p->p_thread_list = current->next;
-        kfree(current); //Frees the node 
-
-        //Release the lock on the proc data structure before removing the thread
-        spinlock_release(&p->p_lock);
-
-        // Terminate the removed thread
-		if(thread_to_remove != curthread)
-        	thread_destroy(thread_to_remove); //Cannot be called on the current thread or on a thread which is in running state
-    }
 	sys__exit(-1); //the process ends with an error
 }
 
@@ -414,10 +640,11 @@ void proc_remove_all_threads(struct proc *p) {
  * the timer interrupt context switch, and any other implicit uses
  * of "curproc".
  */
-void
+unsigned
 proc_remthread(struct thread *t)
 {
 	struct proc *proc;
+	unsigned left;
 	int spl;
 
 	proc = t->t_proc;
@@ -426,6 +653,9 @@ proc_remthread(struct thread *t)
 	spinlock_acquire(&proc->p_lock);
 	KASSERT(proc->p_numthreads > 0);
 	proc->p_numthreads--;
+	left = proc->p_numthreads;
+	/* keep the thread's time for getrusage */
+	cputimes_add(&proc->p_times, &t->t_times);
 #if OPT_C2
 	//thread removed from the list of threads 
 	struct thread_node *current = proc->p_thread_list; 
@@ -450,6 +680,8 @@ proc_remthread(struct thread *t)
 	spl = splhigh();
 	t->t_proc = NULL;
 	splx(spl);
+
+	return left;
 }
 
 /*
@@ -497,50 +729,337 @@ proc_setas(struct addrspace *newas)
 
 
 
+#if OPT_C2
+/*
+ * Collect the exit status of a zombie that has been taken off its
+ * parent's list, and destroy it.
+ */
+static int
+proc_reap(struct proc *proc)
+{
+  int status;
+
+  KASSERT(proc->p_exited);
+  KASSERT(proc->p_parent == NULL);
+  status = proc->p_status;
+
+  /* charge the child's time, and its children's, to the parent */
+  spinlock_acquire(&curproc->p_lock);
+  cputimes_add(&curproc->p_ctimes, &proc->p_times);
+  cputimes_add(&curproc->p_ctimes, &proc->p_ctimes);
+  spinlock_release(&curproc->p_lock);
+
+  proc_destroy(proc);
+  return status;
+}
+
+/*
+ * Take the exited child PROC off its parent's list of zombies, so it
+ * can be reaped. Called with the family lock held.
+ */
+static void
+proc_takezombie(struct proc *proc)
+{
+  KASSERT(proc->p_exited);
+  proc_unlink(&proc->p_parent->p_zombies, proc);
+  proc->p_parent = NULL;
+}
+#endif
+
         /* G.Cabodi - 2019 - support for waitpid */
 int 
 proc_wait(struct proc *proc)
 {
 #if OPT_C2
-        int return_status;
         /* NULL and kernel proc forbidden */
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
 
-        /* wait on semaphore or condition variable */ 
-#if USE_SEMAPHORE_FOR_WAITPID
-        P(proc->p_sem);
-#else
-        lock_acquire(proc->p_lock);
-        cv_wait(proc->p_cv);
-        lock_release(proc->p_lock);
-#endif
-        return_status = proc->p_status;
-        proc_destroy(proc);
-        return return_status;
+        spinlock_acquire(&proc_familylock);
+        KASSERT(proc->p_parent == curproc);
+        while (!proc->p_exited) {
+          wchan_sleep(proc_waitchan(curproc), &proc_familylock);
+        }
+        proc_takezombie(proc);
+        spinlock_release(&proc_familylock);
+
+        return proc_reap(proc);
 #else
         /* this doesn't synchronize */ 
         (void)proc;
         return 0;
 #endif
 }
+
 #if OPT_C2
+/*
+ * Wait for the child PID of the current process to exit, or for any
+ * child if PID is WAIT_ANY, and reap it. With WNOHANG, return a pid
+ * of 0 if there isn't one that has exited already.
+ */
+int
+proc_waitpid(pid_t pid, int options, pid_t *retpid, int *retstatus)
+{
+  struct proc *parent = curproc;
+  struct proc *proc;
+
+  if ((options & ~WNOHANG) != 0) {
+    return EINVAL;
+  }
+  if (pid != WAIT_ANY && pid <= 0) {
+    /* no process groups */
+    return ECHILD;
+  }
+
+  spinlock_acquire(&proc_familylock);
+  while (1) {
+    if (pid == WAIT_ANY) {
+      proc = parent->p_zombies;
+      if (proc != NULL) break;
+      if (parent->p_children == NULL) {
+	spinlock_release(&proc_familylock);
+	return ECHILD;
+      }
+    }
+    else {
+      proc = proc_search_pid(pid);
+      if (proc == NULL || proc->p_parent != parent) {
+	spinlock_release(&proc_familylock);
+	return ECHILD;
+      }
+      if (proc->p_exited) break;
+    }
+    if (options & WNOHANG) {
+      spinlock_release(&proc_familylock);
+      *retpid = 0;
+      return 0;
+    }
+    if (parent->p_exiting) {
+      /* another thread called _exit (see proc_kickthreads) */
+      spinlock_release(&proc_familylock);
+      return EINTR;
+    }
+    wchan_sleep(proc_waitchan(parent), &proc_familylock);
+  }
+  proc_takezombie(proc);
+  spinlock_release(&proc_familylock);
+
+  *retpid = proc->p_pid;
+  *retstatus = proc_reap(proc);
+  return 0;
+}
+
+/*
+ * Get the other threads of PROC, which has just started exiting, to
+ * leave. Those asleep in waitpid or on a futex are woken, and give up
+ * when they see p_exiting; the cpus of the others are interrupted, so
+ * that any in user mode come into the kernel. They all leave on their
+ * way back to user mode (see mips_trap).
+ */
+static void
+proc_kickthreads(struct proc *proc)
+{
+  struct thread_node *tn;
+  struct thread *t;
+  struct addrspace *as;
+
+  spinlock_acquire(&proc->p_lock);
+  if (proc->p_numthreads < 2) {
+    spinlock_release(&proc->p_lock);
+    return;
+  }
+  for (tn = proc->p_thread_list; tn != NULL; tn = tn->next) {
+    t = tn->t;
+    /* unlocked; a thread that moves goes through the kernel anyway */
+    if (t != curthread && t->t_cpu != curcpu->c_self) {
+      ipi_send(t->t_cpu, IPI_UNIDLE);
+    }
+  }
+  /* we're still in it, so it stays put until we're done */
+  as = proc->p_addrspace;
+  spinlock_release(&proc->p_lock);
+
+  spinlock_acquire(&proc_familylock);
+  wchan_wakeall(proc_waitchan(proc), &proc_familylock);
+  spinlock_release(&proc_familylock);
+
+  if (as != NULL) {
+    futex_wakeall(as);
+  }
+}
+
+/*
+ * Exit the current process with STATUS. The calling thread leaves at
+ * once; any others are made to leave soon after (see
+ * proc_kickthreads). The caller then does thread_exit.
+ */
 void
-proc_signal_end(struct proc *proc)
+proc_exit(int status)
 {
-#if USE_SEMAPHORE_FOR_WAITPID
-      V(proc->p_sem);
-#else
-      lock_acquire(proc->p_lock);
-      cv_signal(proc->p_cv);
-      lock_release(proc->p_lock);
-#endif
+  struct proc *proc = curproc;
+  bool first = false;
+
+  KASSERT(proc != kproc);
+
+  spinlock_acquire(&proc->p_lock);
+  if (!proc->p_exiting) {
+    proc->p_exiting = true;
+    proc->p_status = status;
+    first = true;
+  }
+  spinlock_release(&proc->p_lock);
+
+  if (first) {
+    proc_kickthreads(proc);
+  }
+  proc_thread_exit();
+}
+
+/*
+ * The current thread leaves its process. The last one to leave takes
+ * the process down: the files and address space go now, and what's
+ * left of the process stays as a zombie until the parent waits for
+ * it, or is destroyed at once if there's no parent. If nobody called
+ * _exit, the exit status is 0. The caller then does thread_exit.
+ */
+void
+proc_thread_exit(void)
+{
+  struct proc *proc = curproc;
+  struct proc *child, *zombies, *parent;
+  struct addrspace *as;
+  int fd;
+
+  KASSERT(proc != kproc);
+
+  /* give back our user stack, if it isn't the first thread's */
+  if (curthread->t_ustack >= 0) {
+    as_release_tstack(proc->p_addrspace, curthread->t_ustack);
+    curthread->t_ustack = -1;
+  }
+
+  if (proc_remthread(curthread) > 0) {
+    /* not the last one */
+    return;
+  }
+
+  spinlock_acquire(&proc->p_lock);
+  if (!proc->p_exiting) {
+    proc->p_exiting = true;
+    proc->p_status = 0;
+  }
+  as = proc->p_addrspace;
+  proc->p_addrspace = NULL;
+  spinlock_release(&proc->p_lock);
+
+  /* the zombie doesn't need its memory, unless it's borrowed */
+  as_deactivate();
+  if (!proc_vfork_release(proc) && as != NULL) {
+    as_destroy(as);
+  }
+
+  /* or its files */
+  for (fd=0; fd<OPEN_MAX; fd++) {
+    if (proc->fileTable[fd] != NULL) {
+      filetable_close(proc, fd);
+    }
+  }
+
+  spinlock_acquire(&proc_familylock);
+  proc->p_exited = true;
+
+  /* live children are on their own from now on */
+  for (child = proc->p_children; child != NULL; child = child->p_sibling) {
+    child->p_parent = NULL;
+  }
+  proc->p_children = NULL;
+  /* and exited ones are destroyed below */
+  zombies = proc->p_zombies;
+  proc->p_zombies = NULL;
+  for (child = zombies; child != NULL; child = child->p_sibling) {
+    child->p_parent = NULL;
+  }
+
+  parent = proc->p_parent;
+  if (parent != NULL) {
+    proc_unlink(&parent->p_children, proc);
+    proc->p_sibling = parent->p_zombies;
+    parent->p_zombies = proc;
+    wchan_wakeall(proc_waitchan(parent), &proc_familylock);
+  }
+  spinlock_release(&proc_familylock);
+
+  while (zombies != NULL) {
+    child = zombies;
+    zombies = child->p_sibling;
+    child->p_sibling = NULL;
+    proc_destroy(child);
+  }
+  if (parent == NULL) {
+    /* nobody will wait for us */
+    proc_destroy(proc);
+  }
+}
+
+/*
+ * vfork support. The child shares the address space of the parent,
+ * which sleeps in proc_vfork_wait until the child calls
+ * proc_vfork_release, on exec or exit. The wait uses the same
+ * channels as waitpid, and VW (on the parent's stack) rather than
+ * the child, which might be gone by the time the parent wakes up.
+ */
+void
+proc_vfork_lend(struct proc *child, struct vforkwait *vw)
+{
+  KASSERT(child->p_addrspace == NULL);
+  vw->vw_parent = curproc;
+  vw->vw_done = false;
+  child->p_addrspace = curproc->p_addrspace;
+  child->p_vfork = vw;
 }
 
+void
+proc_vfork_wait(struct vforkwait *vw)
+{
+  KASSERT(vw->vw_parent == curproc);
+  spinlock_acquire(&proc_familylock);
+  while (!vw->vw_done) {
+    wchan_sleep(proc_waitchan(curproc), &proc_familylock);
+  }
+  spinlock_release(&proc_familylock);
+}
+
+/*
+ * Give the borrowed address space back, and wake the parent. The
+ * child must have stopped using it. Returns false if PROC wasn't
+ * borrowing.
+ */
+bool
+proc_vfork_release(struct proc *proc)
+{
+  struct vforkwait *vw;
+
+  spinlock_acquire(&proc_familylock);
+  vw = proc->p_vfork;
+  if (vw == NULL) {
+    spinlock_release(&proc_familylock);
+    return false;
+  }
+  proc->p_vfork = NULL;
+  vw->vw_done = true;
+  wchan_wakeall(proc_waitchan(vw->vw_parent), &proc_familylock);
+  spinlock_release(&proc_familylock);
+  return true;
+}
 
+/*
+ * Give PDEST the same open files as PSRC. PDEST isn't running yet,
+ * so only PSRC's table needs locking.
+ */
 void 
 proc_file_table_copy(struct proc *psrc, struct proc *pdest) {
   int fd;
+  spinlock_acquire(&psrc->p_filelock);
   for (fd=0; fd<OPEN_MAX; fd++) {
     struct openfile *of = psrc->fileTable[fd];
     pdest->fileTable[fd] = of;
@@ -549,5 +1068,6 @@ proc_file_table_copy(struct proc *psrc, struct proc *pdest) {
       openfileIncrRefCount(of);
     }
   }
+  spinlock_release(&psrc->p_filelock);
 }
 #endif
\ No newline at end of file
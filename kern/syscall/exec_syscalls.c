@@ -0,0 +1,611 @@
+/*
+ * execv, and the argument handling it shares with runprogram.
+ *
+ * The arguments for a new program are gathered into an argblock: the
+ * strings packed back to back in one kernel buffer. From user space,
+ * the argv pointers are fetched with one copyin per page of pointers
+ * (just one for any usual argv), and each string is copied straight
+ * into the end of the block. Putting them on the new program's stack
+ * is then one copyout for the strings and one for the pointers.
+ *
+ * The old address space is kept until the new program has loaded and
+ * its arguments are in place, so a failed exec returns to the caller
+ * unharmed.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/spawn.h>
+#include <limits.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <current.h>
+#include <thread.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <vfs.h>
+#include <syscall.h>
+
+/* Initial size of the string buffer; it doubles up to ARG_MAX */
+#define ARGBLOCK_INITSIZE	PAGE_SIZE
+
+/* Pointers and strings must both fit in ARG_MAX */
+#define ARGBLOCK_MAXARGS	(ARG_MAX / (sizeof(userptr_t) + 1))
+
+void
+argblock_init(struct argblock *ab)
+{
+	ab->ab_buf = NULL;
+	ab->ab_len = 0;
+	ab->ab_size = 0;
+	ab->ab_argc = 0;
+}
+
+void
+argblock_cleanup(struct argblock *ab)
+{
+	kfree(ab->ab_buf);
+	argblock_init(ab);
+}
+
+/*
+ * Make room for at least one more byte in the string buffer.
+ */
+static
+int
+argblock_grow(struct argblock *ab)
+{
+	char *newbuf;
+	size_t newsize;
+
+	newsize = ab->ab_size == 0 ? ARGBLOCK_INITSIZE : ab->ab_size * 2;
+	if (newsize > ARG_MAX) {
+		newsize = ARG_MAX;
+	}
+	if (newsize <= ab->ab_size) {
+		return E2BIG;
+	}
+	newbuf = kmalloc(newsize);
+	if (newbuf == NULL) {
+		return ENOMEM;
+	}
+	if (ab->ab_len > 0) {
+		memcpy(newbuf, ab->ab_buf, ab->ab_len);
+	}
+	kfree(ab->ab_buf);
+	ab->ab_buf = newbuf;
+	ab->ab_size = newsize;
+	return 0;
+}
+
+/*
+ * Bytes the arguments will take on the user stack: the strings, and
+ * ARGC+1 pointers to them.
+ */
+static
+size_t
+argblock_stacksize(const struct argblock *ab)
+{
+	return ROUNDUP(ab->ab_len, 8) +
+		ROUNDUP((ab->ab_argc + 1) * sizeof(userptr_t), 8);
+}
+
+/*
+ * Fill AB (freshly initialized) from a kernel argv, as from the menu.
+ */
+int
+argblock_fromkernel(struct argblock *ab, int argc, char **argv)
+{
+	size_t len;
+	int i, result;
+
+	for (i=0; i<argc; i++) {
+		len = strlen(argv[i]) + 1;
+		while (ab->ab_size - ab->ab_len < len) {
+			result = argblock_grow(ab);
+			if (result) {
+				return result;
+			}
+		}
+		memcpy(ab->ab_buf + ab->ab_len, argv[i], len);
+		ab->ab_len += len;
+		ab->ab_argc++;
+	}
+	if (argblock_stacksize(ab) > ARG_MAX) {
+		return E2BIG;
+	}
+	return 0;
+}
+
+/*
+ * Copy in the NULL-terminated array of pointers at UARGV. Pointers
+ * are fetched in runs that end at a page boundary, so a run never
+ * faults unless its first pointer does, however short the array.
+ * Returns the array in *PTRSRET and its length, not counting the
+ * NULL, in *ARGCRET.
+ */
+static
+int
+argblock_copyinptrs(userptr_t uargv, userptr_t **ptrsret, int *argcret)
+{
+	userptr_t *ptrs, *newptrs;
+	unsigned num, max, run, i;
+	vaddr_t addr;
+	int result;
+
+	max = PAGE_SIZE / sizeof(userptr_t);
+	ptrs = kmalloc(max * sizeof(userptr_t));
+	if (ptrs == NULL) {
+		return ENOMEM;
+	}
+	num = 0;
+	addr = (vaddr_t)uargv;
+	if (addr % sizeof(userptr_t) != 0) {
+		kfree(ptrs);
+		return EFAULT;
+	}
+
+	while (1) {
+		run = (PAGE_SIZE - addr % PAGE_SIZE) / sizeof(userptr_t);
+		if (num + run > max) {
+			if (max >= ARGBLOCK_MAXARGS) {
+				kfree(ptrs);
+				return E2BIG;
+			}
+			newptrs = kmalloc(max * 2 * sizeof(userptr_t));
+			if (newptrs == NULL) {
+				kfree(ptrs);
+				return ENOMEM;
+			}
+			memcpy(newptrs, ptrs, num * sizeof(userptr_t));
+			kfree(ptrs);
+			ptrs = newptrs;
+			max *= 2;
+		}
+		result = copyin((const_userptr_t)addr, &ptrs[num],
+				run * sizeof(userptr_t));
+		if (result) {
+			kfree(ptrs);
+			return result;
+		}
+		for (i=0; i<run; i++) {
+			if (ptrs[num + i] == NULL) {
+				*ptrsret = ptrs;
+				*argcret = num + i;
+				return 0;
+			}
+		}
+		num += run;
+		addr += run * sizeof(userptr_t);
+	}
+}
+
+/*
+ * Fill AB (freshly initialized) from the user argv UARGV.
+ */
+int
+argblock_fromuser(struct argblock *ab, userptr_t uargv)
+{
+	userptr_t *ptrs;
+	size_t got = 0;
+	int argc, i, result;
+
+	result = argblock_copyinptrs(uargv, &ptrs, &argc);
+	if (result) {
+		return result;
+	}
+
+	for (i=0; i<argc; i++) {
+		while (1) {
+			if (ab->ab_len < ab->ab_size) {
+				result = copyinstr(ptrs[i],
+						   ab->ab_buf + ab->ab_len,
+						   ab->ab_size - ab->ab_len,
+						   &got);
+				if (result != ENAMETOOLONG) {
+					break;
+				}
+			}
+			result = argblock_grow(ab);
+			if (result) {
+				break;
+			}
+		}
+		if (result) {
+			kfree(ptrs);
+			return result;
+		}
+		ab->ab_len += got;
+		ab->ab_argc++;
+	}
+	kfree(ptrs);
+
+	if (argblock_stacksize(ab) > ARG_MAX) {
+		return E2BIG;
+	}
+	return 0;
+}
+
+/*
+ * Put the arguments on the stack of the current address space, which
+ * starts at *STACKPTR, moving *STACKPTR down past them. The user
+ * address of argv is returned in *UARGVRET.
+ */
+static
+int
+argblock_copyout(const struct argblock *ab, vaddr_t *stackptr,
+		 userptr_t *uargvret)
+{
+	userptr_t *ptrs;
+	vaddr_t strbase, argvbase;
+	size_t pos;
+	int i, result;
+
+	strbase = *stackptr - ROUNDUP(ab->ab_len, 8);
+	argvbase = *stackptr - argblock_stacksize(ab);
+
+	ptrs = kmalloc((ab->ab_argc + 1) * sizeof(userptr_t));
+	if (ptrs == NULL) {
+		return ENOMEM;
+	}
+	pos = 0;
+	for (i=0; i<ab->ab_argc; i++) {
+		ptrs[i] = (userptr_t)(strbase + pos);
+		pos += strlen(ab->ab_buf + pos) + 1;
+	}
+	ptrs[ab->ab_argc] = NULL;
+	KASSERT(pos == ab->ab_len);
+
+	result = 0;
+	if (ab->ab_len > 0) {
+		result = copyout(ab->ab_buf, (userptr_t)strbase, ab->ab_len);
+	}
+	if (!result) {
+		result = copyout(ptrs, (userptr_t)argvbase,
+				 (ab->ab_argc + 1) * sizeof(userptr_t));
+	}
+	kfree(ptrs);
+	if (result) {
+		return result;
+	}
+
+	*stackptr = argvbase;
+	*uargvret = (userptr_t)argvbase;
+	return 0;
+}
+
+/*
+ * Load the program open as V into a new address space and make it
+ * the current one, with ARGS on its stack. V is closed. On success
+ * the address space that was current before is handed back in
+ * *OLDASRET for the caller to destroy. On failure it is current
+ * again and nothing has changed.
+ */
+static
+int
+exec_loadvnode(struct vnode *v, const struct argblock *args,
+	       struct addrspace **oldasret, vaddr_t *entrypoint,
+	       vaddr_t *stackptr, userptr_t *uargv)
+{
+	struct addrspace *as, *oldas;
+	int result;
+
+	/* Create a new address space. */
+	as = as_create();
+	if (as == NULL) {
+		vfs_close(v);
+		return ENOMEM;
+	}
+
+	/* Switch to it and activate it. */
+	oldas = proc_setas(as);
+	as_activate();
+
+	/* Load the executable. */
+	result = load_elf(v, entrypoint);
+
+	/* Done with the file now. */
+	vfs_close(v);
+
+	/* Define the user stack in the address space */
+	if (!result) {
+		result = as_define_stack(as, stackptr);
+	}
+
+	/* And put the arguments on it */
+	if (!result) {
+		result = argblock_copyout(args, stackptr, uargv);
+	}
+
+	if (result) {
+		/* go back to the old one */
+		proc_setas(oldas);
+		as_activate();
+		as_destroy(as);
+		return result;
+	}
+
+	*oldasret = oldas;
+	return 0;
+}
+
+/*
+ * Same, opening the program PROGNAME.
+ *
+ * Calls vfs_open on progname and thus may destroy it.
+ */
+int
+exec_load(char *progname, const struct argblock *args,
+	  struct addrspace **oldasret, vaddr_t *entrypoint,
+	  vaddr_t *stackptr, userptr_t *uargv)
+{
+	struct vnode *v;
+	int result;
+
+	/* Open the file. */
+	result = vfs_open(progname, O_RDONLY, 0, &v);
+	if (result) {
+		return result;
+	}
+	return exec_loadvnode(v, args, oldasret, entrypoint, stackptr,
+			      uargv);
+}
+
+/*
+ * execv: replace the program running in the current process.
+ * Does not return except on error.
+ */
+int
+sys_execv(userptr_t uprogname, userptr_t uargv)
+{
+	struct argblock args;
+	struct addrspace *oldas;
+	vaddr_t entrypoint, stackptr;
+	userptr_t argv;
+	char *progname, *name, *oldname;
+	int argc, result;
+
+#if OPT_C2
+	/* other threads would be left running in the old program */
+	spinlock_acquire(&curproc->p_lock);
+	result = curproc->p_numthreads > 1 ? EBUSY : 0;
+	spinlock_release(&curproc->p_lock);
+	if (result) {
+		return result;
+	}
+#endif
+
+	progname = kmalloc(PATH_MAX);
+	if (progname == NULL) {
+		return ENOMEM;
+	}
+	result = copyinstr(uprogname, progname, PATH_MAX, NULL);
+	if (result) {
+		kfree(progname);
+		return result;
+	}
+
+	argblock_init(&args);
+	result = argblock_fromuser(&args, uargv);
+	if (result) {
+		argblock_cleanup(&args);
+		kfree(progname);
+		return result;
+	}
+
+	/* the process takes the name of the new program, if we can */
+	name = kstrdup(progname);
+
+	result = exec_load(progname, &args, &oldas, &entrypoint, &stackptr,
+			   &argv);
+	kfree(progname);
+	if (result) {
+		kfree(name);
+		argblock_cleanup(&args);
+		return result;
+	}
+
+	/* No going back now. */
+#if OPT_C2
+	if (proc_vfork_release(curproc)) {
+		/* it was the parent's; the parent can have it back */
+		oldas = NULL;
+	}
+#endif
+	if (oldas != NULL) {
+		as_destroy(oldas);
+	}
+	/* whichever stack we were on, the new program has the first one */
+	curthread->t_ustack = -1;
+	if (name != NULL) {
+		spinlock_acquire(&curproc->p_lock);
+		oldname = curproc->p_name;
+		curproc->p_name = name;
+		spinlock_release(&curproc->p_lock);
+		kfree(oldname);
+	}
+	argc = args.ab_argc;
+	argblock_cleanup(&args);
+
+	enter_new_process(argc, argv, NULL /*env*/, stackptr, entrypoint);
+	/* enter_new_process does not return. */
+	panic("enter_new_process returned\n");
+	return EINVAL;
+}
+
+#if OPT_C2
+/*
+ * What a spawned child needs to start its program.
+ */
+struct spawnstart {
+	struct vnode *ss_vn;		/* the program, open */
+	struct argblock ss_args;
+};
+
+/*
+ * First thing run by the thread of a spawned child: load the program
+ * into the (so far empty) process and go to user mode.
+ */
+static
+void
+spawn_start(void *data, unsigned long junk)
+{
+	struct spawnstart *ss = data;
+	struct addrspace *oldas;
+	vaddr_t entrypoint, stackptr;
+	userptr_t argv;
+	int argc, result;
+
+	(void)junk;
+
+	result = exec_loadvnode(ss->ss_vn, &ss->ss_args, &oldas,
+				&entrypoint, &stackptr, &argv);
+	argc = ss->ss_args.ab_argc;
+	argblock_cleanup(&ss->ss_args);
+	kfree(ss);
+	if (result) {
+		/* too late to tell the parent; exit as a shell would */
+		proc_exit(127);
+		thread_exit();
+	}
+	KASSERT(oldas == NULL);
+
+	enter_new_process(argc, argv, NULL /*env*/, stackptr, entrypoint);
+	/* enter_new_process does not return. */
+	panic("enter_new_process returned\n");
+}
+
+/*
+ * Apply the file actions ACTS to the file table of the new process
+ * P, which is still a copy of the caller's.
+ */
+static
+int
+spawn_fileactions(struct proc *p, const struct spawn_action *acts,
+		  unsigned nacts, char *pathbuf)
+{
+	unsigned i;
+	int result;
+
+	for (i=0; i<nacts; i++) {
+		switch (acts[i].sa_action) {
+		    case SPAWN_CLOSE:
+			result = filetable_close(p, acts[i].sa_fd);
+			break;
+		    case SPAWN_DUP2:
+			result = filetable_dup2(p, acts[i].sa_srcfd,
+						acts[i].sa_fd);
+			break;
+		    case SPAWN_OPEN:
+			result = copyinstr((const_userptr_t)acts[i].sa_path,
+					   pathbuf, PATH_MAX, NULL);
+			if (result) {
+				break;
+			}
+			result = filetable_open(p, pathbuf, acts[i].sa_flags,
+						0, acts[i].sa_fd);
+			break;
+		    default:
+			result = EINVAL;
+			break;
+		}
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * spawn: start the program UPROGNAME with arguments UARGV in a new
+ * child process, applying the NACTS file actions at UACTS. See
+ * <kern/spawn.h>. Returns the child's pid.
+ */
+int
+sys_spawn(userptr_t uprogname, userptr_t uargv, userptr_t uacts,
+	  unsigned nacts, int32_t *retval)
+{
+	struct spawn_action acts[SPAWN_MAXACTIONS];
+	struct spawnstart *ss;
+	struct proc *newp;
+	char *path;
+	int fd, result;
+
+	if (nacts > SPAWN_MAXACTIONS) {
+		return EINVAL;
+	}
+	if (nacts > 0) {
+		result = copyin(uacts, acts, nacts * sizeof(acts[0]));
+		if (result) {
+			return result;
+		}
+	}
+
+	/* one buffer for the program name, then for files to open */
+	path = kmalloc(PATH_MAX);
+	ss = kmalloc(sizeof(*ss));
+	if (path == NULL || ss == NULL) {
+		kfree(path);
+		kfree(ss);
+		return ENOMEM;
+	}
+	argblock_init(&ss->ss_args);
+	ss->ss_vn = NULL;
+
+	result = copyinstr(uprogname, path, PATH_MAX, NULL);
+	if (result) {
+		goto fail;
+	}
+	result = argblock_fromuser(&ss->ss_args, uargv);
+	if (result) {
+		goto fail;
+	}
+
+	result = proc_create_runprogram(ss->ss_args.ab_argc > 0 ?
+					ss->ss_args.ab_buf : path, &newp);
+	if (result) {
+		goto fail;
+	}
+
+	/* open the program now, so a bad name is our caller's error */
+	result = vfs_open(path, O_RDONLY, 0, &ss->ss_vn);
+	if (result) {
+		goto failproc;
+	}
+
+	proc_file_table_copy(curproc, newp);
+	result = spawn_fileactions(newp, acts, nacts, path);
+	if (result) {
+		goto failproc;
+	}
+	kfree(path);
+	path = NULL;
+
+	result = thread_fork(newp->p_name, newp, spawn_start, ss, 0);
+	if (result) {
+		goto failproc;
+	}
+
+	/* ss belongs to the child now */
+	*retval = newp->p_pid;
+	return 0;
+
+ failproc:
+	for (fd=0; fd<OPEN_MAX; fd++) {
+		if (newp->fileTable[fd] != NULL) {
+			filetable_close(newp, fd);
+		}
+	}
+	proc_destroy(newp);
+ fail:
+	if (ss->ss_vn != NULL) {
+		vfs_close(ss->ss_vn);
+	}
+	argblock_cleanup(&ss->ss_args);
+	kfree(ss);
+	kfree(path);
+	return result;
+}
+#endif
@@ -21,50 +21,103 @@
 #include <limits.h>
 #include <uio.h>
 #include <proc.h>
+#include <spinlock.h>
+#include <synch.h>
 
 /* max num of system wide open files */
 #define SYSTEM_OPEN_MAX (10*OPEN_MAX)
 
 #define USE_KERNEL_BUFFER 0
 
-/* system open file table */
+/*
+ * System open file table. systemFileTableLock covers claiming a free
+ * slot and countRef; an open file's lock covers its offset, and is
+ * held across the I/O so reads and writes through one open file
+ * don't interleave. A process's fileTable is covered by its
+ * p_filelock, taken before systemFileTableLock.
+ */
 struct openfile {
   struct vnode *vn;
+  struct lock *lock;
   off_t offset;	
   unsigned int countRef;
 };
 
 struct openfile systemFileTable[SYSTEM_OPEN_MAX];
+static struct spinlock systemFileTableLock = SPINLOCK_INITIALIZER;
 
 void openfileIncrRefCount(struct openfile *of) {
-  if (of!=NULL)
+  if (of!=NULL) {
+    spinlock_acquire(&systemFileTableLock);
+    KASSERT(of->countRef > 0);
     of->countRef++;
+    spinlock_release(&systemFileTableLock);
+  }
+}
+
+static void
+openfile_decref(struct openfile *of)
+{
+  struct vnode *vn;
+  struct lock *lock;
+
+  spinlock_acquire(&systemFileTableLock);
+  KASSERT(of->countRef > 0);
+  if (--of->countRef > 0) {
+    // just decrement ref cnt
+    spinlock_release(&systemFileTableLock);
+    return;
+  }
+  vn = of->vn;
+  lock = of->lock;
+  of->vn = NULL;
+  of->lock = NULL;
+  spinlock_release(&systemFileTableLock);
+
+  if (vn!=NULL)
+    vfs_close(vn);
+  lock_destroy(lock);
+}
+
+/*
+ * Get the open file FD of process P, with a reference that keeps it
+ * open until openfile_decref, even if P closes FD meanwhile. NULL if
+ * FD isn't open.
+ */
+static struct openfile *
+filetable_get(struct proc *p, int fd)
+{
+  struct openfile *of;
+
+  if (fd<0||fd>=OPEN_MAX) return NULL;
+  spinlock_acquire(&p->p_filelock);
+  of = p->fileTable[fd];
+  openfileIncrRefCount(of);
+  spinlock_release(&p->p_filelock);
+  return of;
 }
 
 #if USE_KERNEL_BUFFER
 
 static int
-file_read(int fd, userptr_t buf_ptr, size_t size) {
+file_read(struct openfile *of, userptr_t buf_ptr, size_t size) {
   struct iovec iov;
   struct uio ku;
   int result, nread;
-  struct vnode *vn;
-  struct openfile *of;
   void *kbuf;
 
-  if (fd<0||fd>OPEN_MAX) return -1;
-  of = curproc->fileTable[fd];
-  if (of==NULL) return -1;
-  vn = of->vn;
-  if (vn==NULL) return -1;
-
   kbuf = kmalloc(size);
+  if (kbuf==NULL) return -1;
+  lock_acquire(of->lock);
   uio_kinit(&iov, &ku, kbuf, size, of->offset, UIO_READ);
-  result = VOP_READ(vn, &ku);
+  result = VOP_READ(of->vn, &ku);
   if (result) {
+    lock_release(of->lock);
+    kfree(kbuf);
     return result;
   }
   of->offset = ku.uio_offset;
+  lock_release(of->lock);
   nread = size - ku.uio_resid;
   copyout(kbuf,buf_ptr,nread);
   kfree(kbuf);
@@ -72,29 +125,26 @@ file_read(int fd, userptr_t buf_ptr, size_t size) {
 }
 
 static int
-file_write(int fd, userptr_t buf_ptr, size_t size) {
+file_write(struct openfile *of, userptr_t buf_ptr, size_t size) {
   struct iovec iov;
   struct uio ku;
   int result, nwrite;
-  struct vnode *vn;
-  struct openfile *of;
   void *kbuf;
 
-  if (fd<0||fd>OPEN_MAX) return -1;
-  of = curproc->fileTable[fd];
-  if (of==NULL) return -1;
-  vn = of->vn;
-  if (vn==NULL) return -1;
-
   kbuf = kmalloc(size);
+  if (kbuf==NULL) return -1;
   copyin(buf_ptr,kbuf,size);
+  lock_acquire(of->lock);
   uio_kinit(&iov, &ku, kbuf, size, of->offset, UIO_WRITE);
-  result = VOP_WRITE(vn, &ku);
+  result = VOP_WRITE(of->vn, &ku);
   if (result) {
+    lock_release(of->lock);
+    kfree(kbuf);
     return result;
   }
-  kfree(kbuf);
   of->offset = ku.uio_offset;
+  lock_release(of->lock);
+  kfree(kbuf);
   nwrite = size - ku.uio_resid;
   return (nwrite);
 }
@@ -102,22 +152,15 @@ file_write(int fd, userptr_t buf_ptr, size_t size) {
 #else
 
 static int
-file_read(int fd, userptr_t buf_ptr, size_t size) {
+file_read(struct openfile *of, userptr_t buf_ptr, size_t size) {
   struct iovec iov;
   struct uio u;
   int result;
-  struct vnode *vn;
-  struct openfile *of;
-
-  if (fd<0||fd>OPEN_MAX) return -1;
-  of = curproc->fileTable[fd];
-  if (of==NULL) return -1;
-  vn = of->vn;
-  if (vn==NULL) return -1;
 
   iov.iov_ubase = buf_ptr;
   iov.iov_len = size;
 
+  lock_acquire(of->lock);
   u.uio_iov = &iov;
   u.uio_iovcnt = 1;
   u.uio_resid = size;          // amount to read from the file
@@ -126,32 +169,27 @@ file_read(int fd, userptr_t buf_ptr, size_t size) {
   u.uio_rw = UIO_READ;
   u.uio_space = curproc->p_addrspace;
 
-  result = VOP_READ(vn, &u);
+  result = VOP_READ(of->vn, &u);
   if (result) {
+    lock_release(of->lock);
     return result;
   }
 
   of->offset = u.uio_offset;
+  lock_release(of->lock);
   return (size - u.uio_resid);
 }
 
 static int
-file_write(int fd, userptr_t buf_ptr, size_t size) {
+file_write(struct openfile *of, userptr_t buf_ptr, size_t size) {
   struct iovec iov;
   struct uio u;
   int result, nwrite;
-  struct vnode *vn;
-  struct openfile *of;
-
-  if (fd<0||fd>OPEN_MAX) return -1;
-  of = curproc->fileTable[fd];
-  if (of==NULL) return -1;
-  vn = of->vn;
-  if (vn==NULL) return -1;
 
   iov.iov_ubase = buf_ptr;
   iov.iov_len = size;
 
+  lock_acquire(of->lock);
   u.uio_iov = &iov;
   u.uio_iovcnt = 1;
   u.uio_resid = size;          // amount to read from the file
@@ -160,11 +198,13 @@ file_write(int fd, userptr_t buf_ptr, size_t size) {
   u.uio_rw = UIO_WRITE;
   u.uio_space = curproc->p_addrspace;
 
-  result = VOP_WRITE(vn, &u);
+  result = VOP_WRITE(of->vn, &u);
   if (result) {
+    lock_release(of->lock);
     return result;
   }
   of->offset = u.uio_offset;
+  lock_release(of->lock);
   nwrite = size - u.uio_resid;
   return (nwrite);
 }
@@ -172,47 +212,143 @@ file_write(int fd, userptr_t buf_ptr, size_t size) {
 #endif
 
 /*
- * file system calls for open/close
+ * open PATH and put it in a free slot of the system open file table
  */
-int
-sys_open(userptr_t path, int openflags, mode_t mode, int *errp)
+static int
+openfile_open(char *path, int openflags, mode_t mode,
+	      struct openfile **ofret)
 {
-  int fd, i;
+  int i;
   struct vnode *v;
-  struct openfile *of=NULL;; 	
+  struct lock *lock;
   int result;
 
-  result = vfs_open((char *)path, openflags, mode, &v);
+  lock = lock_create("openfile");
+  if (lock == NULL) {
+    return ENOMEM;
+  }
+  result = vfs_open(path, openflags, mode, &v);
   if (result) {
-    *errp = ENOENT;
-    return -1;
+    lock_destroy(lock);
+    return result;
   }
   /* search system open file table */
+  spinlock_acquire(&systemFileTableLock);
   for (i=0; i<SYSTEM_OPEN_MAX; i++) {
     if (systemFileTable[i].vn==NULL) {
-      of = &systemFileTable[i];
-      of->vn = v;
-      of->offset = 0; // TODO: handle offset with append
-      of->countRef = 1;
-      break;
+      *ofret = &systemFileTable[i];
+      (*ofret)->vn = v;
+      (*ofret)->lock = lock;
+      (*ofret)->offset = 0; // TODO: handle offset with append
+      (*ofret)->countRef = 1;
+      spinlock_release(&systemFileTableLock);
+      return 0;
     }
   }
-  if (of==NULL) { 
-    // no free slot in system open file table
+  spinlock_release(&systemFileTableLock);
+  // no free slot in system open file table
+  vfs_close(v);
+  lock_destroy(lock);
+  return ENFILE;
+}
+
+/*
+ * Operations on the file table of a process P that may not be the
+ * current one (as for spawn, before the child runs). Return an
+ * error code.
+ */
+int
+filetable_close(struct proc *p, int fd)
+{
+  struct openfile *of;
+
+  if (fd<0||fd>=OPEN_MAX) return EBADF;
+  spinlock_acquire(&p->p_filelock);
+  of = p->fileTable[fd];
+  p->fileTable[fd] = NULL;
+  spinlock_release(&p->p_filelock);
+  if (of==NULL) return EBADF;
+  openfile_decref(of);
+  return 0;
+}
+
+int
+filetable_dup2(struct proc *p, int oldfd, int newfd)
+{
+  struct openfile *of, *old;
+
+  if (oldfd<0||oldfd>=OPEN_MAX||newfd<0||newfd>=OPEN_MAX) return EBADF;
+  spinlock_acquire(&p->p_filelock);
+  of = p->fileTable[oldfd];
+  if (of==NULL) {
+    spinlock_release(&p->p_filelock);
+    return EBADF;
+  }
+  if (oldfd==newfd) {
+    spinlock_release(&p->p_filelock);
+    return 0;
+  }
+  openfileIncrRefCount(of);
+  old = p->fileTable[newfd];
+  p->fileTable[newfd] = of;
+  spinlock_release(&p->p_filelock);
+  if (old!=NULL) {
+    openfile_decref(old);
+  }
+  return 0;
+}
+
+/* open PATH as FD, closing whatever FD was */
+int
+filetable_open(struct proc *p, char *path, int openflags, mode_t mode, int fd)
+{
+  struct openfile *of, *old;
+  int result;
+
+  if (fd<0||fd>=OPEN_MAX) return EBADF;
+  result = openfile_open(path, openflags, mode, &of);
+  if (result) return result;
+  spinlock_acquire(&p->p_filelock);
+  old = p->fileTable[fd];
+  p->fileTable[fd] = of;
+  spinlock_release(&p->p_filelock);
+  if (old!=NULL) {
+    openfile_decref(old);
+  }
+  return 0;
+}
+
+/*
+ * file system calls for open/close
+ */
+int
+sys_open(userptr_t path, int openflags, mode_t mode, int *errp)
+{
+  int fd;
+  struct openfile *of=NULL;
+  int result;
+
+  result = openfile_open((char *)path, openflags, mode, &of);
+  if (result == ENFILE) {
     *errp = ENFILE;
+    return -1;
   }
-  else {
-    for (fd=STDERR_FILENO+1; fd<OPEN_MAX; fd++) {
-      if (curproc->fileTable[fd] == NULL) {
-	curproc->fileTable[fd] = of;
-	return fd;
-      }
+  if (result) {
+    *errp = ENOENT;
+    return -1;
+  }
+  spinlock_acquire(&curproc->p_filelock);
+  for (fd=STDERR_FILENO+1; fd<OPEN_MAX; fd++) {
+    if (curproc->fileTable[fd] == NULL) {
+      curproc->fileTable[fd] = of;
+      spinlock_release(&curproc->p_filelock);
+      return fd;
     }
-    // no free slot in process open file table
-    *errp = EMFILE;
   }
-  
-  vfs_close(v);
+  spinlock_release(&curproc->p_filelock);
+  // no free slot in process open file table
+  *errp = EMFILE;
+  openfile_decref(of);
   return -1;
 }
 
@@ -222,20 +358,7 @@ sys_open(userptr_t path, int openflags, mode_t mode, int *errp)
 int
 sys_close(int fd)
 {
-  struct openfile *of=NULL; 
-  struct vnode *vn;
-
-  if (fd<0||fd>OPEN_MAX) return -1;
-  of = curproc->fileTable[fd];
-  if (of==NULL) return -1;
-  curproc->fileTable[fd] = NULL;
-
-  if (--of->countRef > 0) return 0; // just decrement ref cnt
-  vn = of->vn;
-  of->vn = NULL;
-  if (vn==NULL) return -1;
-
-  vfs_close(vn);	
+  if (filetable_close(curproc, fd)) return -1;
   return 0;
 }
 
@@ -249,10 +372,21 @@ sys_write(int fd, userptr_t buf_ptr, size_t size)
 {
   int i;
   char *p = (char *)buf_ptr;
+#if OPT_C2
+  struct openfile *of;
+  int result;
 
+  /* stdout/stderr go to the console unless redirected */
+  of = filetable_get(curproc, fd);
+  if (of!=NULL) {
+    result = file_write(of, buf_ptr, size);
+    openfile_decref(of);
+    return result;
+  }
+#endif
   if (fd!=STDOUT_FILENO && fd!=STDERR_FILENO) {
 #if OPT_C2
-    return file_write(fd, buf_ptr, size);
+    return -1;
 #else
     kprintf("sys_write supported only to stdout\n");
     return -1;
@@ -271,10 +405,21 @@ sys_read(int fd, userptr_t buf_ptr, size_t size)
 {
   int i;
   char *p = (char *)buf_ptr;
+#if OPT_C2
+  struct openfile *of;
+  int result;
 
+  /* stdin comes from the console unless redirected */
+  of = filetable_get(curproc, fd);
+  if (of!=NULL) {
+    result = file_read(of, buf_ptr, size);
+    openfile_decref(of);
+    return result;
+  }
+#endif
   if (fd!=STDIN_FILENO) {
 #if OPT_C2
-    return file_read(fd, buf_ptr, size);
+    return -1;
 #else
     kprintf("sys_read supported only to stdin\n");
     return -1;
@@ -282,7 +427,14 @@ sys_read(int fd, userptr_t buf_ptr, size_t size)
   }
 
   for (i=0; i<(int)size; i++) {
+#if OPT_C2
+    /* gives up if another thread of the process calls _exit */
+    if (getch_user(&p[i])) {
+      return i>0 ? i : -1;
+    }
+#else
     p[i] = getch();
+#endif
     if (p[i] < 0) 
       return i;
   }
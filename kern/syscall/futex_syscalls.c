@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Futexes: sleeping and waking on user addresses, so that user-level
+ * locks need only enter the kernel when they're contended.
+ *
+ * A futex is named by the address space and the user address, and
+ * hashed into a fixed table of buckets. Each bucket has a sleep lock,
+ * a CV for its sleepers, and a list of who is sleeping on what; the
+ * lock is held while the user word is checked so a wakeup can't slip
+ * in between the check and going to sleep. Waking marks the chosen
+ * sleepers and broadcasts on the CV; sleepers on other futexes that
+ * hash to the same bucket just go back to sleep.
+ *
+ * futex_wait and futex_wake also take a null address space, meaning
+ * the word is in the kernel; the fx1 test uses that.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/futex.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <synch.h>
+#include <syscall.h>
+
+#define FUTEX_NBUCKETS	64
+
+/*
+ * A thread sleeping on a futex. Lives on the sleeper's stack.
+ */
+struct futex_waiter {
+	struct addrspace *fw_as;
+	vaddr_t fw_addr;
+	bool fw_woken;			/* Set by the waker */
+	struct futex_waiter *fw_next;
+};
+
+struct futex_bucket {
+	struct lock *fb_lock;
+	struct cv *fb_cv;
+	struct futex_waiter *fb_waiters;
+};
+
+static struct futex_bucket futex_buckets[FUTEX_NBUCKETS];
+
+/*
+ * Set up the bucket table.
+ */
+void
+futex_bootstrap(void)
+{
+	struct futex_bucket *fb;
+	unsigned i;
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		fb = &futex_buckets[i];
+		fb->fb_lock = lock_create("futex");
+		fb->fb_cv = cv_create("futex");
+		if (fb->fb_lock == NULL || fb->fb_cv == NULL) {
+			panic("futex_bootstrap: Out of memory\n");
+		}
+		fb->fb_waiters = NULL;
+	}
+}
+
+static
+struct futex_bucket *
+futex_bucket(struct addrspace *as, vaddr_t addr)
+{
+	uint32_t hash;
+
+	hash = ((uint32_t)(uintptr_t)as >> 4) ^ ((uint32_t)addr >> 2);
+	hash *= 2654435761U;	/* Knuth's multiplicative hash */
+	return &futex_buckets[hash >> 26];
+}
+
+/*
+ * True if another thread has called _exit, so a sleeper should give
+ * up (see proc_exit).
+ */
+static
+bool
+futex_exiting(void)
+{
+#if OPT_C2
+	return curproc->p_exiting;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Sleep on ADDR if it contains VAL.
+ */
+int
+futex_wait(struct addrspace *as, userptr_t uaddr, int val)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter self, **fwp;
+	int cur, result;
+
+	fb = futex_bucket(as, (vaddr_t)uaddr);
+	lock_acquire(fb->fb_lock);
+
+	if (as == NULL) {
+		cur = *(volatile int *)uaddr;
+	}
+	else {
+		result = copyin((const_userptr_t)uaddr, &cur, sizeof(cur));
+		if (result) {
+			lock_release(fb->fb_lock);
+			return result;
+		}
+	}
+	if (cur != val) {
+		lock_release(fb->fb_lock);
+		return EAGAIN;
+	}
+
+	self.fw_as = as;
+	self.fw_addr = (vaddr_t)uaddr;
+	self.fw_woken = false;
+	self.fw_next = NULL;
+
+	/* Add at the end, so sleepers are woken in order. */
+	for (fwp = &fb->fb_waiters; *fwp != NULL; fwp = &(*fwp)->fw_next) {
+		/* nothing */
+	}
+	*fwp = &self;
+
+	/*
+	 * The waker takes us off the list. If another thread calls
+	 * _exit meanwhile we give up, and take ourselves off.
+	 */
+	while (!self.fw_woken && !futex_exiting()) {
+		cv_wait(fb->fb_cv, fb->fb_lock);
+	}
+	result = 0;
+	if (!self.fw_woken) {
+		for (fwp = &fb->fb_waiters; *fwp != &self;
+		     fwp = &(*fwp)->fw_next) {
+			KASSERT(*fwp != NULL);
+		}
+		*fwp = self.fw_next;
+		result = EINTR;
+	}
+
+	lock_release(fb->fb_lock);
+	return result;
+}
+
+/*
+ * Wake up to MAX threads sleeping on ADDR. Returns how many.
+ */
+int
+futex_wake(struct addrspace *as, userptr_t uaddr, int max)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter *fw, **fwp;
+	int count;
+
+	fb = futex_bucket(as, (vaddr_t)uaddr);
+	lock_acquire(fb->fb_lock);
+
+	count = 0;
+	fwp = &fb->fb_waiters;
+	while (count < max && *fwp != NULL) {
+		fw = *fwp;
+		if (fw->fw_as == as && fw->fw_addr == (vaddr_t)uaddr) {
+			*fwp = fw->fw_next;
+			fw->fw_next = NULL;
+			fw->fw_woken = true;
+			count++;
+		}
+		else {
+			fwp = &fw->fw_next;
+		}
+	}
+	if (count > 0) {
+		cv_broadcast(fb->fb_cv, fb->fb_lock);
+	}
+
+	lock_release(fb->fb_lock);
+	return count;
+}
+
+/*
+ * Wake everyone sleeping on a futex in AS, without marking them, so
+ * they see that their process is exiting and give up. Called by
+ * proc_exit after setting p_exiting.
+ */
+void
+futex_wakeall(struct addrspace *as)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter *fw;
+	unsigned i;
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		fb = &futex_buckets[i];
+		lock_acquire(fb->fb_lock);
+		for (fw = fb->fb_waiters; fw != NULL; fw = fw->fw_next) {
+			if (fw->fw_as == as) {
+				cv_broadcast(fb->fb_cv, fb->fb_lock);
+				break;
+			}
+		}
+		lock_release(fb->fb_lock);
+	}
+}
+
+int
+sys_futex(userptr_t uaddr, int op, int val, int32_t *retval)
+{
+	struct addrspace *as;
+	int result;
+
+	if ((vaddr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+	as = proc_getas();
+	KASSERT(as != NULL);
+
+	switch (op) {
+	    case FUTEX_WAIT:
+		result = futex_wait(as, uaddr, val);
+		break;
+	    case FUTEX_WAKE:
+		if (val < 0) {
+			return EINVAL;
+		}
+		*retval = futex_wake(as, uaddr, val);
+		result = 0;
+		break;
+	    default:
+		result = EINVAL;
+		break;
+	}
+	return result;
+}
@@ -2,12 +2,15 @@
  * AUthor: G.Cabodi
  * Very simple implementation of sys__exit.
  * It just avoids crash/panic. Full process exit still TODO
- * Address space is released
+ * Address space is released; the rest of the process stays as a
+ * zombie until the parent waits for it (see proc_exit)
  */
 
 #include <types.h>
 #include <kern/unistd.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -18,6 +21,7 @@
 #include <mips/trapframe.h>
 #include <current.h>
 #include <synch.h>
+#include <rcu.h>
 
 /*
  * system calls for process management
@@ -26,10 +30,7 @@ void
 sys__exit(int status)
 {
 #if OPT_C2
-  struct proc *p = curproc;
-  p->p_status = status & 0xff; /* just lower 8 bits returned */
-  proc_remthread(curthread);
-  proc_signal_end(p);
+  proc_exit(status & 0xff); /* just lower 8 bits returned */
 #else
   /* get address space of current process and destroy */
   struct addrspace *as = proc_getas();
@@ -42,22 +43,25 @@ sys__exit(int status)
 }
 
 int
-sys_waitpid(pid_t pid, userptr_t statusp, int options)
+sys_waitpid(pid_t pid, userptr_t statusp, int options, pid_t *retval)
 {
 #if OPT_C2
-  struct proc *p = proc_search_pid(pid);
-  int s;
-  (void)options; /* not handled */
-  if (p==NULL) return -1;
-  s = proc_wait(p);
-  if (statusp!=NULL) 
-    *(int*)statusp = s;
-  return pid;
+  pid_t ret;
+  int s, result;
+  result = proc_waitpid(pid, options, &ret, &s);
+  if (result) return result;
+  if (statusp!=NULL && ret!=0) {
+    result = copyout(&s, statusp, sizeof(s));
+    if (result) return result;
+  }
+  *retval = ret;
+  return 0;
 #else
   (void)options; /* not handled */
   (void)pid;
   (void)statusp;
-  return -1;
+  (void)retval;
+  return ENOSYS;
 #endif
 }
 
@@ -73,10 +77,136 @@ sys_getpid(void)
 }
 
 #if OPT_C2
+/*
+ * Find the target of a setpriority/getpriority call. Only
+ * PRIO_PROCESS is supported; who==0 means the current process.
+ * Called in an RCU read section, which keeps the target from being
+ * freed until the caller is done with it.
+ */
+static int
+priority_target(int which, pid_t who, struct proc **ret)
+{
+  struct proc *p;
+
+  if (which != PRIO_PROCESS) return EINVAL;
+  if (who == 0) {
+    p = curproc;
+  }
+  else {
+    p = proc_search_pid(who);
+    if (p == NULL) return ESRCH;
+  }
+  *ret = p;
+  return 0;
+}
+
+/*
+ * Set the nice value of every thread of a process. As in POSIX,
+ * out-of-range values are clamped.
+ */
+int
+sys_setpriority(int which, pid_t who, int prio)
+{
+  struct proc *p;
+  struct thread_node *tn;
+  int result, spl;
+
+  if (prio < PRIO_MIN) prio = PRIO_MIN;
+  if (prio > PRIO_MAX) prio = PRIO_MAX;
+
+  spl = rcu_read_lock();
+  result = priority_target(which, who, &p);
+  if (result == 0) {
+    /* p_lock keeps the threads from exiting under us */
+    spinlock_acquire(&p->p_lock);
+    for (tn = p->p_thread_list; tn != NULL; tn = tn->next) {
+      thread_setnice(tn->t, prio);
+    }
+    spinlock_release(&p->p_lock);
+  }
+  rcu_read_unlock(spl);
+  return result;
+}
+
+int
+sys_getpriority(int which, pid_t who, int32_t *retval)
+{
+  struct proc *p;
+  int result, spl;
+
+  spl = rcu_read_lock();
+  result = priority_target(which, who, &p);
+  if (result == 0) {
+    spinlock_acquire(&p->p_lock);
+    if (p->p_thread_list == NULL) {
+      /* already exited */
+      result = ESRCH;
+    }
+    else {
+      *retval = thread_getnice(p->p_thread_list->t);
+    }
+    spinlock_release(&p->p_lock);
+  }
+  rcu_read_unlock(spl);
+  return result;
+}
+
 static void
-call_enter_forked_process(void *tfv, unsigned long dummy) {
+cycles_to_timeval(uint64_t cycles, struct timeval *tv)
+{
+  struct timespec ts;
+
+  cputime_totime(cycles, &ts);
+  tv->tv_sec = ts.tv_sec;
+  tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+/*
+ * Report CPU time and context switches of the current process
+ * (RUSAGE_SELF), counting threads that have exited and the time so
+ * far of those still running, or of its waited-for children
+ * (RUSAGE_CHILDREN). Interrupt time isn't included in either user or
+ * system time. The other fields aren't tracked and are zero.
+ */
+int
+sys_getrusage(int who, userptr_t usage)
+{
+  struct proc *p = curproc;
+  struct thread_node *tn;
+  struct cputimes total;
+  struct rusage ru;
+
+  cputimes_init(&total);
+  spinlock_acquire(&p->p_lock);
+  if (who == RUSAGE_SELF) {
+    cputimes_add(&total, &p->p_times);
+    for (tn = p->p_thread_list; tn != NULL; tn = tn->next) {
+      cputimes_add(&total, &tn->t->t_times);
+    }
+  }
+  else if (who == RUSAGE_CHILDREN) {
+    cputimes_add(&total, &p->p_ctimes);
+  }
+  else {
+    spinlock_release(&p->p_lock);
+    return EINVAL;
+  }
+  spinlock_release(&p->p_lock);
+
+  bzero(&ru, sizeof(ru));
+  cycles_to_timeval(total.ct_ucycles, &ru.ru_utime);
+  cycles_to_timeval(total.ct_scycles, &ru.ru_stime);
+  ru.ru_nvcsw = total.ct_nvcsw;
+  ru.ru_nivcsw = total.ct_nivcsw;
+
+  return copyout(&ru, usage, sizeof(ru));
+}
+
+static void
+call_enter_forked_process(void *tfv, unsigned long ustack) {
   struct trapframe *tf = (struct trapframe *)tfv;
-  (void)dummy;
+  /* the copy of the user stack we're on, if not the first one */
+  curthread->t_ustack = (int)ustack;
   enter_forked_process(tf); 
  
   panic("enter_forked_process returned (should not happen)\n");
@@ -89,9 +219,9 @@ int sys_fork(struct trapframe *ctf, pid_t *retval) {
 
   KASSERT(curproc != NULL);
 
-  newp = proc_create_runprogram(curproc->p_name);
-  if (newp == NULL) {
-    return ENOMEM;
+  result = proc_create_runprogram(curproc->p_name, &newp);
+  if (result) {
+    return result;
   }
 
   /* done here as we need to duplicate the address space 
@@ -102,7 +232,7 @@ int sys_fork(struct trapframe *ctf, pid_t *retval) {
     return ENOMEM; 
   }
 
-  proc_file_table_copy(newp,curproc);
+  proc_file_table_copy(curproc,newp);
 
   /* we need a copy of the parent's trapframe */
   tf_child = kmalloc(sizeof(struct trapframe));
@@ -118,9 +248,57 @@ int sys_fork(struct trapframe *ctf, pid_t *retval) {
   result = thread_fork(
 		 curthread->t_name, newp,
 		 call_enter_forked_process, 
-		 (void *)tf_child, (unsigned long)0/*unused*/);
+		 (void *)tf_child, (unsigned long)curthread->t_ustack);
+
+  if (result){
+    proc_destroy(newp);
+    kfree(tf_child);
+    return ENOMEM;
+  }
+
+  *retval = newp->p_pid;
+
+  return 0;
+}
+/*
+ * vfork: like fork, but the child runs in the parent's address space
+ * and the parent sleeps until the child calls execv or _exit, so no
+ * copy of the address space is made.
+ */
+int sys_vfork(struct trapframe *ctf, pid_t *retval) {
+  struct trapframe *tf_child;
+  struct vforkwait vw;
+  struct proc *newp;
+  int result;
+
+  KASSERT(curproc != NULL);
+
+  result = proc_create_runprogram(curproc->p_name, &newp);
+  if (result) {
+    return result;
+  }
+
+  proc_file_table_copy(curproc,newp);
+
+  /* we need a copy of the parent's trapframe */
+  tf_child = kmalloc(sizeof(struct trapframe));
+  if(tf_child == NULL){
+    proc_destroy(newp);
+    return ENOMEM; 
+  }
+  memcpy(tf_child, ctf, sizeof(struct trapframe));
+
+  proc_vfork_lend(newp, &vw);
+
+  result = thread_fork(
+		 curthread->t_name, newp,
+		 call_enter_forked_process, 
+		 (void *)tf_child, (unsigned long)-1/*stack is borrowed*/);
 
   if (result){
+    /* don't let proc_destroy have the address space */
+    proc_vfork_release(newp);
+    newp->p_addrspace = NULL;
     proc_destroy(newp);
     kfree(tf_child);
     return ENOMEM;
@@ -128,6 +306,76 @@ int sys_fork(struct trapframe *ctf, pid_t *retval) {
 
   *retval = newp->p_pid;
 
+  /* newp may be gone once this returns */
+  proc_vfork_wait(&vw);
+
   return 0;
 }
-#endif
\ No newline at end of file
+/*
+ * User threads. A new thread shares everything with the rest of the
+ * process except its stack, which the address space provides. It
+ * starts at ENTRY, called with ARG; ENTRY must not return, but call
+ * thread_exit. The thread id returned is the stack's number plus 1
+ * (the first thread is 0).
+ */
+struct uthreadstart {
+  vaddr_t us_entry;
+  userptr_t us_arg;
+  vaddr_t us_stack;
+};
+
+static void
+call_enter_new_thread(void *data, unsigned long slot) {
+  struct uthreadstart *us = data;
+  struct uthreadstart start = *us;
+
+  kfree(us);
+  curthread->t_ustack = slot;
+  if (curproc->p_exiting) {
+    /* _exit was called while we were being made */
+    proc_thread_exit();
+    thread_exit();
+  }
+  enter_new_thread(start.us_arg, start.us_stack, start.us_entry);
+}
+
+int
+sys_thread_create(userptr_t entry, userptr_t arg, int32_t *retval)
+{
+  struct uthreadstart *us;
+  struct addrspace *as = proc_getas();
+  int slot, result;
+
+  KASSERT(as != NULL);
+
+  us = kmalloc(sizeof(*us));
+  if (us == NULL) {
+    return ENOMEM;
+  }
+  us->us_entry = (vaddr_t)entry;
+  us->us_arg = arg;
+  result = as_define_tstack(as, &slot, &us->us_stack);
+  if (result) {
+    kfree(us);
+    return result;
+  }
+
+  result = thread_fork(curthread->t_name, curproc,
+		       call_enter_new_thread, us, (unsigned long)slot);
+  if (result) {
+    as_release_tstack(as, slot);
+    kfree(us);
+    return result;
+  }
+
+  *retval = slot + 1;
+  return 0;
+}
+
+void
+sys_thread_exit(void)
+{
+  proc_thread_exit();
+  thread_exit();
+}
+#endif
@@ -35,70 +35,51 @@
 
 #include <types.h>
 #include <kern/errno.h>
-#include <kern/fcntl.h>
 #include <lib.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
-#include <vm.h>
-#include <vfs.h>
 #include <syscall.h>
 #include <test.h>
 
 /*
- * Load program "progname" and start running it in usermode.
+ * Load program "progname" and start running it in usermode, with
+ * the ARGC arguments ARGV.
  * Does not return except on error.
  *
  * Calls vfs_open on progname and thus may destroy it.
  */
 int
-runprogram(char *progname)
+runprogram(char *progname, int argc, char **argv)
 {
-	struct addrspace *as;
-	struct vnode *v;
+	struct argblock args;
+	struct addrspace *oldas;
 	vaddr_t entrypoint, stackptr;
+	userptr_t uargv;
 	int result;
 
-	/* Open the file. */
-	result = vfs_open(progname, O_RDONLY, 0, &v);
-	if (result) {
-		return result;
-	}
-
 	/* We should be a new process. */
 	KASSERT(proc_getas() == NULL);
 
-	/* Create a new address space. */
-	as = as_create();
-	if (as == NULL) {
-		vfs_close(v);
-		return ENOMEM;
-	}
-
-	/* Switch to it and activate it. */
-	proc_setas(as);
-	as_activate();
-
-	/* Load the executable. */
-	result = load_elf(v, &entrypoint);
+	/* Gather the arguments. */
+	argblock_init(&args);
+	result = argblock_fromkernel(&args, argc, argv);
 	if (result) {
-		/* p_addrspace will go away when curproc is destroyed */
-		vfs_close(v);
+		argblock_cleanup(&args);
 		return result;
 	}
 
-	/* Done with the file now. */
-	vfs_close(v);
-
-	/* Define the user stack in the address space */
-	result = as_define_stack(as, &stackptr);
+	/* Load the executable, and put the arguments on its stack. */
+	result = exec_load(progname, &args, &oldas, &entrypoint, &stackptr,
+			   &uargv);
+	argblock_cleanup(&args);
 	if (result) {
-		/* p_addrspace will go away when curproc is destroyed */
 		return result;
 	}
+	KASSERT(oldas == NULL);
 
 	/* Warp to user mode. */
-	enter_new_process(0 /*argc*/, NULL /*userspace addr of argv*/,
+	enter_new_process(argc, uargv,
 			  NULL /*userspace addr of environment*/,
 			  stackptr, entrypoint);
 
@@ -106,4 +87,3 @@ runprogram(char *progname)
 	panic("enter_new_process returned\n");
 	return EINVAL;
 }
-
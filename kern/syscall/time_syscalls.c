@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -56,3 +57,38 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Sleep for the interval in REQ. Since there are no signals, the
+ * sleep is never interrupted, and the time remaining stored in REM
+ * (if requested) is always zero.
+ */
+int
+sys_nanosleep(const_userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec req, when;
+	int result;
+
+	result = copyin(user_req, &req, sizeof(req));
+	if (result) {
+		return result;
+	}
+	if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	gettime(&when);
+	timespec_add(&when, &req, &when);
+	thread_sleep_until(&when);
+
+	if (user_rem != NULL) {
+		req.tv_sec = 0;
+		req.tv_nsec = 0;
+		result = copyout(&req, user_rem, sizeof(req));
+		if (result) {
+			return result;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Futex test.
+ *
+ * There are no user programs in this tree to try the system call
+ * with, so this drives futex_wait and futex_wake directly on a kernel
+ * word. It checks that a wait on a word that doesn't hold the
+ * expected value fails with EAGAIN without sleeping, that wakes on
+ * an address nobody sleeps on wake nobody, and that a number of
+ * sleepers are woken one per futex_wake(..., 1) until all are awake.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <synch.h>
+#include <syscall.h>
+#include <test.h>
+
+#define FXTHREADS  8
+
+static int fxword;
+static int fxother;
+static struct semaphore *fxdonesem;
+static volatile unsigned fxerrors;
+
+static
+void
+fxthread(void *junk, unsigned long num)
+{
+	int result;
+
+	(void)junk;
+
+	/* fxword stays 0, so we sleep until woken */
+	result = futex_wait(NULL, (userptr_t)&fxword, 0);
+	if (result) {
+		kprintf("fx1: thread %lu: futex_wait: %s\n",
+			num, strerror(result));
+		fxerrors++;
+	}
+	V(fxdonesem);
+}
+
+int
+futextest(int nargs, char **args)
+{
+	unsigned i, woken;
+	int n, result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting futex test...\n");
+
+	fxdonesem = sem_create("fxdone", 0);
+	if (fxdonesem == NULL) {
+		panic("fx1: sem_create failed\n");
+	}
+	fxerrors = 0;
+	fxword = 0;
+	fxother = 5;
+
+	result = futex_wait(NULL, (userptr_t)&fxother, 4);
+	if (result != EAGAIN) {
+		kprintf("fx1: wait on mismatched value returned %d, "
+			"expected EAGAIN\n", result);
+		fxerrors++;
+	}
+
+	for (i=0; i<FXTHREADS; i++) {
+		result = thread_fork("fxthread", NULL, fxthread, NULL, i);
+		if (result) {
+			panic("fx1: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	/*
+	 * Wake the sleepers one at a time. Some may not be asleep yet;
+	 * then there's nobody to wake and we let them get there.
+	 */
+	woken = 0;
+	while (woken < FXTHREADS) {
+		n = futex_wake(NULL, (userptr_t)&fxother, FXTHREADS);
+		if (n != 0) {
+			kprintf("fx1: wake on another word woke %d\n", n);
+			fxerrors++;
+		}
+		n = futex_wake(NULL, (userptr_t)&fxword, 1);
+		if (n < 0 || n > 1) {
+			kprintf("fx1: wake of 1 woke %d\n", n);
+			fxerrors++;
+		}
+		if (n == 0) {
+			thread_yield();
+		}
+		woken += n;
+	}
+	for (i=0; i<FXTHREADS; i++) {
+		P(fxdonesem);
+	}
+
+	n = futex_wake(NULL, (userptr_t)&fxword, FXTHREADS);
+	if (n != 0) {
+		kprintf("fx1: %d sleepers left after all were woken\n", n);
+		fxerrors++;
+	}
+
+	sem_destroy(fxdonesem);
+	fxdonesem = NULL;
+
+	if (fxerrors > 0) {
+		kprintf("Futex test failed: %u errors\n", fxerrors);
+		return 1;
+	}
+	kprintf("Futex test done.\n");
+	return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Process table test.
+ *
+ * Creates a number of processes (1000 unless given on the command
+ * line) and keeps them alive, so the pid table has to grow and
+ * allocation can't find free pids just by luck, and then times
+ * forking one more process over and over: create it, start a thread
+ * in it that exits at once, and wait for it. (There's no address
+ * space to copy, so this is the process side of fork only.) Checks
+ * on the way that every live process can be found by its pid, that
+ * no pid is handed out twice, and that the exit status comes back.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <proc.h>
+#include <thread.h>
+#include <rcu.h>
+#include <test.h>
+
+#define PTNPROCS   1000
+#define PTCYCLES   2000
+#define PTSTATUS   42
+
+static
+void
+proctestchild(void *junk, unsigned long junk2)
+{
+	(void)junk;
+	(void)junk2;
+
+	proc_exit(PTSTATUS);
+	thread_exit();
+}
+
+int
+proctest(int nargs, char **args)
+{
+	struct proc **procs, *p;
+	struct timespec before, after;
+	unsigned i, j, nprocs, usecs, errors;
+	int spl, result;
+
+	nprocs = PTNPROCS;
+	if (nargs > 1) {
+		nprocs = atoi(args[1]);
+	}
+
+	kprintf("Starting process table test with %u live processes...\n",
+		nprocs);
+
+	procs = kmalloc(nprocs * sizeof(procs[0]));
+	if (procs == NULL) {
+		panic("pt1: Out of memory\n");
+	}
+
+	errors = 0;
+	gettime(&before);
+	for (i=0; i<nprocs; i++) {
+		result = proc_create_runprogram("pt1", &procs[i]);
+		if (result) {
+			panic("pt1: proc_create failed: %s\n", strerror(result));
+		}
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &after);
+	usecs = after.tv_sec * 1000000 + after.tv_nsec / 1000;
+	kprintf("Created %u processes in %u us\n", nprocs, usecs);
+
+	for (i=0; i<nprocs; i++) {
+		spl = rcu_read_lock();
+		p = proc_search_pid(procs[i]->p_pid);
+		rcu_read_unlock(spl);
+		if (p != procs[i]) {
+			kprintf("pt1: pid %d not found\n", procs[i]->p_pid);
+			errors++;
+		}
+	}
+
+	gettime(&before);
+	for (j=0; j<PTCYCLES; j++) {
+		result = proc_create_runprogram("pt1", &p);
+		if (result) {
+			panic("pt1: proc_create failed: %s\n", strerror(result));
+		}
+		for (i=0; i<nprocs && j<4; i++) {
+			if (procs[i]->p_pid == p->p_pid) {
+				kprintf("pt1: pid %d handed out twice\n",
+					p->p_pid);
+				errors++;
+			}
+		}
+		result = thread_fork("pt1", p, proctestchild, NULL, 0);
+		if (result) {
+			panic("pt1: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+		if (proc_wait(p) != PTSTATUS) {
+			kprintf("pt1: wrong exit status\n");
+			errors++;
+		}
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &after);
+	usecs = after.tv_sec * 1000000 + after.tv_nsec / 1000;
+	kprintf("%u fork/exit/wait cycles in %u us, %u ns each\n",
+		PTCYCLES, usecs, usecs * 1000 / PTCYCLES);
+
+	for (i=0; i<nprocs; i++) {
+		proc_destroy(procs[i]);
+	}
+	kfree(procs);
+
+	if (errors > 0) {
+		kprintf("Process table test failed: %u errors\n", errors);
+		return 1;
+	}
+	kprintf("Process table test done.\n");
+	return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * Spinlock contention benchmark.
+ *
+ * One thread per cpu, bound to it, takes and releases a shared
+ * spinlock as fast as it can for a couple of seconds, doing a little
+ * work inside. We report for each cpu how many times it got the lock
+ * and the average time per acquisition, and then how evenly the lock
+ * was shared out: the least successful cpu's count as a percentage
+ * of the most successful one's. With test-and-set spinlocks the cpu
+ * that just released the lock tends to win it straight back; with
+ * the ticketlock option this should be close to 100%.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define SPSECONDS  2
+#define SPWORK     20
+
+static struct spinlock splk = SPINLOCK_INITIALIZER;
+static struct semaphore *spdonesem;
+static volatile bool spstart, spstop;
+static volatile unsigned spshared;
+static unsigned *spcounts;
+
+static
+void
+sptestthread(void *junk, unsigned long num)
+{
+	unsigned i, count;
+
+	(void)junk;
+
+	while (!spstart) {
+		thread_yield();
+	}
+
+	count = 0;
+	while (!spstop) {
+		spinlock_acquire(&splk);
+		for (i=0; i<SPWORK; i++) {
+			spshared++;
+		}
+		spinlock_release(&splk);
+		count++;
+	}
+	spcounts[num] = count;
+	V(spdonesem);
+}
+
+int
+spinlocktest(int nargs, char **args)
+{
+	struct timespec before, after;
+	unsigned i, ncpus, usecs, total, min, max;
+	char name[16];
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting spinlock contention test (%s locks)...\n",
+		OPT_TICKETLOCK ? "ticket" : "test-and-set");
+
+	ncpus = cpu_count();
+	spcounts = kmalloc(ncpus * sizeof(spcounts[0]));
+	if (spcounts == NULL) {
+		panic("sp1: Out of memory\n");
+	}
+	spdonesem = sem_create("spdone", 0);
+	if (spdonesem == NULL) {
+		panic("sp1: sem_create failed\n");
+	}
+	spstart = spstop = false;
+	spshared = 0;
+
+	for (i=0; i<ncpus; i++) {
+		snprintf(name, sizeof(name), "sp1.%u", i);
+		result = thread_fork_bound(name, cpu_bynumber(i),
+					   sptestthread, NULL, i);
+		if (result) {
+			panic("sp1: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	gettime(&before);
+	spstart = true;
+	clocksleep(SPSECONDS);
+	spstop = true;
+	gettime(&after);
+	for (i=0; i<ncpus; i++) {
+		P(spdonesem);
+	}
+
+	timespec_sub(&after, &before, &after);
+	usecs = after.tv_sec * 1000000 + after.tv_nsec / 1000;
+
+	total = 0;
+	min = max = spcounts[0];
+	for (i=0; i<ncpus; i++) {
+		kprintf("cpu%u: %u acquisitions, %u ns each\n", i,
+			spcounts[i],
+			spcounts[i] ? usecs * 1000 / spcounts[i] : 0);
+		total += spcounts[i];
+		if (spcounts[i] < min) {
+			min = spcounts[i];
+		}
+		if (spcounts[i] > max) {
+			max = spcounts[i];
+		}
+	}
+	kprintf("Total %u acquisitions; fairness (min/max) %u%%\n",
+		total, max ? min * 100 / max : 100);
+
+	sem_destroy(spdonesem);
+	spdonesem = NULL;
+	kfree(spcounts);
+	spcounts = NULL;
+
+	if (spshared != total * SPWORK) {
+		kprintf("Spinlock test failed: counter is %u, expected %u\n",
+			spshared, total * SPWORK);
+		return 1;
+	}
+	kprintf("Spinlock test done.\n");
+	return 0;
+}
@@ -32,9 +32,13 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
+#include <cpu.h>
+#include <current.h>
 #include <thread.h>
+#include <kern/resource.h>
 #include <synch.h>
 #include <test.h>
 
@@ -192,17 +196,17 @@ locktestthread(void *junk, unsigned long num)
 }
 
 
-int
-locktest(int nargs, char **args)
+/*
+ * Run the lock test threads once and report how long they took.
+ */
+static
+void
+locktest_run(const char *what)
 {
+	struct timespec before, after;
 	int i, result;
 
-	(void)nargs;
-	(void)args;
-
-	inititems();
-	kprintf("Starting lock test...\n");
-
+	gettime(&before);
 	for (i=0; i<NTHREADS; i++) {
 		result = thread_fork("synchtest", NULL, locktestthread,
 				     NULL, i);
@@ -214,6 +218,33 @@ locktest(int nargs, char **args)
 	for (i=0; i<NTHREADS; i++) {
 		P(donesem);
 	}
+	gettime(&after);
+	timespec_sub(&after, &before, &after);
+	kprintf("%s: %llu.%09lu seconds\n", what,
+		(unsigned long long)after.tv_sec,
+		(unsigned long)after.tv_nsec);
+}
+
+/*
+ * The test is run twice, with adaptive spinning and without, to
+ * compare the two.
+ */
+int
+locktest(int nargs, char **args)
+{
+	unsigned spinlimit;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting lock test...\n");
+
+	spinlimit = lock_spinlimit;
+	locktest_run("Adaptive locks");
+	lock_spinlimit = 0;
+	locktest_run("Blocking locks");
+	lock_spinlimit = spinlimit;
 
 	kprintf("Lock test done.\n");
 
@@ -399,3 +430,460 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Reader-writer lock test.
+ *
+ * Every fourth thread is a writer. Writers update the test values
+ * and readers check they are consistent, both yielding halfway, so a
+ * reader overlapping a writer shows up. We also keep count of who is
+ * inside the lock, to check directly that writers are alone and to
+ * see how many readers got in together.
+ */
+
+#define NRWLOOPS      40
+
+static struct rwlock *testrw;
+static struct spinlock rwstatlock = SPINLOCK_INITIALIZER;
+static unsigned rwreaders, rwwriters, rwmaxreaders, rwerrors;
+
+static
+void
+rwtest_enter(bool writer)
+{
+	spinlock_acquire(&rwstatlock);
+	if (writer) {
+		if (rwreaders > 0 || rwwriters > 0) {
+			rwerrors++;
+		}
+		rwwriters++;
+	}
+	else {
+		if (rwwriters > 0) {
+			rwerrors++;
+		}
+		rwreaders++;
+		if (rwreaders > rwmaxreaders) {
+			rwmaxreaders = rwreaders;
+		}
+	}
+	spinlock_release(&rwstatlock);
+}
+
+static
+void
+rwtest_leave(bool writer, bool ok)
+{
+	spinlock_acquire(&rwstatlock);
+	if (writer) {
+		rwwriters--;
+	}
+	else {
+		rwreaders--;
+	}
+	if (!ok) {
+		rwerrors++;
+	}
+	spinlock_release(&rwstatlock);
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	unsigned long val;
+	bool writer, ok;
+	int i;
+
+	(void)junk;
+
+	writer = (num % 4 == 0);
+	for (i=0; i<NRWLOOPS; i++) {
+		if (writer) {
+			rwlock_acquire_write(testrw);
+			rwtest_enter(true);
+			testval1 = num;
+			thread_yield();
+			testval2 = num*num;
+			testval3 = num%3;
+			rwtest_leave(true, true);
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			rwtest_enter(false);
+			val = testval1;
+			thread_yield();
+			ok = testval1 == val && testval2 == val*val &&
+				testval3 == val%3;
+			rwtest_leave(false, ok);
+			rwlock_release_read(testrw);
+		}
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrw = rwlock_create("testrw");
+	if (testrw == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	testval1 = testval2 = testval3 = 0;
+	rwreaders = rwwriters = rwmaxreaders = rwerrors = 0;
+
+	kprintf("Starting rwlock test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	rwlock_destroy(testrw);
+	testrw = NULL;
+
+	kprintf("Most readers at once: %u\n", rwmaxreaders);
+	if (rwerrors > 0) {
+		kprintf("Rwlock test failed: %u errors\n", rwerrors);
+		return 1;
+	}
+	kprintf("Rwlock test done.\n");
+	return 0;
+}
+
+/*
+ * Priority inversion test.
+ *
+ * Three threads share this cpu. A low priority thread takes a lock;
+ * then a middling one starts using all the cpu it can get, and a high
+ * priority one asks for the lock. Without priority inheritance the
+ * low priority thread never gets to run again to release the lock,
+ * and the high priority one is stuck until the middling one gives up
+ * after PISECONDS. With it, the lock holder runs at the high level
+ * and hands the lock over after PIWORKMS of work.
+ */
+
+#define PISECONDS     2
+#define PIWORKMS      50
+
+static struct lock *pilock;
+static struct semaphore *piheldsem, *pistartsem;
+static volatile bool pihwaiting, pihdone;
+static struct timespec piwaited;
+
+/*
+ * Use the cpu until MS milliseconds have passed since START, or until
+ * *STOP is set.
+ */
+static
+void
+pitest_busy(const struct timespec *start, unsigned ms, volatile bool *stop)
+{
+	struct timespec now;
+
+	while (stop == NULL || !*stop) {
+		gettime(&now);
+		timespec_sub(&now, start, &now);
+		if (now.tv_sec * 1000 + now.tv_nsec / 1000000 >= ms) {
+			break;
+		}
+	}
+}
+
+static
+void
+pitest_low(void *junk, unsigned long num)
+{
+	struct timespec start;
+
+	(void)junk;
+	(void)num;
+
+	thread_setnice(curthread, PRIO_MAX);
+	lock_acquire(pilock);
+	V(piheldsem);
+
+	while (!pihwaiting) {
+		/* spin; the others preempt us */
+	}
+	gettime(&start);
+	pitest_busy(&start, PIWORKMS, NULL);
+
+	lock_release(pilock);
+	V(donesem);
+}
+
+static
+void
+pitest_middle(void *junk, unsigned long num)
+{
+	struct timespec start;
+
+	(void)junk;
+	(void)num;
+
+	thread_setnice(curthread, PRIO_MIN / 2);
+	P(piheldsem);
+	V(pistartsem);
+	gettime(&start);
+	pitest_busy(&start, PISECONDS * 1000, &pihdone);
+	V(donesem);
+}
+
+static
+void
+pitest_high(void *junk, unsigned long num)
+{
+	struct timespec start, end;
+
+	(void)junk;
+	(void)num;
+
+	thread_setnice(curthread, PRIO_MIN);
+	P(pistartsem);
+	gettime(&start);
+	pihwaiting = true;
+	lock_acquire(pilock);
+	gettime(&end);
+	lock_release(pilock);
+	pihdone = true;
+
+	timespec_sub(&end, &start, &piwaited);
+	V(donesem);
+}
+
+int
+pitest(int nargs, char **args)
+{
+	static void (*const funcs[3])(void *, unsigned long) = {
+		pitest_low, pitest_middle, pitest_high,
+	};
+	static const char *const names[3] = {
+		"pitest.low", "pitest.middle", "pitest.high",
+	};
+	struct cpu *c;
+	unsigned ms;
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	pilock = lock_create("pilock");
+	piheldsem = sem_create("piheld", 0);
+	pistartsem = sem_create("pistart", 0);
+	if (pilock == NULL || piheldsem == NULL || pistartsem == NULL) {
+		panic("pitest: out of memory\n");
+	}
+	pihwaiting = pihdone = false;
+
+	kprintf("Starting priority inversion test...\n");
+
+	/*
+	 * All on this cpu, so they have to compete for it. Each waits
+	 * for the one before to get going.
+	 */
+	c = curcpu->c_self;
+	for (i=0; i<3; i++) {
+		result = thread_fork_bound(names[i], c, funcs[i], NULL, 0);
+		if (result) {
+			panic("pitest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<3; i++) {
+		P(donesem);
+	}
+
+	lock_destroy(pilock);
+	pilock = NULL;
+	sem_destroy(piheldsem);
+	piheldsem = NULL;
+	sem_destroy(pistartsem);
+	pistartsem = NULL;
+
+	ms = piwaited.tv_sec * 1000 + piwaited.tv_nsec / 1000000;
+	kprintf("High priority thread waited %u ms for the lock\n", ms);
+	if (ms >= PISECONDS * 1000) {
+		kprintf("Priority inversion test failed\n");
+		return 1;
+	}
+	kprintf("Priority inversion test done.\n");
+	return 0;
+}
+
+/*
+ * Timed wait test.
+ *
+ * Check that P_timed and cv_timedwait give up with ETIMEDOUT after
+ * about the right time when nobody wakes them, and return 0 early
+ * when someone does; and that sem_tryP never waits.
+ */
+
+#define TIMEDMS       100
+#define TIMEDSLOPMS   50
+
+static struct semaphore *timedsem;
+
+/*
+ * Milliseconds since START.
+ */
+static
+unsigned
+timedtest_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	gettime(&now);
+	timespec_sub(&now, start, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * After TIMEDMS/2, V timedsem (NUM == 0) or signal testcv (NUM == 1).
+ */
+static
+void
+timedwaker(void *junk, unsigned long num)
+{
+	struct timespec when;
+
+	(void)junk;
+
+	gettime(&when);
+	when.tv_nsec += TIMEDMS / 2 * 1000000;
+	if (when.tv_nsec >= 1000000000) {
+		when.tv_sec++;
+		when.tv_nsec -= 1000000000;
+	}
+	thread_sleep_until(&when);
+
+	if (num == 0) {
+		V(timedsem);
+	}
+	else {
+		lock_acquire(testlock);
+		cv_signal(testcv, testlock);
+		lock_release(testlock);
+	}
+}
+
+/*
+ * Check one timed wait: it should have returned EXPECTED, taking
+ * about TIMEDMS if that's ETIMEDOUT and less otherwise.
+ */
+static
+bool
+timedtest_check(const char *what, int result, int expected, unsigned ms)
+{
+	bool ok;
+
+	if (expected == ETIMEDOUT) {
+		ok = result == ETIMEDOUT && ms >= TIMEDMS &&
+			ms < TIMEDMS + TIMEDSLOPMS;
+	}
+	else {
+		ok = result == 0 && ms < TIMEDMS;
+	}
+	kprintf("%s: %s after %u ms: %s\n", what,
+		result ? strerror(result) : "woken", ms,
+		ok ? "ok" : "FAILED");
+	return ok;
+}
+
+int
+timedtest(int nargs, char **args)
+{
+	struct timespec start, timeout;
+	unsigned ms;
+	bool ok;
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	timedsem = sem_create("timedsem", 0);
+	if (timedsem == NULL) {
+		panic("timedtest: sem_create failed\n");
+	}
+	timeout.tv_sec = 0;
+	timeout.tv_nsec = TIMEDMS * 1000000;
+	ok = true;
+
+	kprintf("Starting timed wait test...\n");
+
+	if (sem_tryP(timedsem)) {
+		kprintf("sem_tryP on an empty semaphore succeeded\n");
+		ok = false;
+	}
+	V(timedsem);
+	if (!sem_tryP(timedsem)) {
+		kprintf("sem_tryP on a full semaphore failed\n");
+		ok = false;
+	}
+
+	/* First with nobody to wake us, then with a waker. */
+	for (i=0; i<2; i++) {
+		if (i == 1) {
+			result = thread_fork("timedwaker", NULL,
+					     timedwaker, NULL, 0);
+			if (result) {
+				panic("timedtest: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		gettime(&start);
+		result = P_timed(timedsem, &timeout);
+		ms = timedtest_since(&start);
+		ok &= timedtest_check("P_timed", result,
+				      i == 0 ? ETIMEDOUT : 0, ms);
+	}
+
+	for (i=0; i<2; i++) {
+		lock_acquire(testlock);
+		if (i == 1) {
+			result = thread_fork("timedwaker", NULL,
+					     timedwaker, NULL, 1);
+			if (result) {
+				panic("timedtest: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		gettime(&start);
+		result = cv_timedwait(testcv, testlock, &timeout);
+		ms = timedtest_since(&start);
+		if (!lock_do_i_hold(testlock)) {
+			kprintf("cv_timedwait returned without the lock\n");
+			ok = false;
+		}
+		lock_release(testlock);
+		ok &= timedtest_check("cv_timedwait", result,
+				      i == 0 ? ETIMEDOUT : 0, ms);
+	}
+
+	sem_destroy(timedsem);
+	timedsem = NULL;
+
+	if (!ok) {
+		kprintf("Timed wait test failed\n");
+		return 1;
+	}
+	kprintf("Timed wait test done.\n");
+	return 0;
+}
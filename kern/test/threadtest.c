@@ -32,6 +32,7 @@
  */
 #include <types.h>
 #include <lib.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -144,3 +145,57 @@ threadtest2(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Fork/exit latency benchmark. Forks NFORKLAT trivial threads one at
+ * a time, waiting for each to run before forking the next, and reports
+ * the average cost of the round trip. Since exited threads are reused
+ * by thread_fork, after the first few this measures the thread cache.
+ */
+
+#define NFORKLAT  1000
+
+static
+void
+nullthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	V(tsem);
+}
+
+int
+threadtest4(int nargs, char **args)
+{
+	struct timespec before, after, duration;
+	unsigned long usecs;
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	init_sem();
+	kprintf("Starting thread test 4 (fork/exit latency)...\n");
+
+	gettime(&before);
+	for (i=0; i<NFORKLAT; i++) {
+		result = thread_fork("forklat", NULL, nullthread, NULL, i);
+		if (result) {
+			panic("threadtest4: thread_fork failed %s)\n",
+			      strerror(result));
+		}
+		P(tsem);
+	}
+	gettime(&after);
+
+	timespec_sub(&after, &before, &duration);
+	usecs = (unsigned long) duration.tv_sec * 1000000
+		+ duration.tv_nsec / 1000;
+	kprintf("%d forks in %llu.%09lu seconds: %lu us per fork+exit\n",
+		NFORKLAT, (unsigned long long) duration.tv_sec,
+		(unsigned long) duration.tv_nsec, usecs / NFORKLAT);
+	kprintf("Thread test 4 done.\n");
+
+	return 0;
+}
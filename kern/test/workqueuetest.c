@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Work queue test.
+ *
+ * Submits a batch of work items spread over all cpus from a thread,
+ * checking that each runs on the cpu it was sent to and in thread
+ * context, and then submits one from interrupt context (a timer
+ * callback).
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <clock.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <workqueue.h>
+#include <test.h>
+
+#define NWORK  64
+
+static struct semaphore *wqsem;
+static struct work wqitems[NWORK];
+static unsigned wqcpus[NWORK];
+static volatile unsigned wqerrors;
+
+static
+void
+wqfunc(void *data)
+{
+	unsigned n = (uintptr_t)data;
+
+	if (curthread->t_in_interrupt) {
+		kprintf("wq1: work %u ran in interrupt context\n", n);
+		wqerrors++;
+	}
+	if (curcpu->c_number != wqcpus[n]) {
+		kprintf("wq1: work %u ran on cpu %u, expected %u\n",
+			n, curcpu->c_number, wqcpus[n]);
+		wqerrors++;
+	}
+	V(wqsem);
+}
+
+/*
+ * Timer callback: runs in interrupt context on cpu 0.
+ */
+static
+void
+wqtimerfunc(void *data)
+{
+	struct work *w = data;
+
+	if (!work_submit(w)) {
+		wqerrors++;
+	}
+}
+
+int
+workqueuetest(int nargs, char **args)
+{
+	struct timer tm;
+	struct timespec when;
+	unsigned i, ncpus;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting workqueue test...\n");
+
+	wqsem = sem_create("wqsem", 0);
+	if (wqsem == NULL) {
+		panic("wq1: sem_create failed\n");
+	}
+	wqerrors = 0;
+
+	ncpus = cpu_count();
+	for (i=0; i<NWORK; i++) {
+		wqcpus[i] = i % ncpus;
+		work_init(&wqitems[i], wqfunc, (void *)(uintptr_t)i);
+		if (!work_submit_cpu(&wqitems[i], cpu_bynumber(wqcpus[i]))) {
+			panic("wq1: fresh work item already queued\n");
+		}
+	}
+	for (i=0; i<NWORK; i++) {
+		P(wqsem);
+	}
+
+	/* Timer callbacks run on cpu 0, and work_submit uses curcpu. */
+	wqcpus[0] = 0;
+	timer_init(&tm, wqtimerfunc, &wqitems[0]);
+	gettime(&when);
+	timer_start(&tm, &when);
+	P(wqsem);
+
+	sem_destroy(wqsem);
+	wqsem = NULL;
+
+	if (wqerrors > 0) {
+		kprintf("Workqueue test failed: %u errors\n", wqerrors);
+		return 1;
+	}
+	kprintf("Workqueue test done.\n");
+	return 0;
+}
@@ -30,17 +30,19 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spl.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution than one second.
+ * This is pretty primitive. There is the once-a-second lbolt, and
+ * one-shot timers (see below) that schedule callbacks or wakeups at
+ * specific points in the future with a resolution of one hardclock.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -50,8 +52,7 @@
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define SCHEDULE_HARDCLOCKS	HZ	/* Reschedule once a second. */
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
@@ -59,17 +60,236 @@
 static struct wchan *lbolt;
 static struct spinlock lbolt_lock;
 
+/*
+ * Timers are kept on a hashed timing wheel: a timer expiring at tick
+ * number N (counting HZ ticks of the time of day) goes on the list of
+ * bucket N % TIMER_WHEELSIZE. Starting and stopping a timer is then
+ * constant time, and each hardclock only looks at the buckets for the
+ * ticks that have passed since the previous one. Timers that are more
+ * than a turn of the wheel away are passed over until their turn.
+ *
+ * Because tick numbers come from the time of day rather than from
+ * counting hardclocks, missed ticks (e.g. while CPU 0 isn't ticking
+ * with the tickless option) are caught up on correctly.
+ *
+ * Threads in thread_sleep_until wait on the wait channel of their
+ * timer's bucket.
+ *
+ * Everything is protected by timer_lock.
+ */
+#define TIMER_WHEELSIZE		64	/* must be a power of 2 */
+#define TIMER_NSECPERTICK	(1000000000 / HZ)
+
+static struct timer *timer_wheel[TIMER_WHEELSIZE];
+static struct wchan *timer_wchans[TIMER_WHEELSIZE];
+static struct spinlock timer_lock;
+static unsigned timer_count;		/* number of pending timers */
+static uint64_t timer_lasttick;		/* last tick processed */
+
 /*
  * Setup.
  */
 void
 hardclock_bootstrap(void)
 {
+	unsigned i;
+
 	spinlock_init(&lbolt_lock);
+	spinlock_setname(&lbolt_lock, "lbolt");
 	lbolt = wchan_create("lbolt");
 	if (lbolt == NULL) {
 		panic("Couldn't create lbolt\n");
 	}
+
+	spinlock_init(&timer_lock);
+	spinlock_setname(&timer_lock, "timer");
+	for (i=0; i<TIMER_WHEELSIZE; i++) {
+		timer_wheel[i] = NULL;
+		timer_wchans[i] = wchan_create("timer");
+		if (timer_wchans[i] == NULL) {
+			panic("Couldn't create timer wait channels\n");
+		}
+	}
+	timer_count = 0;
+	timer_lasttick = 0;
+}
+
+/*
+ * Convert a time of day to a tick number. If ROUNDUP is true, times
+ * between ticks go to the following tick, so that timers never fire
+ * early.
+ */
+static
+uint64_t
+timer_ticks(const struct timespec *ts, bool roundup)
+{
+	uint64_t tick;
+
+	tick = (uint64_t)ts->tv_sec * HZ + ts->tv_nsec / TIMER_NSECPERTICK;
+	if (roundup && ts->tv_nsec % TIMER_NSECPERTICK != 0) {
+		tick++;
+	}
+	return tick;
+}
+
+/*
+ * Put a timer on the wheel. Call with timer_lock held.
+ */
+static
+void
+timer_insert(struct timer *tm, const struct timespec *when)
+{
+	struct timer **bucket;
+
+	KASSERT(spinlock_do_i_hold(&timer_lock));
+	KASSERT(!tm->tm_pending);
+
+	tm->tm_tick = timer_ticks(when, true);
+	if (tm->tm_tick <= timer_lasttick) {
+		/* Already passed; fire on the next tick we look at */
+		tm->tm_tick = timer_lasttick + 1;
+	}
+
+	bucket = &timer_wheel[tm->tm_tick & (TIMER_WHEELSIZE - 1)];
+	tm->tm_prev = NULL;
+	tm->tm_next = *bucket;
+	if (tm->tm_next != NULL) {
+		tm->tm_next->tm_prev = tm;
+	}
+	*bucket = tm;
+	tm->tm_pending = true;
+	timer_count++;
+}
+
+/*
+ * Take a pending timer off the wheel. Call with timer_lock held.
+ */
+static
+void
+timer_remove(struct timer *tm)
+{
+	KASSERT(spinlock_do_i_hold(&timer_lock));
+	KASSERT(tm->tm_pending);
+
+	if (tm->tm_prev != NULL) {
+		tm->tm_prev->tm_next = tm->tm_next;
+	}
+	else {
+		timer_wheel[tm->tm_tick & (TIMER_WHEELSIZE - 1)] = tm->tm_next;
+	}
+	if (tm->tm_next != NULL) {
+		tm->tm_next->tm_prev = tm->tm_prev;
+	}
+	tm->tm_next = tm->tm_prev = NULL;
+	tm->tm_pending = false;
+	KASSERT(timer_count > 0);
+	timer_count--;
+}
+
+void
+timer_init(struct timer *tm, void (*func)(void *), void *data)
+{
+	tm->tm_tick = 0;
+	tm->tm_pending = false;
+	tm->tm_func = func;
+	tm->tm_data = data;
+	tm->tm_next = tm->tm_prev = NULL;
+}
+
+void
+timer_start(struct timer *tm, const struct timespec *when)
+{
+	spinlock_acquire(&timer_lock);
+	timer_insert(tm, when);
+#if OPT_TICKLESS
+	thread_tickstart();
+#endif
+	spinlock_release(&timer_lock);
+}
+
+bool
+timer_stop(struct timer *tm)
+{
+	bool ret;
+
+	spinlock_acquire(&timer_lock);
+	ret = tm->tm_pending;
+	if (ret) {
+		timer_remove(tm);
+	}
+	spinlock_release(&timer_lock);
+	return ret;
+}
+
+bool
+timer_anypending(void)
+{
+	/* unlocked read; only a hint */
+	return timer_count > 0;
+}
+
+/*
+ * Expire the timers whose time has come. Called from hardclock on
+ * CPU 0.
+ *
+ * Timers with functions are collected on a private list and run after
+ * releasing timer_lock, so they can take other locks (including those
+ * held by callers of timer_start and timer_stop) freely.
+ */
+static
+void
+timer_run(void)
+{
+	struct timespec now;
+	struct timer *tm, *next, *expired;
+	uint64_t tick, nowtick;
+	unsigned b;
+	bool wake;
+
+	if (timer_count == 0) {
+		/* unlocked check, to skip gettime() in the common case */
+		return;
+	}
+
+	gettime(&now);
+	nowtick = timer_ticks(&now, false);
+	expired = NULL;
+
+	spinlock_acquire(&timer_lock);
+	if (nowtick - timer_lasttick > TIMER_WHEELSIZE) {
+		/* Been a while; look at every bucket once */
+		timer_lasttick = nowtick - TIMER_WHEELSIZE;
+	}
+	for (tick = timer_lasttick + 1; tick <= nowtick; tick++) {
+		b = tick & (TIMER_WHEELSIZE - 1);
+		wake = false;
+		for (tm = timer_wheel[b]; tm != NULL; tm = next) {
+			next = tm->tm_next;
+			if (tm->tm_tick > nowtick) {
+				/* A later turn of the wheel */
+				continue;
+			}
+			timer_remove(tm);
+			if (tm->tm_func == NULL) {
+				wake = true;
+			}
+			else {
+				tm->tm_next = expired;
+				expired = tm;
+			}
+		}
+		if (wake) {
+			wchan_wakeall(timer_wchans[b], &timer_lock);
+		}
+	}
+	timer_lasttick = nowtick;
+	spinlock_release(&timer_lock);
+
+	for (tm = expired; tm != NULL; tm = next) {
+		next = tm->tm_next;
+		tm->tm_next = NULL;
+		tm->tm_func(tm->tm_data);
+	}
 }
 
 /*
@@ -87,7 +307,8 @@ timerclock(void)
 
 /*
  * This is called HZ times a second (on each processor) by the timer
- * code.
+ * code. With the tickless option, the scheduler turns it off on
+ * processors that are idle or have only one thread to run.
  */
 void
 hardclock(void)
@@ -97,13 +318,23 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
+	curcpu->c_rcu_qs++;	/* See rcu.h */
+	if (curcpu->c_number == 0) {
+		timer_run();
 	}
-	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
+	/*
+	 * c_hardclocks can jump when the tickless code catches up on
+	 * hardclocks missed while it was off, so don't look for an
+	 * exact multiple of SCHEDULE_HARDCLOCKS.
+	 */
+	if (curcpu->c_hardclocks - curcpu->c_lastschedule >=
+	    SCHEDULE_HARDCLOCKS) {
+		curcpu->c_lastschedule = curcpu->c_hardclocks;
 		schedule();
 	}
-	thread_yield();
+	if (thread_tick()) {
+		thread_yield();
+	}
 }
 
 /*
@@ -119,3 +350,116 @@ clocksleep(int num_secs)
 	}
 	spinlock_release(&lbolt_lock);
 }
+
+/*
+ * Suspend execution until time WHEN. The timer has no function, so
+ * timer_run just wakes up its bucket's wait channel; sleepers on the
+ * same bucket with later timers go back to sleep.
+ */
+void
+thread_sleep_until(const struct timespec *when)
+{
+	struct timer tm;
+	struct wchan *wc;
+
+	timer_init(&tm, NULL, NULL);
+
+	spinlock_acquire(&timer_lock);
+	timer_insert(&tm, when);
+#if OPT_TICKLESS
+	thread_tickstart();
+#endif
+	wc = timer_wchans[tm.tm_tick & (TIMER_WHEELSIZE - 1)];
+	while (tm.tm_pending) {
+		wchan_sleep(wc, &timer_lock);
+	}
+	spinlock_release(&timer_lock);
+}
+
+/*
+ * CPU time accounting.
+ */
+
+void
+cputimes_init(struct cputimes *ct)
+{
+	ct->ct_ucycles = 0;
+	ct->ct_scycles = 0;
+	ct->ct_icycles = 0;
+	ct->ct_nvcsw = 0;
+	ct->ct_nivcsw = 0;
+}
+
+void
+cputimes_add(struct cputimes *total, const struct cputimes *ct)
+{
+	total->ct_ucycles += ct->ct_ucycles;
+	total->ct_scycles += ct->ct_scycles;
+	total->ct_icycles += ct->ct_icycles;
+	total->ct_nvcsw += ct->ct_nvcsw;
+	total->ct_nivcsw += ct->ct_nivcsw;
+}
+
+/*
+ * Charge DELTA to the times in CT according to STATE.
+ */
+static
+void
+cputime_charge(struct cputimes *ct, int state, uint64_t delta)
+{
+	switch (state) {
+	    case CPUSTATE_USER:
+		ct->ct_ucycles += delta;
+		break;
+	    case CPUSTATE_SYS:
+		ct->ct_scycles += delta;
+		break;
+	    case CPUSTATE_INTR:
+		ct->ct_icycles += delta;
+		break;
+	}
+}
+
+/*
+ * Change the current cpu's accounting state. The first call on each
+ * cpu only starts the first interval.
+ */
+int
+cputime_enter(int state)
+{
+	uint64_t now, delta;
+	int oldstate, spl;
+
+	spl = splhigh();
+
+	oldstate = curcpu->c_cpustate;
+	curcpu->c_cpustate = state;
+
+	now = mainbus_cycles();
+	if (curcpu->c_acctstamp != 0) {
+		delta = now - curcpu->c_acctstamp;
+		if (oldstate == CPUSTATE_IDLE) {
+			curcpu->c_idlecycles += delta;
+		}
+		else {
+			cputime_charge(&curcpu->c_times, oldstate, delta);
+			if (!curcpu->c_isidle) {
+				cputime_charge(&curthread->t_times,
+					       oldstate, delta);
+			}
+		}
+	}
+	curcpu->c_acctstamp = now;
+
+	splx(spl);
+	return oldstate;
+}
+
+/*
+ * Convert a time from struct cputimes to a timespec.
+ */
+void
+cputime_totime(uint64_t cycles, struct timespec *ts)
+{
+	mainbus_cycles_to_time(cycles, ts);
+}
@@ -34,39 +34,124 @@
 #include <types.h>
 #include <lib.h>
 #include <spl.h>
+#include <membar.h>
 #include <spinlock.h>
 #include <hangman.h>
 
+/*
+ * Protects the lock order graph, and serializes deadlock checks.
+ * Waiting and holding is recorded without it: a_waiting is only
+ * written by the actor itself, and l_holding only by the holder.
+ */
 static struct spinlock hangman_lock = SPINLOCK_INITIALIZER;
 
 /*
- * Look for a path through the waits-for graph that goes from START to
+ * Sizes. The graph's edges come from a fixed pool; if it runs out,
+ * new edges are not recorded (and hangman says so, once).
+ */
+#define HANGMAN_NEDGES		2048
+#define HANGMAN_HASHSIZE	512	/* must be a power of 2 */
+#define HANGMAN_MAXCHAIN	64	/* longest waits-for chain followed */
+#define HANGMAN_CONFIRM		1000	/* times a cycle must be seen */
+#define HANGMAN_MAXPATH		8	/* longest reversal printed */
+
+/*
+ * An edge FROM -> TO in the lock order graph: TO has been taken (or
+ * waited for, or signalled) while FROM was held.
+ */
+struct hangman_edge {
+	struct hangman_lockable *e_from;
+	struct hangman_lockable *e_to;
+	struct hangman_edge *e_hashnext;	/* Hash chain */
+	struct hangman_edge *e_fromnext;	/* e_from's l_after list */
+	struct hangman_edge *e_tonext;		/* e_to's l_before list */
+};
+
+static struct hangman_edge hangman_edgepool[HANGMAN_NEDGES];
+static struct hangman_edge *hangman_freeedges;
+static struct hangman_edge *hangman_edgehash[HANGMAN_HASHSIZE];
+static bool hangman_graphready, hangman_graphfull;
+static unsigned hangman_visitgen;
+static struct hangman_lockable *hangman_stack[HANGMAN_NEDGES + 1];
+
+void
+hangman_actorinit(struct hangman_actor *a, const char *name)
+{
+	a->a_name = name;
+	a->a_waiting = NULL;
+	a->a_numheld = 0;
+}
+
+void
+hangman_lockableinit(struct hangman_lockable *l, const char *name,
+		     bool ordered)
+{
+	l->l_name = name;
+	l->l_holding = NULL;
+	l->l_ordered = ordered;
+	l->l_after = NULL;
+	l->l_before = NULL;
+	l->l_visit = 0;
+	l->l_visitedge = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// Waits-for checking
+
+/*
+ * Follow the waits-for graph from START: return true if it leads to
  * TARGET.
  *
  * Because lockables can only be held by one actor, and actors can
  * only be waiting for one thing at a time, this turns out to be
- * quite simple.
+ * quite simple. Since the fields are read without locking, though,
+ * the walk is bounded in case it catches things changing.
  */
 static
-void
-hangman_check(const struct hangman_lockable *start,
-	      const struct hangman_actor *target)
+bool
+hangman_findcycle(const struct hangman_lockable *start,
+		  const struct hangman_actor *target)
 {
 	const struct hangman_actor *cur;
+	const struct hangman_lockable *l;
+	unsigned n;
 
 	cur = start->l_holding;
-	while (cur != NULL) {
+	for (n=0; cur != NULL && n < HANGMAN_MAXCHAIN; n++) {
 		if (cur == target) {
-			goto found;
+			return true;
 		}
-		if (cur->a_waiting == NULL) {
+		l = cur->a_waiting;
+		if (l == NULL) {
 			break;
 		}
-		cur = cur->a_waiting->l_holding;
+		cur = l->l_holding;
+	}
+	return false;
+}
+
+/*
+ * Check whether waiting for START would deadlock TARGET. Called with
+ * hangman_lock held.
+ *
+ * A cycle seen in the unlocked fields could in principle be made up
+ * of states from different moments; a real deadlock doesn't go away,
+ * so it has to be seen HANGMAN_CONFIRM times running.
+ */
+static
+void
+hangman_check(const struct hangman_lockable *start,
+	      const struct hangman_actor *target)
+{
+	const struct hangman_actor *cur;
+	unsigned i;
+
+	for (i=0; i<HANGMAN_CONFIRM; i++) {
+		if (!hangman_findcycle(start, target)) {
+			return;
+		}
 	}
-	return;
 
- found:
 	/*
 	 * None of this can change while we print it (that's the point
 	 * of it being a deadlock) so drop hangman_lock while
@@ -93,18 +178,338 @@ hangman_check(const struct hangman_lockable *start,
 	panic("Deadlock.\n");
 }
 
+////////////////////////////////////////////////////////////
+// Lock order graph
+
+/*
+ * Everything here is called with hangman_lock held, except
+ * hangman_seenedge.
+ */
+
+static
+unsigned
+hangman_edgehashval(const struct hangman_lockable *from,
+		    const struct hangman_lockable *to)
+{
+	uint32_t x;
+
+	x = (uint32_t)(uintptr_t)from ^ ((uint32_t)(uintptr_t)to >> 3);
+	x *= 2654435761U;
+	return (x >> 16) & (HANGMAN_HASHSIZE - 1);
+}
+
+static
+void
+hangman_graphinit(void)
+{
+	unsigned i;
+
+	hangman_freeedges = NULL;
+	for (i=0; i<HANGMAN_NEDGES; i++) {
+		hangman_edgepool[i].e_hashnext = hangman_freeedges;
+		hangman_freeedges = &hangman_edgepool[i];
+	}
+	for (i=0; i<HANGMAN_HASHSIZE; i++) {
+		hangman_edgehash[i] = NULL;
+	}
+	hangman_graphready = true;
+}
+
+static
+struct hangman_edge *
+hangman_findedge(const struct hangman_lockable *from,
+		 const struct hangman_lockable *to)
+{
+	struct hangman_edge *e;
+
+	e = hangman_edgehash[hangman_edgehashval(from, to)];
+	for (; e != NULL; e = e->e_hashnext) {
+		if (e->e_from == from && e->e_to == to) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Like hangman_findedge, but without hangman_lock, so that an order
+ * seen before (the common case) costs no global lock. Edges are only
+ * linked in once filled in, and a removed edge has its ends cleared,
+ * so a match is a real edge. A chain can change underneath us, so the
+ * walk is bounded; a miss is just rechecked under the lock.
+ */
+static
+bool
+hangman_seenedge(const struct hangman_lockable *from,
+		 const struct hangman_lockable *to)
+{
+	struct hangman_edge *e;
+	unsigned n;
+
+	e = hangman_edgehash[hangman_edgehashval(from, to)];
+	for (n=0; e != NULL && n < HANGMAN_NEDGES; e = e->e_hashnext, n++) {
+		if (e->e_from == from && e->e_to == to) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static
+void
+hangman_addedge(struct hangman_lockable *from, struct hangman_lockable *to)
+{
+	struct hangman_edge *e, **bucket;
+
+	e = hangman_freeedges;
+	if (e == NULL) {
+		hangman_graphfull = true;
+		return;
+	}
+	hangman_freeedges = e->e_hashnext;
+
+	e->e_from = from;
+	e->e_to = to;
+	bucket = &hangman_edgehash[hangman_edgehashval(from, to)];
+	e->e_hashnext = *bucket;
+	/* for hangman_seenedge */
+	membar_store_store();
+	*bucket = e;
+	e->e_fromnext = from->l_after;
+	from->l_after = e;
+	e->e_tonext = to->l_before;
+	to->l_before = e;
+}
+
+static
+void
+hangman_removeedge(struct hangman_edge *e)
+{
+	struct hangman_edge **ep;
+
+	ep = &hangman_edgehash[hangman_edgehashval(e->e_from, e->e_to)];
+	while (*ep != e) {
+		ep = &(*ep)->e_hashnext;
+	}
+	*ep = e->e_hashnext;
+
+	ep = &e->e_from->l_after;
+	while (*ep != e) {
+		ep = &(*ep)->e_fromnext;
+	}
+	*ep = e->e_fromnext;
+
+	ep = &e->e_to->l_before;
+	while (*ep != e) {
+		ep = &(*ep)->e_tonext;
+	}
+	*ep = e->e_tonext;
+
+	/* so hangman_seenedge can't match it any more */
+	e->e_from = NULL;
+	e->e_to = NULL;
+	e->e_hashnext = hangman_freeedges;
+	hangman_freeedges = e;
+}
+
+/*
+ * Search the graph from START for TARGET. If found, the path can be
+ * traced back from TARGET through l_visitedge.
+ */
+static
+bool
+hangman_reachable(struct hangman_lockable *start,
+		  struct hangman_lockable *target)
+{
+	struct hangman_lockable *l;
+	struct hangman_edge *e;
+	unsigned sp;
+
+	hangman_visitgen++;
+	start->l_visit = hangman_visitgen;
+	start->l_visitedge = NULL;
+	hangman_stack[0] = start;
+	sp = 1;
+
+	while (sp > 0) {
+		l = hangman_stack[--sp];
+		if (l == target) {
+			return true;
+		}
+		for (e = l->l_after; e != NULL; e = e->e_fromnext) {
+			if (e->e_to->l_visit == hangman_visitgen) {
+				continue;
+			}
+			e->e_to->l_visit = hangman_visitgen;
+			e->e_to->l_visitedge = e;
+			/* each lockable is pushed once, each has an edge in */
+			KASSERT(sp < HANGMAN_NEDGES + 1);
+			hangman_stack[sp++] = e->e_to;
+		}
+	}
+	return false;
+}
+
+/*
+ * A lock order reversal, copied so it can be printed after letting
+ * go of hangman_lock.
+ */
+struct hangman_reversal {
+	unsigned r_len;
+	struct {
+		char name[24];
+		const void *ptr;
+	} r_path[HANGMAN_MAXPATH];
+};
+
+static
+void
+hangman_saveone(struct hangman_reversal *r, const struct hangman_lockable *l)
+{
+	if (r->r_len < HANGMAN_MAXPATH) {
+		snprintf(r->r_path[r->r_len].name,
+			 sizeof(r->r_path[r->r_len].name), "%s", l->l_name);
+		r->r_path[r->r_len].ptr = l;
+	}
+	r->r_len++;
+}
+
+/*
+ * Note that TO is being taken while FROM is held. If that's new,
+ * check it against the order seen so far, and remember it. Returns
+ * true, and fills in R, if it's a reversal.
+ */
+static
+bool
+hangman_order(struct hangman_lockable *from, struct hangman_lockable *to,
+	      struct hangman_reversal *r)
+{
+	struct hangman_edge *e;
+	bool reversed;
+
+	if (from == to || hangman_findedge(from, to) != NULL) {
+		/* The common case */
+		return false;
+	}
+
+	/* TO before FROM already? Then save the path TO ... FROM. */
+	reversed = hangman_reachable(to, from);
+	if (reversed) {
+		r->r_len = 0;
+		hangman_saveone(r, from);
+		for (e = from->l_visitedge; e != NULL;
+		     e = e->e_from->l_visitedge) {
+			hangman_saveone(r, e->e_from);
+		}
+	}
+
+	/* Remember it either way, so it's only reported once. */
+	hangman_addedge(from, to);
+	return reversed;
+}
+
+static
+void
+hangman_report(const struct hangman_lockable *from,
+	       const struct hangman_lockable *to,
+	       const struct hangman_reversal *r)
+{
+	unsigned i;
+
+	kprintf("hangman: Lock order reversal: %s (%p) after %s (%p),\n",
+		to->l_name, to, from->l_name, from);
+	kprintf("hangman: but previously the other way round:\n");
+	for (i=r->r_len; i-- > 0; ) {
+		if (i >= HANGMAN_MAXPATH) {
+			if (i == r->r_len - 1) {
+				kprintf("   ...\n");
+			}
+			continue;
+		}
+		kprintf("   %s (%p)%s\n", r->r_path[i].name, r->r_path[i].ptr,
+			i > 0 ? ", then" : "");
+	}
+}
+
+/*
+ * Record the order between the ordered lockable L and each of the
+ * ordered lockables A holds, except SKIP: held -> L if AFTER is true,
+ * L -> held if not. Reversals are reported, but only warned about:
+ * they haven't deadlocked, yet.
+ */
+static
+void
+hangman_orderheld(struct hangman_actor *a, struct hangman_lockable *l,
+		  const struct hangman_lockable *skip, bool after)
+{
+	struct hangman_reversal r;
+	struct hangman_lockable *held, *from, *to;
+	unsigned i, n;
+	bool reversed, full;
+
+	n = a->a_numheld;
+	if (n > HANGMAN_MAXHELD) {
+		n = HANGMAN_MAXHELD;
+	}
+	for (i=0; i<n; i++) {
+		held = a->a_held[i];
+		if (held == NULL || held == skip) {
+			continue;
+		}
+		from = after ? held : l;
+		to = after ? l : held;
+		if (from == to || hangman_seenedge(from, to)) {
+			continue;
+		}
+
+		spinlock_acquire(&hangman_lock);
+		if (!hangman_graphready) {
+			hangman_graphinit();
+		}
+		reversed = hangman_order(from, to, &r);
+		full = hangman_graphfull;
+		hangman_graphfull = false;
+		spinlock_release(&hangman_lock);
+
+		/* Print only after letting go; kprintf can sleep. */
+		if (full) {
+			kprintf("hangman: Lock order graph full\n");
+		}
+		if (reversed) {
+			hangman_report(from, to, &r);
+		}
+	}
+}
+
+/*
+ * L is going away: drop its edges.
+ */
+void
+hangman_forget(struct hangman_lockable *l)
+{
+	KASSERT(l->l_holding == NULL);
+
+	spinlock_acquire(&hangman_lock);
+	while (l->l_after != NULL) {
+		hangman_removeedge(l->l_after);
+	}
+	while (l->l_before != NULL) {
+		hangman_removeedge(l->l_before);
+	}
+	spinlock_release(&hangman_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Hooks
+
 /*
  * Note that a is about to wait for l.
  *
- * Note that there's no point calling this if a isn't going to wait,
- * because in that case l->l_holding will be null and the check
- * won't go anywhere.
- *
- * One could also maintain in memory a graph of all requests ever
- * seen, in order to detect lock order inversions that haven't
- * actually deadlocked; but there are a lot of ways in which this is
- * tricky and problematic. For now we'll settle for just detecting and
- * reporting deadlocks that do happen.
+ * If l isn't held, there's nothing to check: a is about to get it,
+ * or someone else has just beaten it there and will be the one to
+ * look if they're stuck. The barrier is so that of two actors
+ * starting to wait for each other at the same time, at least one
+ * sees the other waiting.
  */
 void
 hangman_wait(struct hangman_actor *a,
@@ -115,17 +520,23 @@ hangman_wait(struct hangman_actor *a,
 		return;
 	}
 
-	spinlock_acquire(&hangman_lock);
-
 	if (a->a_waiting != NULL) {
-		spinlock_release(&hangman_lock);
 		panic("hangman_wait: already waiting for something?\n");
 	}
 
-	hangman_check(l, a);
+	/* Before we start waiting, as reporting uses kprintf's lock */
+	if (l->l_ordered && a->a_numheld > 0) {
+		hangman_orderheld(a, l, NULL, true);
+	}
+
 	a->a_waiting = l;
+	membar_any_any();
 
-	spinlock_release(&hangman_lock);
+	if (l->l_holding != NULL) {
+		spinlock_acquire(&hangman_lock);
+		hangman_check(l, a);
+		spinlock_release(&hangman_lock);
+	}
 }
 
 void
@@ -137,15 +548,11 @@ hangman_acquire(struct hangman_actor *a,
 		return;
 	}
 
-	spinlock_acquire(&hangman_lock);
-
 	if (a->a_waiting != l) {
-		spinlock_release(&hangman_lock);
 		panic("hangman_acquire: not waiting for lock %s (%p)\n",
 		      l->l_name, l);
 	}
 	if (l->l_holding != NULL) {
-		spinlock_release(&hangman_lock);
 		panic("hangman_acquire: lock %s (%p) still held by %s (%p)\n",
 		      l->l_name, l, a->a_name, a);
 	}
@@ -153,30 +560,84 @@ hangman_acquire(struct hangman_actor *a,
 	l->l_holding = a;
 	a->a_waiting = NULL;
 
-	spinlock_release(&hangman_lock);
+	if (l->l_ordered) {
+		if (a->a_numheld < HANGMAN_MAXHELD) {
+			a->a_held[a->a_numheld] = l;
+		}
+		a->a_numheld++;
+	}
 }
 
 void
 hangman_release(struct hangman_actor *a,
 		struct hangman_lockable *l)
 {
+	unsigned i, n;
+
 	if (l == &hangman_lock.splk_hangman) {
 		/* don't recurse */
 		return;
 	}
 
-	spinlock_acquire(&hangman_lock);
-
 	if (a->a_waiting != NULL) {
-		spinlock_release(&hangman_lock);
 		panic("hangman_release: waiting for something?\n");
 	}
 	if (l->l_holding != a) {
-		spinlock_release(&hangman_lock);
 		panic("hangman_release: not the holder\n");
 	}
 
 	l->l_holding = NULL;
 
-	spinlock_release(&hangman_lock);
+	if (l->l_ordered) {
+		KASSERT(a->a_numheld > 0);
+		n = a->a_numheld < HANGMAN_MAXHELD ?
+			a->a_numheld : HANGMAN_MAXHELD;
+		/* Usually the last one taken */
+		for (i = n; i-- > 0; ) {
+			if (a->a_held[i] == l) {
+				break;
+			}
+		}
+		/* (if not found, i has wrapped round past n) */
+		if (i < n) {
+			for (; i + 1 < n; i++) {
+				a->a_held[i] = a->a_held[i + 1];
+			}
+			a->a_held[n - 1] = NULL;
+		}
+		else {
+			/* Taken after the array filled up */
+			KASSERT(a->a_numheld > HANGMAN_MAXHELD);
+		}
+		a->a_numheld--;
+	}
+}
+
+/*
+ * Note that a is about to wait for the event (CV) l, letting go of
+ * RELEASED, the lock that goes with it: anything else a holds comes
+ * before l.
+ */
+void
+hangman_waitevent(struct hangman_actor *a, struct hangman_lockable *l,
+		  const struct hangman_lockable *released)
+{
+	KASSERT(l->l_ordered);
+	if (a->a_numheld > 0) {
+		hangman_orderheld(a, l, released, true);
+	}
+}
+
+/*
+ * Note that a is signalling the event (CV) l: a waiter can't get
+ * going again until a has got hold of everything it holds now, so l
+ * comes before all of those.
+ */
+void
+hangman_signal(struct hangman_actor *a, struct hangman_lockable *l)
+{
+	KASSERT(l->l_ordered);
+	if (a->a_numheld > 0) {
+		hangman_orderheld(a, l, NULL, false);
+	}
 }
@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Lock contention statistics. See lockstat.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <current.h>
+#include <lockstat.h>
+
+#define LOCKSTAT_NCLASSES	128
+#define LOCKSTAT_NAMELEN	24
+
+/*
+ * Statistics for one class of locks.
+ *
+ * These can't be protected by spinlocks, since that's what we're
+ * instrumenting; each class has a bare lock word instead, and so
+ * does the class table. Both are only taken with interrupts off.
+ */
+struct lockstat_class {
+	volatile spinlock_data_t lc_lock;
+	char lc_name[LOCKSTAT_NAMELEN];	/* Copied; locks can go away */
+	unsigned lc_kind;
+	unsigned lc_acquires;		/* Times acquired */
+	unsigned lc_contended;		/* Times acquired after waiting */
+	uint64_t lc_spins;		/* Spin iterations while waiting */
+	struct timespec lc_waittime;	/* Total time waiting */
+	struct timespec lc_holdtime;	/* Total time held */
+};
+
+/*
+ * The table of classes. Slots are handed out in order and never
+ * given back; the last one collects everything that doesn't fit.
+ */
+static struct lockstat_class lockstat_classes[LOCKSTAT_NCLASSES];
+static unsigned lockstat_nclasses;
+static volatile spinlock_data_t lockstat_tablelock;
+
+static
+void
+lockstat_lockword(volatile spinlock_data_t *sd)
+{
+	while (spinlock_data_testandset(sd) != 0) {
+		/* spin */
+	}
+	membar_store_any();
+}
+
+static
+void
+lockstat_unlockword(volatile spinlock_data_t *sd)
+{
+	membar_any_store();
+	spinlock_data_set(sd, 0);
+}
+
+/*
+ * Check if NAME is the name of class LC, remembering that long names
+ * are cut short in the class.
+ */
+static
+bool
+lockstat_samename(const struct lockstat_class *lc, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKSTAT_NAMELEN - 1; i++) {
+		if (lc->lc_name[i] != name[i]) {
+			return false;
+		}
+		if (name[i] == 0) {
+			return true;
+		}
+	}
+	return true;
+}
+
+/*
+ * Find the class for NAME and KIND, adding it if it's new. Called
+ * with interrupts off.
+ */
+static
+struct lockstat_class *
+lockstat_findclass(const char *name, unsigned kind)
+{
+	struct lockstat_class *lc;
+	unsigned i, j;
+
+	lockstat_lockword(&lockstat_tablelock);
+	for (i=0; i<lockstat_nclasses; i++) {
+		lc = &lockstat_classes[i];
+		if (lc->lc_kind == kind && lockstat_samename(lc, name)) {
+			goto done;
+		}
+	}
+	if (lockstat_nclasses == LOCKSTAT_NCLASSES) {
+		lc = &lockstat_classes[LOCKSTAT_NCLASSES - 1];
+		goto done;
+	}
+
+	lc = &lockstat_classes[lockstat_nclasses++];
+	if (lockstat_nclasses == LOCKSTAT_NCLASSES) {
+		name = "(other)";
+	}
+	for (j=0; j<LOCKSTAT_NAMELEN - 1 && name[j] != 0; j++) {
+		lc->lc_name[j] = name[j];
+	}
+	lc->lc_name[j] = 0;
+	lc->lc_kind = kind;
+
+ done:
+	lockstat_unlockword(&lockstat_tablelock);
+	return lc;
+}
+
+/*
+ * Set up the statistics hook for a lock.
+ */
+void
+lockstat_init(struct lockstat *ls, const char *name, unsigned kind)
+{
+	ls->ls_name = name;
+	ls->ls_kind = kind;
+	ls->ls_class = NULL;
+	ls->ls_acquired.tv_sec = 0;
+	ls->ls_acquired.tv_nsec = 0;
+}
+
+/*
+ * Get the current time for the statistics, or zero if there's no
+ * clock yet.
+ */
+void
+lockstat_waitstart(struct timespec *ts)
+{
+	if (CURCPU_EXISTS() && gettime_available()) {
+		gettime(ts);
+	}
+	else {
+		ts->tv_sec = 0;
+		ts->tv_nsec = 0;
+	}
+}
+
+/*
+ * Record an acquisition of the lock LS. If it had to wait, WAITSTART
+ * is when the wait started and SPINS is the number of times round
+ * the waiting loop; otherwise WAITSTART is NULL. Called by the new
+ * holder.
+ */
+void
+lockstat_acquire(struct lockstat *ls, const struct timespec *waitstart,
+		 unsigned spins)
+{
+	struct lockstat_class *lc;
+	struct timespec waited;
+	int spl;
+
+	spl = splhigh();
+
+	lc = ls->ls_class;
+	if (lc == NULL) {
+		lc = lockstat_findclass(ls->ls_name, ls->ls_kind);
+		ls->ls_class = lc;
+	}
+
+	lockstat_waitstart(&ls->ls_acquired);
+
+	lockstat_lockword(&lc->lc_lock);
+	lc->lc_acquires++;
+	if (waitstart != NULL) {
+		lc->lc_contended++;
+		lc->lc_spins += spins;
+		if (waitstart->tv_sec != 0 && ls->ls_acquired.tv_sec != 0) {
+			timespec_sub(&ls->ls_acquired, waitstart, &waited);
+			timespec_add(&lc->lc_waittime, &waited,
+				     &lc->lc_waittime);
+		}
+	}
+	lockstat_unlockword(&lc->lc_lock);
+
+	splx(spl);
+}
+
+/*
+ * Record the release of the lock LS. Called by the holder before
+ * actually letting go.
+ */
+void
+lockstat_release(struct lockstat *ls)
+{
+	struct lockstat_class *lc;
+	struct timespec now, held;
+	int spl;
+
+	lc = ls->ls_class;
+	if (lc == NULL || ls->ls_acquired.tv_sec == 0) {
+		/* Taken before the clock existed */
+		return;
+	}
+
+	spl = splhigh();
+	lockstat_waitstart(&now);
+	if (now.tv_sec != 0) {
+		timespec_sub(&now, &ls->ls_acquired, &held);
+		lockstat_lockword(&lc->lc_lock);
+		timespec_add(&lc->lc_holdtime, &held, &lc->lc_holdtime);
+		lockstat_unlockword(&lc->lc_lock);
+	}
+	splx(spl);
+}
+
+/*
+ * Return true if class A has waited longer than class B.
+ */
+static
+bool
+lockstat_worse(const struct lockstat_class *a, const struct lockstat_class *b)
+{
+	if (a->lc_waittime.tv_sec != b->lc_waittime.tv_sec) {
+		return a->lc_waittime.tv_sec > b->lc_waittime.tv_sec;
+	}
+	if (a->lc_waittime.tv_nsec != b->lc_waittime.tv_nsec) {
+		return a->lc_waittime.tv_nsec > b->lc_waittime.tv_nsec;
+	}
+	return a->lc_contended > b->lc_contended;
+}
+
+/*
+ * Print the MAX classes that have spent the longest waiting. The
+ * counts are read without locking, so they're only a snapshot.
+ */
+void
+lockstat_print(unsigned max)
+{
+	bool printed[LOCKSTAT_NCLASSES];
+	struct lockstat_class *lc, *worst;
+	unsigned i, n, num;
+
+	num = lockstat_nclasses;
+	for (i=0; i<num; i++) {
+		printed[i] = false;
+	}
+
+	kprintf("%-24s %-5s %9s %9s %10s %16s %16s\n", "lock", "kind",
+		"acquires", "contended", "spins", "wait (s)", "hold (s)");
+	for (n=0; n<max && n<num; n++) {
+		worst = NULL;
+		for (i=0; i<num; i++) {
+			lc = &lockstat_classes[i];
+			if (printed[i]) {
+				continue;
+			}
+			if (worst == NULL || lockstat_worse(lc, worst)) {
+				worst = lc;
+			}
+		}
+		printed[worst - lockstat_classes] = true;
+		kprintf("%-24s %-5s %9u %9u %10llu %6llu.%09lu %6llu.%09lu\n",
+			worst->lc_name,
+			worst->lc_kind == LOCKSTAT_SPIN ? "spin" : "sleep",
+			worst->lc_acquires, worst->lc_contended,
+			(unsigned long long)worst->lc_spins,
+			(unsigned long long)worst->lc_waittime.tv_sec,
+			(unsigned long)worst->lc_waittime.tv_nsec,
+			(unsigned long long)worst->lc_holdtime.tv_sec,
+			(unsigned long)worst->lc_holdtime.tv_nsec);
+	}
+}
+
+/*
+ * Zero all the counts.
+ */
+void
+lockstat_reset(void)
+{
+	struct lockstat_class *lc;
+	unsigned i;
+	int spl;
+
+	spl = splhigh();
+	for (i=0; i<lockstat_nclasses; i++) {
+		lc = &lockstat_classes[i];
+		lockstat_lockword(&lc->lc_lock);
+		lc->lc_acquires = 0;
+		lc->lc_contended = 0;
+		lc->lc_spins = 0;
+		lc->lc_waittime.tv_sec = 0;
+		lc->lc_waittime.tv_nsec = 0;
+		lc->lc_holdtime.tv_sec = 0;
+		lc->lc_holdtime.tv_nsec = 0;
+		lockstat_unlockword(&lc->lc_lock);
+	}
+	splx(spl);
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Read-copy-update grace periods. See rcu.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <spinlock.h>
+#include <workqueue.h>
+#include <rcu.h>
+
+static void rcu_callwork(void *junk);
+
+/*
+ * Calls waiting for a grace period (rcu_call), newest first, and the
+ * work item that runs them. The work always goes to cpu 0, so it is
+ * only ever queued once.
+ */
+static struct spinlock rcu_calllock = SPINLOCK_INITIALIZER;
+static struct rcu_head *rcu_pending;
+static struct work rcu_work = { rcu_callwork, NULL, NULL, false };
+
+/*
+ * Wait for a grace period: for every cpu but this one to pass through
+ * a quiescent state after the call. (This cpu is in one right now,
+ * since the caller isn't reading.)
+ *
+ * A cpu that has neither switched threads nor been idle when we first
+ * look is sent an IPI; that counts as soon as it's taken, which is as
+ * soon as any read section in progress there ends. So this normally
+ * takes well under a tick.
+ */
+void
+rcu_synchronize(void)
+{
+	struct cpu *c;
+	unsigned i, n, qs;
+
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	/* Make the caller's unlinking visible before we look */
+	membar_any_any();
+
+	n = cpu_count();
+	for (i=0; i<n; i++) {
+		c = cpu_bynumber(i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		qs = c->c_rcu_qs;
+		if (c->c_isidle) {
+			continue;
+		}
+		ipi_send(c, IPI_UNIDLE);
+		while (c->c_rcu_qs == qs && !c->c_isidle) {
+			thread_yield();
+		}
+	}
+
+	/* Don't let the caller's freeing get ahead of the checks */
+	membar_any_any();
+}
+
+/*
+ * Work function: wait for one grace period for everything queued so
+ * far, then make the calls. Anything queued meanwhile resubmits the
+ * work and waits for the next round.
+ */
+static
+void
+rcu_callwork(void *junk)
+{
+	struct rcu_head *rh, *next;
+
+	(void)junk;
+
+	spinlock_acquire(&rcu_calllock);
+	rh = rcu_pending;
+	rcu_pending = NULL;
+	spinlock_release(&rcu_calllock);
+
+	if (rh == NULL) {
+		return;
+	}
+	rcu_synchronize();
+	for (; rh != NULL; rh = next) {
+		next = rh->rh_next;
+		rh->rh_func(rh->rh_data);
+	}
+}
+
+/*
+ * Call FUNC(DATA) after a grace period, without waiting for it.
+ * Before the work queues are running, just wait here.
+ */
+void
+rcu_call(struct rcu_head *rh, void (*func)(void *), void *data)
+{
+	struct cpu *c;
+
+	c = cpu_bynumber(0);
+	if (c->c_workqueue == NULL) {
+		rcu_synchronize();
+		func(data);
+		return;
+	}
+
+	rh->rh_func = func;
+	rh->rh_data = data;
+	spinlock_acquire(&rcu_calllock);
+	rh->rh_next = rcu_pending;
+	rcu_pending = rh;
+	spinlock_release(&rcu_calllock);
+
+	work_submit_cpu(&rcu_work, c);
+}
@@ -51,10 +51,27 @@ void
 spinlock_init(struct spinlock *splk)
 {
 	spinlock_data_set(&splk->splk_lock, 0);
+#if OPT_TICKETLOCK
+	spinlock_data_set(&splk->splk_serving, 0);
+#endif
 	splk->splk_holder = NULL;
 	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
+#if OPT_LOCKSTAT
+	lockstat_init(&splk->splk_stat, "spinlock", LOCKSTAT_SPIN);
+#endif
 }
 
+#if OPT_LOCKSTAT
+/*
+ * Name spinlock for lock statistics.
+ */
+void
+spinlock_setname(struct spinlock *splk, const char *name)
+{
+	lockstat_init(&splk->splk_stat, name, LOCKSTAT_SPIN);
+}
+#endif
+
 /*
  * Clean up spinlock.
  */
@@ -62,7 +79,12 @@ void
 spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
+#if OPT_TICKETLOCK
+	KASSERT(spinlock_data_get(&splk->splk_lock) ==
+		spinlock_data_get(&splk->splk_serving));
+#else
 	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+#endif
 }
 
 /*
@@ -76,6 +98,13 @@ void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+#if OPT_TICKETLOCK
+	spinlock_data_t ticket;
+#endif
+#if OPT_LOCKSTAT
+	struct timespec waitstart;
+	unsigned spins = 0;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -93,6 +122,21 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
+#if OPT_TICKETLOCK
+	/*
+	 * Take a ticket and wait for our turn. The wait only reads
+	 * splk_serving, which changes once per release, so waiting
+	 * cpus don't fight over the cache line.
+	 */
+	ticket = spinlock_data_fetchadd(&splk->splk_lock, 1);
+	while (spinlock_data_get(&splk->splk_serving) != ticket) {
+#if OPT_LOCKSTAT
+		if (spins++ == 0) {
+			lockstat_waitstart(&waitstart);
+		}
+#endif
+	}
+#else
 	while (1) {
 		/*
 		 * Do test-test-and-set, that is, read first before
@@ -104,20 +148,27 @@ spinlock_acquire(struct spinlock *splk)
 		 * previously unheld and we now own it. If it was 1,
 		 * we don't.
 		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
+		if (spinlock_data_get(&splk->splk_lock) == 0 &&
+		    spinlock_data_testandset(&splk->splk_lock) == 0) {
+			break;
 		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
+#if OPT_LOCKSTAT
+		if (spins++ == 0) {
+			lockstat_waitstart(&waitstart);
 		}
-		break;
+#endif
 	}
+#endif
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
 
 	if (CURCPU_EXISTS()) {
 		HANGMAN_ACQUIRE(&curcpu->c_hangman, &splk->splk_hangman);
+#if OPT_LOCKSTAT
+		lockstat_acquire(&splk->splk_stat,
+				 spins > 0 ? &waitstart : NULL, spins);
+#endif
 	}
 }
 
@@ -133,11 +184,20 @@ spinlock_release(struct spinlock *splk)
 		KASSERT(curcpu->c_spinlocks > 0);
 		curcpu->c_spinlocks--;
 		HANGMAN_RELEASE(&curcpu->c_hangman, &splk->splk_hangman);
+#if OPT_LOCKSTAT
+		lockstat_release(&splk->splk_stat);
+#endif
 	}
 
 	splk->splk_holder = NULL;
 	membar_any_store();
+#if OPT_TICKETLOCK
+	/* Only the holder writes splk_serving, so no atomic op needed. */
+	spinlock_data_set(&splk->splk_serving,
+			  spinlock_data_get(&splk->splk_serving) + 1);
+#else
 	spinlock_data_set(&splk->splk_lock, 0);
+#endif
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -33,11 +33,14 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <cpu.h>
+#include <clock.h>
 #include <synch.h>
 
 ////////////////////////////////////////////////////////////
@@ -68,6 +71,7 @@ sem_create(const char *name, unsigned initial_count)
 	}
 
 	spinlock_init(&sem->sem_lock);
+	spinlock_setname(&sem->sem_lock, sem->sem_name);
         sem->sem_count = initial_count;
 
         return sem;
@@ -120,6 +124,59 @@ P(struct semaphore *sem)
 	spinlock_release(&sem->sem_lock);
 }
 
+/*
+ * The deadline for a wait of TIMEOUT from now.
+ */
+static
+void
+synch_deadline(const struct timespec *timeout, struct timespec *when)
+{
+	gettime(when);
+	timespec_add(when, timeout, when);
+}
+
+int
+P_timed(struct semaphore *sem, const struct timespec *timeout)
+{
+	struct timespec when;
+	int result;
+
+        KASSERT(sem != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+	synch_deadline(timeout, &when);
+
+	spinlock_acquire(&sem->sem_lock);
+        while (sem->sem_count == 0) {
+		result = wchan_sleep_until(sem->sem_wchan, &sem->sem_lock,
+					   &when);
+		if (result && sem->sem_count == 0) {
+			spinlock_release(&sem->sem_lock);
+			return result;
+		}
+        }
+        KASSERT(sem->sem_count > 0);
+        sem->sem_count--;
+	spinlock_release(&sem->sem_lock);
+	return 0;
+}
+
+bool
+sem_tryP(struct semaphore *sem)
+{
+	bool ret;
+
+        KASSERT(sem != NULL);
+
+	spinlock_acquire(&sem->sem_lock);
+	ret = sem->sem_count > 0;
+	if (ret) {
+		sem->sem_count--;
+	}
+	spinlock_release(&sem->sem_lock);
+	return ret;
+}
+
 void
 V(struct semaphore *sem)
 {
@@ -138,10 +195,198 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+unsigned lock_spinlimit = LOCK_SPINLIMIT;
+
+#if OPT_SYNCH
+#if !USE_SEMAPHORE_FOR_LOCK
+/*
+ * Priority inheritance state: the waiter counts in every lock, the
+ * t_blockedon and t_waitlevel fields of waiting threads, and (as well
+ * as each lock's own lk_lock) lk_owner, so that chains of owners and
+ * locks can be followed holding only this. Ordered after lk_lock and
+ * before the run queue locks.
+ */
+static struct spinlock lock_pilock = SPINLOCK_NAMED_INITIALIZER("lock_pi");
+
+/*
+ * The level of the most important thread waiting for LOCK, or
+ * THREAD_PRI_MIN if there are none.
+ */
+static
+int
+lock_pitop(struct lock *lock)
+{
+	int pri;
+
+	KASSERT(spinlock_do_i_hold(&lock_pilock));
+
+	if (lock->lk_nwaiters == 0) {
+		return THREAD_PRI_MIN;
+	}
+	for (pri = THREAD_PRI_MAX; pri > THREAD_PRI_MIN; pri--) {
+		if (lock->lk_piwaiters[pri] > 0) {
+			break;
+		}
+	}
+	return pri;
+}
+
+/*
+ * Start waiting for LOCK, which is held by someone else: count
+ * curthread as a waiter, and raise the owner to our level. If the
+ * owner is waiting for a lock in turn, move it up in that lock's
+ * counts and raise that lock's owner, and so on down the chain. Stop
+ * where the owner already inherits at least this much; because that
+ * only ever goes up, a cycle (that is, a deadlock) ends the walk too.
+ */
+static
+void
+lock_piwait(struct lock *lock)
+{
+	struct thread *t;
+	int pri;
+
+	spinlock_acquire(&lock_pilock);
+
+	pri = thread_getpri(curthread);
+	curthread->t_blockedon = lock;
+	curthread->t_waitlevel = pri;
+	lock->lk_piwaiters[pri]++;
+	lock->lk_nwaiters++;
+
+	while (1) {
+		t = (struct thread *)lock->lk_owner;
+		if (t == NULL || t->t_inherited >= pri) {
+			break;
+		}
+		thread_setinherited(t, pri);
+
+		lock = t->t_blockedon;
+		if (lock == NULL || t->t_waitlevel >= pri) {
+			break;
+		}
+		lock->lk_piwaiters[t->t_waitlevel]--;
+		lock->lk_piwaiters[pri]++;
+		t->t_waitlevel = pri;
+	}
+
+	spinlock_release(&lock_pilock);
+}
+
+/*
+ * Take over LOCK, which is free: stop counting curthread as a waiter
+ * if WAITED, and inherit the level of any waiters that are left.
+ * Called with lk_lock held.
+ */
+static
+void
+lock_pitake(struct lock *lock, bool waited)
+{
+	int pri;
+
+	spinlock_acquire(&lock_pilock);
+
+	if (waited) {
+		KASSERT(curthread->t_blockedon == lock);
+		KASSERT(lock->lk_piwaiters[curthread->t_waitlevel] > 0);
+		lock->lk_piwaiters[curthread->t_waitlevel]--;
+		lock->lk_nwaiters--;
+		curthread->t_blockedon = NULL;
+	}
+
+	lock->lk_owner = curthread;
+	lock->lk_heldnext = curthread->t_heldlocks;
+	curthread->t_heldlocks = lock;
+
+	pri = lock_pitop(lock);
+	if (pri > curthread->t_inherited) {
+		thread_setinherited(curthread, pri);
+	}
+
+	spinlock_release(&lock_pilock);
+}
+
+/*
+ * Give up LOCK, and drop back to the level inherited through the
+ * locks we still hold. If a thread that was held up by us is now more
+ * important than we are, it gets the cpu at the next tick at the
+ * latest; we can't yield here, since callers may hold spinlocks.
+ * Called with lk_lock held.
+ */
+static
+void
+lock_pigive(struct lock *lock)
+{
+	struct lock **lp, *held;
+	int pri, top;
+
+	spinlock_acquire(&lock_pilock);
+
+	lock->lk_owner = NULL;
+	for (lp = &curthread->t_heldlocks; *lp != lock; lp = &(*lp)->lk_heldnext) {
+		KASSERT(*lp != NULL);
+	}
+	*lp = lock->lk_heldnext;
+	lock->lk_heldnext = NULL;
+
+	if (curthread->t_inherited > THREAD_PRI_MIN) {
+		pri = THREAD_PRI_MIN;
+		for (held = curthread->t_heldlocks; held != NULL;
+		     held = held->lk_heldnext) {
+			top = lock_pitop(held);
+			if (top > pri) {
+				pri = top;
+			}
+		}
+		thread_setinherited(curthread, pri);
+	}
+
+	spinlock_release(&lock_pilock);
+}
+#endif
+
+/*
+ * Adaptive part of lock_acquire: wait, without sleeping, while the
+ * lock's owner is running on another cpu. Returns when the lock is
+ * free, the owner stops running, or the spin budget is used up; the
+ * caller then takes the lock or sleeps as usual. Returns the number
+ * of times round the loop, for lock statistics.
+ *
+ * This is done without lk_lock, so everything read is only a hint.
+ * The owner could even release the lock and exit while we look at it,
+ * and its thread structure be reused from the thread cache or freed.
+ * We only ever read through OWNER, and kernel memory is direct-mapped,
+ * so such a read can't fault; at worst it gives a stale or garbage
+ * t_state or t_cpu and we spin or stop a little early. lk_owner is a
+ * volatile pointer, so each time round the loop reloads it.
+ */
+static
+unsigned
+lock_spin(struct lock *lock)
+{
+	volatile struct thread *owner;
+	unsigned i;
+
+	for (i=0; i<lock_spinlimit; i++) {
+		owner = lock->lk_owner;
+		if (owner == NULL) {
+			break;
+		}
+		if (owner->t_state != S_RUN || owner->t_cpu == curcpu->c_self) {
+			break;
+		}
+	}
+	return i;
+}
+#endif
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
+#if OPT_SYNCH
+	unsigned i;
+#endif
 
         lock = kmalloc(sizeof(*lock));
         if (lock == NULL) {
@@ -170,6 +415,16 @@ lock_create(const char *name)
 	}
 	lock->lk_owner = NULL;
 	spinlock_init(&lock->lk_lock);
+	spinlock_setname(&lock->lk_lock, lock->lk_name);
+	for (i=0; i<THREAD_PRI_LEVELS; i++) {
+		lock->lk_piwaiters[i] = 0;
+	}
+	lock->lk_nwaiters = 0;
+	lock->lk_heldnext = NULL;
+	HANGMAN_ORDEREDINIT(&lock->lk_hangman, lock->lk_name);
+#if OPT_LOCKSTAT
+	lockstat_init(&lock->lk_stat, lock->lk_name, LOCKSTAT_SLEEP);
+#endif
 #endif	
         return lock;
 }
@@ -181,6 +436,9 @@ lock_destroy(struct lock *lock)
 
         // add stuff here as needed
 #if OPT_SYNCH
+	KASSERT(lock->lk_owner == NULL);
+	KASSERT(lock->lk_nwaiters == 0);
+	HANGMAN_FORGET(&lock->lk_hangman);
 	spinlock_cleanup(&lock->lk_lock);
 #if USE_SEMAPHORE_FOR_LOCK
         sem_destroy(lock->lk_sem);
@@ -197,6 +455,15 @@ lock_acquire(struct lock *lock)
 {
         // Write this
 #if OPT_SYNCH
+	unsigned spins;
+#if !USE_SEMAPHORE_FOR_LOCK
+	bool waited;
+#endif
+#if OPT_LOCKSTAT
+	struct timespec waitstart;
+	bool contended;
+#endif
+
         KASSERT(lock != NULL);
 	if (lock_do_i_hold(lock)) {
 	  kprintf("AAACKK!\n");
@@ -205,6 +472,17 @@ lock_acquire(struct lock *lock)
 
         KASSERT(curthread->t_in_interrupt == false);
 
+	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
+
+#if OPT_LOCKSTAT
+	contended = lock->lk_owner != NULL;
+	if (contended) {
+		lockstat_waitstart(&waitstart);
+	}
+#endif
+
+	spins = lock_spin(lock);
+
 #if USE_SEMAPHORE_FOR_LOCK
 /*
  *  G.Cabodi - 2019: P BEFORE(!!!) spinlock acquire. OS161 forbids sleeping/realeasing
@@ -215,15 +493,26 @@ lock_acquire(struct lock *lock)
  */
     P(lock->lk_sem);
 	spinlock_acquire(&lock->lk_lock);        
+        KASSERT(lock->lk_owner == NULL);
+        lock->lk_owner=curthread;
 #else
 	spinlock_acquire(&lock->lk_lock);        
+	waited = lock->lk_owner != NULL;
+	if (waited) {
+		lock_piwait(lock);
+	}
 	while (lock->lk_owner != NULL) {
 	  wchan_sleep(lock->lk_wchan, &lock->lk_lock);
         }
+	lock_pitake(lock, waited);
 #endif
-        KASSERT(lock->lk_owner == NULL);
-        lock->lk_owner=curthread;
 	spinlock_release(&lock->lk_lock);
+	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+#if OPT_LOCKSTAT
+	lockstat_acquire(&lock->lk_stat, contended ? &waitstart : NULL, spins);
+#else
+	(void)spins;
+#endif
 #endif
         (void)lock;  // suppress warning until code gets written
 }
@@ -235,8 +524,16 @@ lock_release(struct lock *lock)
 #if OPT_SYNCH
 	KASSERT(lock != NULL);
 	KASSERT(lock_do_i_hold(lock));
+	HANGMAN_RELEASE(&curthread->t_hangman, &lock->lk_hangman);
+#if OPT_LOCKSTAT
+	lockstat_release(&lock->lk_stat);
+#endif
 	spinlock_acquire(&lock->lk_lock);
+#if USE_SEMAPHORE_FOR_LOCK
         lock->lk_owner=NULL;
+#else
+	lock_pigive(lock);
+#endif
 	/*  G.Cabodi - 2019: no problem here owning a spinlock, as V/wchan_wakeone 
 	    do not lead to wait state */
 #if USE_SEMAPHORE_FOR_LOCK
@@ -305,6 +602,8 @@ cv_create(const char *name)
 		return NULL;
 	}
         spinlock_init(&cv->cv_lock);
+	HANGMAN_ORDEREDINIT(&cv->cv_hangman, cv->cv_name);
+	spinlock_setname(&cv->cv_lock, cv->cv_name);
 #endif
         return cv;
 }
@@ -316,6 +615,7 @@ cv_destroy(struct cv *cv)
 
         // add stuff here as needed
 #if OPT_SYNCH
+	HANGMAN_FORGET(&cv->cv_hangman);
 	spinlock_cleanup(&cv->cv_lock);
 	wchan_destroy(cv->cv_wchan);
 #endif
@@ -332,6 +632,8 @@ cv_wait(struct cv *cv, struct lock *lock)
 	KASSERT(cv != NULL);
 	KASSERT(lock_do_i_hold(lock));
 
+	HANGMAN_WAITEVENT(&curthread->t_hangman, &cv->cv_hangman,
+			  &lock->lk_hangman);
 	spinlock_acquire(&cv->cv_lock);
 	/* G.Cabodi - 2019: spinlock already owned as atomic lock_release+wchan_sleep
 	   needed */
@@ -348,6 +650,36 @@ cv_wait(struct cv *cv, struct lock *lock)
         (void)lock;  // suppress warning until code gets written
 }
 
+int
+cv_timedwait(struct cv *cv, struct lock *lock, const struct timespec *timeout)
+{
+#if OPT_SYNCH
+	struct timespec when;
+	int result;
+
+        KASSERT(lock != NULL);
+	KASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	synch_deadline(timeout, &when);
+
+	/* As in cv_wait */
+	HANGMAN_WAITEVENT(&curthread->t_hangman, &cv->cv_hangman,
+			  &lock->lk_hangman);
+	spinlock_acquire(&cv->cv_lock);
+	lock_release(lock);
+	result = wchan_sleep_until(cv->cv_wchan, &cv->cv_lock, &when);
+	spinlock_release(&cv->cv_lock);
+	lock_acquire(lock);
+	return result;
+#else
+        (void)cv;
+        (void)lock;
+        (void)timeout;
+	return 0;
+#endif
+}
+
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
@@ -358,6 +690,7 @@ cv_signal(struct cv *cv, struct lock *lock)
 	KASSERT(lock_do_i_hold(lock));
 	/* g.Cabodi - 2019: here the spinlock is NOT required, as no atomic operation 
 	   has to be done. The spinlock is just acquired because needed by wakeone */
+	HANGMAN_SIGNAL(&curthread->t_hangman, &cv->cv_hangman);
 	spinlock_acquire(&cv->cv_lock);
 	wchan_wakeone(cv->cv_wchan,&cv->cv_lock);
 	spinlock_release(&cv->cv_lock);
@@ -375,10 +708,148 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	KASSERT(cv != NULL);
 	KASSERT(lock_do_i_hold(lock));
 	/* G.Cabodi - 2019: see comment on spinlocks in cv_signal */
+	HANGMAN_SIGNAL(&curthread->t_hangman, &cv->cv_hangman);
 	spinlock_acquire(&cv->cv_lock);
 	wchan_wakeall(cv->cv_wchan,&cv->cv_lock);
 	spinlock_release(&cv->cv_lock);
 #endif
 	(void)cv;    // suppress warning until code gets written
 	(void)lock;  // suppress warning until code gets written
-}
\ No newline at end of file
+}
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rwlock_name = kstrdup(name);
+	if (rw->rwlock_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_rwchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_rwchan == NULL) {
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+	rw->rw_wwchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_wwchan == NULL) {
+		wchan_destroy(rw->rw_rwchan);
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	spinlock_setname(&rw->rw_lock, rw->rwlock_name);
+	rw->rw_readers = 0;
+	rw->rw_wwaiting = 0;
+	rw->rw_writer = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_wwaiting == 0);
+
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_wwchan);
+	wchan_destroy(rw->rw_rwchan);
+	kfree(rw->rwlock_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	/* Wait behind an active writer, and behind waiting ones too. */
+	while (rw->rw_writer != NULL || rw->rw_wwaiting > 0) {
+		wchan_sleep(rw->rw_rwchan, &rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_wwaiting > 0) {
+		wchan_wakeone(rw->rw_wwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		rw->rw_wwaiting++;
+		wchan_sleep(rw->rw_wwchan, &rw->rw_lock);
+		rw->rw_wwaiting--;
+	}
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+	/*
+	 * Hand over to the next writer if there is one; the readers
+	 * would only go back to sleep. Otherwise let all the readers
+	 * in at once.
+	 */
+	if (rw->rw_wwaiting > 0) {
+		wchan_wakeone(rw->rw_wwchan, &rw->rw_lock);
+	}
+	else {
+		wchan_wakeall(rw->rw_rwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	bool res;
+
+	spinlock_acquire(&rw->rw_lock);
+	res = rw->rw_writer == curthread;
+	spinlock_release(&rw->rw_lock);
+	return res;
+}
@@ -35,6 +35,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <array.h>
 #include <cpu.h>
@@ -46,6 +48,7 @@
 #include <threadprivate.h>
 #include <proc.h>
 #include <current.h>
+#include <clock.h>
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
@@ -55,6 +58,34 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/*
+ * Length of a time slice at feedback queue level PRI, in hardclocks.
+ * Important (interactive) levels get short slices so they stay
+ * responsive; the bottom levels get long ones so CPU-bound threads
+ * pay for fewer context switches. The slices run from 20 ms to 160 ms
+ * whatever HZ is.
+ */
+#define QUANTUM_HARDCLOCKS(pri) \
+	((unsigned)(2 * (THREAD_PRI_LEVELS - (pri)) * HZ / 100))
+
+/*
+ * Maximum number of exited threads (with their stacks) each cpu keeps
+ * for reuse by thread_fork.
+ */
+#define THREAD_CACHE_MAX	8
+
+/*
+ * A thread that stopped running on a cpu less than this many of that
+ * cpu's hardclocks (30 ms) ago probably still has state in its cache.
+ */
+#define CACHEHOT_HARDCLOCKS	(3 * HZ / 100)
+
+/*
+ * A waking thread goes back to its previous cpu only if fewer than
+ * this many threads are already waiting there.
+ */
+#define WAKEUP_MAXQUEUE		1
+
 /* Wait channel. A wchan is protected by an associated, passed-in spinlock. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -108,6 +139,53 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Initialize the fields of a thread structure other than its name
+ * and stack. This is used both for new threads and for ones being
+ * reused from the thread cache.
+ */
+static
+void
+thread_init(struct thread *thread)
+{
+	thread->t_wchan_name = "NEW";
+	thread->t_state = S_READY;
+
+	/* Thread subsystem fields */
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	thread->t_context = NULL;
+	thread->t_cpu = NULL;
+	thread->t_proc = NULL;
+	thread->t_ustack = -1;
+
+	/* Scheduler fields */
+	thread->t_nice = 0;
+	thread->t_priority = THREAD_PRI_MAX;
+	thread->t_quantum = QUANTUM_HARDCLOCKS(THREAD_PRI_MAX);
+	thread->t_lastrun = 0;
+	thread->t_bound = false;
+	thread->t_inherited = THREAD_PRI_MIN;
+
+	/* Priority inheritance fields */
+	thread->t_blockedon = NULL;
+	thread->t_waitlevel = THREAD_PRI_MIN;
+	thread->t_heldlocks = NULL;
+
+	/* CPU time accounting fields */
+	cputimes_init(&thread->t_times);
+	thread->t_cpustate = CPUSTATE_SYS;
+
+	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
+
+	/* Interrupt state fields */
+	thread->t_in_interrupt = false;
+	thread->t_curspl = IPL_HIGH;
+	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+
+	/* If you add to struct thread, be sure to initialize here */
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -130,23 +208,45 @@ thread_create(const char *name)
 		kfree(thread);
 		return NULL;
 	}
-	thread->t_wchan_name = "NEW";
-	thread->t_state = S_READY;
-
-	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
 	thread->t_stack = NULL;
-	thread->t_context = NULL;
-	thread->t_cpu = NULL;
-	thread->t_proc = NULL;
+	thread_init(thread);
 
-	/* Interrupt state fields */
-	thread->t_in_interrupt = false;
-	thread->t_curspl = IPL_HIGH;
-	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+	return thread;
+}
 
-	/* If you add to struct thread, be sure to initialize here */
+/*
+ * Get a thread, complete with stack, from the current cpu's cache of
+ * exited threads (see exorcise). Returns NULL if the cache is empty.
+ *
+ * The stack's guard band was checked when the thread exited, so it
+ * doesn't need to be filled in again.
+ */
+static
+struct thread *
+thread_create_cached(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	DEBUGASSERT(name != NULL);
+
+	/* The cache is per-cpu; keep interrupts off while using it */
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadcache);
+	splx(spl);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	thread->t_name = kstrdup(name);
+	if (thread->t_name == NULL) {
+		spl = splhigh();
+		threadlist_addhead(&curcpu->c_threadcache, thread);
+		splx(spl);
+		return NULL;
+	}
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_init(thread);
 
 	return thread;
 }
@@ -176,16 +276,32 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadcache);
 	c->c_hardclocks = 0;
+	c->c_lastschedule = 0;
+	c->c_rcu_qs = 0;
 	c->c_spinlocks = 0;
+	HANGMAN_ACTORINIT(&c->c_hangman, "cpu");
+	cputimes_init(&c->c_times);
+	c->c_cyclebase = 0;
+	c->c_idlecycles = 0;
+	c->c_acctstamp = 0;
+	c->c_cpustate = CPUSTATE_SYS;
 
 	c->c_isidle = false;
+	c->c_tickstopped = false;
+	c->c_tickbusy = false;
+	c->c_tickbusystart = 0;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	spinlock_setname(&c->c_runqueue_lock, "runqueue");
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
 	spinlock_init(&c->c_ipi_lock);
+	spinlock_setname(&c->c_ipi_lock, "ipi");
+
+	c->c_workqueue = NULL;
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
@@ -249,6 +365,21 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Access to the set of cpus from outside the thread system.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_bynumber(unsigned num)
+{
+	return cpuarray_get(&allcpus, num);
+}
+
 /*
  * Destroy a thread.
  *
@@ -284,11 +415,42 @@ thread_destroy(struct thread *thread)
 	kfree(thread);
 }
 
+/*
+ * Put an exited thread in the current cpu's thread cache for reuse by
+ * thread_fork, if it has a stack and there's room; otherwise destroy
+ * it. The structure and stack are kept; everything else is cleaned
+ * up as in thread_destroy. Threads go on the front of the cache, so
+ * the most recently used (and most likely cache-hot) stack is reused
+ * first.
+ */
+static
+void
+thread_recycle(struct thread *thread)
+{
+	KASSERT(thread != curthread);
+	KASSERT(thread->t_state != S_RUN);
+
+	if (thread->t_stack == NULL ||
+	    curcpu->c_threadcache.tl_count >= THREAD_CACHE_MAX) {
+		thread_destroy(thread);
+		return;
+	}
+
+	KASSERT(thread->t_proc == NULL);
+	thread_machdep_cleanup(&thread->t_machdep);
+	kfree(thread->t_name);
+	thread->t_name = NULL;
+	thread->t_wchan_name = "CACHED";
+	threadlist_addhead(&curcpu->c_threadcache, thread);
+}
+
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) Where possible they're
+ * recycled instead of destroyed.
  *
- * The list of zombies is per-cpu.
+ * The list of zombies is per-cpu, as is the thread cache. This is
+ * called with interrupts off.
  */
 static
 void
@@ -299,7 +461,7 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		thread_recycle(z);
 	}
 }
 
@@ -440,15 +602,325 @@ thread_start_cpus(void)
 }
 
 /*
- * Make a thread runnable.
+ * Highest and lowest feedback queue levels a thread may occupy, as
+ * set by its nice value. Positive nice values cap how high a thread
+ * can climb; negative ones keep it from decaying all the way down.
+ */
+static
+int
+thread_pri_ceiling(struct thread *t)
+{
+	if (t->t_nice <= 0) {
+		return THREAD_PRI_MAX;
+	}
+	return THREAD_PRI_MAX - t->t_nice * THREAD_PRI_LEVELS / (PRIO_MAX+1);
+}
+
+static
+int
+thread_pri_floor(struct thread *t)
+{
+	if (t->t_nice >= 0) {
+		return THREAD_PRI_MIN;
+	}
+	return -t->t_nice * THREAD_PRI_MAX / -PRIO_MIN;
+}
+
+/*
+ * The level a thread is actually scheduled at: its own, or one it has
+ * inherited, whichever is higher.
+ */
+static
+int
+thread_effpri(struct thread *t)
+{
+	return t->t_priority > t->t_inherited ? t->t_priority : t->t_inherited;
+}
+
+/*
+ * Put a thread on a cpu's run queue. The run queue is kept sorted by
+ * priority, highest first, and is FIFO within each level; so the new
+ * thread goes after everything at least as important. Search from
+ * the tail, since that's where most threads end up.
+ */
+static
+void
+runqueue_insert(struct cpu *c, struct thread *t)
+{
+	struct thread *prev;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	THREADLIST_FORALL_REV(prev, c->c_runqueue) {
+		if (thread_effpri(prev) >= thread_effpri(t)) {
+			threadlist_insertafter(&c->c_runqueue, prev, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
+/*
+ * Give a thread that is waking up a priority boost. Threads that
+ * sleep a lot (interactive and I/O-bound ones) thus float towards the
+ * top of the run queue and get low wakeup latency.
+ *
+ * Called with the run queue of the thread's cpu locked, like
+ * thread_setnice, which may be changing the same fields.
+ */
+static
+void
+thread_wakeup_boost(struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&t->t_cpu->c_runqueue_lock));
+
+	if (t->t_priority < thread_pri_ceiling(t)) {
+		t->t_priority++;
+	}
+	t->t_quantum = QUANTUM_HARDCLOCKS(t->t_priority);
+}
+
+#if OPT_TICKLESS
+/*
+ * The number of hardclocks the current cpu has had, counting the ones
+ * it would have had while busy with its hardclock turned off. (Time
+ * spent idle doesn't count either way.) The missed ones come from the
+ * timer's own count, so this is cheap. Called with interrupts off.
+ */
+static
+unsigned
+thread_hardclocks(void)
+{
+	unsigned now;
+
+	if (!curcpu->c_tickbusy) {
+		return curcpu->c_hardclocks;
+	}
+	now = mainbus_hardclock_elapsed();
+	if (now < curcpu->c_tickbusystart) {
+		/* the stopped timer fired, and hardclock counted it */
+		return curcpu->c_hardclocks + now;
+	}
+	return curcpu->c_hardclocks + (now - curcpu->c_tickbusystart);
+}
+#else
+#define thread_hardclocks() (curcpu->c_hardclocks)
+#endif
+
+/*
+ * Return true if thread T probably still has state in the cache of
+ * the cpu it last ran on. Called with that cpu's run queue locked.
+ *
+ * The age is measured in that cpu's own hardclocks, so a thread is
+ * not considered cold just because its cpu sat idle (and its cache
+ * undisturbed) for a while.
+ */
+static
+bool
+thread_cachehot(struct thread *t)
+{
+#if OPT_TICKLESS
+	if (t->t_cpu->c_tickbusy) {
+		/*
+		 * Another thread has had that cpu to itself, without a
+		 * hardclock to measure for how long, since T ran there.
+		 */
+		return false;
+	}
+#endif
+	return t->t_cpu->c_hardclocks - t->t_lastrun < CACHEHOT_HARDCLOCKS;
+}
+
+/*
+ * Choose the cpu a waking thread should run on. Called with the run
+ * queue of the thread's previous cpu (t_cpu) locked. If the chosen
+ * cpu is a different one, the caller may move the thread there (set
+ * t_cpu) without further checks, before or after dropping the lock.
+ *
+ * If the previous cpu is idle, or the thread ran there recently and
+ * the cpu isn't overloaded, we go back there to reuse the cache.
+ * Otherwise we prefer an idle cpu, starting with our own (we can be
+ * running here on an idle cpu from an interrupt handler). If there's
+ * no idle cpu, moving wouldn't gain anything, so we stay put.
  *
- * targetcpu might be curcpu; it might not be, too.
+ * The idle flags and run queue counts of other cpus are read without
+ * locking them; they're only hints. We never hold two run queue locks
+ * at once.
+ */
+static
+struct cpu *
+thread_wakeup_cpu(struct thread *t)
+{
+	struct cpu *prev, *c, *best;
+	unsigned i, numcpus;
+
+	prev = t->t_cpu;
+	KASSERT(spinlock_do_i_hold(&prev->c_runqueue_lock));
+
+	/*
+	 * If the thread is still prev's curthread (see thread_steal)
+	 * prev is still on its stack and it can't be moved. That
+	 * can only happen if prev is idle, in which case we want it
+	 * there anyway.
+	 */
+	if (t->t_bound || prev->c_isidle || prev->c_curthread == t) {
+		return prev;
+	}
+	if (thread_cachehot(t) &&
+	    prev->c_runqueue.tl_count < WAKEUP_MAXQUEUE) {
+		return prev;
+	}
+
+	best = NULL;
+	if (curcpu->c_isidle) {
+		best = curcpu->c_self;
+	}
+	else {
+		numcpus = cpuarray_num(&allcpus);
+		for (i=1; i<numcpus; i++) {
+			/* Start after prev, to spread wakeups around */
+			c = cpuarray_get(&allcpus,
+					 (prev->c_number + i) % numcpus);
+			if (c->c_isidle) {
+				best = c;
+				break;
+			}
+		}
+	}
+	if (best == NULL) {
+		return prev;
+	}
+
+	/*
+	 * Since we hold prev's run queue lock and the thread isn't
+	 * its curthread, prev has finished switching away from it
+	 * and it's safe to move.
+	 */
+	return best;
+}
+
+#if OPT_TICKLESS
+/*
+ * Turn the current cpu's hardclock on or off according to whether it
+ * is needed. It is needed to preempt the current thread, so an idle
+ * cpu, or one with an empty run queue, can do without it; except that
+ * cpu 0 also needs it while there are timers to run. Called with the
+ * run queue locked; thread_make_runnable and thread_tickstart check
+ * c_tickstopped under the same lock to restart it.
+ *
+ * This is also called whenever the cpu goes idle or stops idling, so
+ * it keeps track of when the cpu is busy without a hardclock; those
+ * hardclocks are added to c_hardclocks afterwards (see
+ * thread_hardclocks).
  */
 static
 void
-thread_make_runnable(struct thread *target, bool already_have_lock)
+thread_tickcheck(void)
 {
-	struct cpu *targetcpu;
+	bool need;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	curcpu->c_hardclocks = thread_hardclocks();
+	curcpu->c_tickbusy = false;
+
+	need = !curcpu->c_isidle && !threadlist_isempty(&curcpu->c_runqueue);
+	if (curcpu->c_number == 0 && timer_anypending()) {
+		need = true;
+	}
+	if (need && curcpu->c_tickstopped) {
+		mainbus_hardclock_start();
+		curcpu->c_tickstopped = false;
+	}
+	else if (!need && !curcpu->c_tickstopped) {
+		mainbus_hardclock_stop();
+		curcpu->c_tickstopped = true;
+	}
+
+	if (curcpu->c_tickstopped && !curcpu->c_isidle) {
+		curcpu->c_tickbusystart = mainbus_hardclock_elapsed();
+		curcpu->c_tickbusy = true;
+	}
+}
+
+/*
+ * Make sure cpu 0's hardclock is running, because a timer has just
+ * been started. If cpu 0 is somewhere else, it rechecks its tick when
+ * it gets IPI_UNIDLE.
+ */
+void
+thread_tickstart(void)
+{
+	struct cpu *c;
+
+	c = cpuarray_get(&allcpus, 0);
+	spinlock_acquire(&c->c_runqueue_lock);
+	if (c->c_tickstopped) {
+		if (c == curcpu->c_self) {
+			thread_tickcheck();
+		}
+		else {
+			ipi_send(c, IPI_UNIDLE);
+		}
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+#endif
+
+/*
+ * Make sure cpu C notices threads just added to its run queue. Called
+ * with C's run queue locked.
+ */
+static
+void
+thread_kick(struct cpu *c)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	/*
+	 * If the other processor is idle, send an interrupt to make
+	 * sure it unidles; but not if one is already on its way. The
+	 * unlocked check is safe: the thread is on the run queue
+	 * already, and the other cpu only clears the pending bit
+	 * before going back to look at it.
+	 */
+	if (c->c_isidle && c != curcpu->c_self &&
+	    (c->c_ipi_pending & ((uint32_t)1 << IPI_UNIDLE)) == 0) {
+		ipi_send(c, IPI_UNIDLE);
+	}
+#if OPT_TICKLESS
+	else if (c->c_tickstopped && !c->c_isidle) {
+		/*
+		 * A busy cpu running without a hardclock now has
+		 * something to preempt for. We can restart our own;
+		 * another cpu needs to be told (IPI_UNIDLE does that,
+		 * see interprocessor_interrupt).
+		 */
+		if (c == curcpu->c_self) {
+			thread_tickcheck();
+		}
+		else {
+			ipi_send(c, IPI_UNIDLE);
+		}
+	}
+#endif
+}
+
+/*
+ * Make a thread runnable. If WAKING, it is waking up from a wait
+ * channel and gets a priority boost.
+ *
+ * Unless we already hold the run queue lock of the thread's cpu (that
+ * is, the thread is being requeued by thread_switch), the scheduler
+ * picks the cpu with thread_wakeup_cpu. It might be curcpu; it might
+ * not be, too.
+ */
+static
+void
+thread_make_runnable(struct thread *target, bool already_have_lock,
+		     bool waking)
+{
+	struct cpu *targetcpu, *newcpu;
 
 	/* Lock the run queue of the target thread's cpu. */
 	targetcpu = target->t_cpu;
@@ -459,19 +931,23 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 	else {
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		if (waking) {
+			thread_wakeup_boost(target);
+		}
+		newcpu = thread_wakeup_cpu(target);
+		if (newcpu != targetcpu) {
+			/* Never hold two run queue locks at once. */
+			spinlock_release(&targetcpu->c_runqueue_lock);
+			spinlock_acquire(&newcpu->c_runqueue_lock);
+			target->t_cpu = newcpu;
+			targetcpu = newcpu;
+		}
 	}
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
-
-	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
-		/*
-		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
-		 */
-		ipi_send(targetcpu, IPI_UNIDLE);
-	}
+	runqueue_insert(targetcpu, target);
+	thread_kick(targetcpu);
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -479,43 +955,102 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 }
 
 /*
- * Create a new thread based on an existing one.
- *
- * The new thread has name NAME, and starts executing in function
- * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
- *
- * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * Make runnable, in one go, all threads on LIST whose t_cpu is C,
+ * removing them from LIST. This is the batched form of
+ * thread_make_runnable for wchan_wakeall: C's run queue lock is taken
+ * once, and C gets at most one IPI, however many threads there are.
+ *
+ * If MOVED is not null, each thread gets its wakeup boost and its cpu
+ * is chosen with thread_wakeup_cpu as usual; threads going somewhere
+ * other than C get their t_cpu changed and are put on MOVED instead,
+ * for a second pass with MOVED null, which puts threads where t_cpu
+ * says.
+ */
+static
+void
+thread_make_runnable_batch(struct cpu *c, struct threadlist *list,
+			   struct threadlist *moved)
+{
+	struct thread *t, *next;
+	struct cpu *newcpu;
+	bool added;
+
+	added = false;
+	spinlock_acquire(&c->c_runqueue_lock);
+	for (t = list->tl_head.tln_next->tln_self; t != NULL; t = next) {
+		next = t->t_listnode.tln_next->tln_self;
+		if (t->t_cpu != c) {
+			continue;
+		}
+		threadlist_remove(list, t);
+		if (moved != NULL) {
+			thread_wakeup_boost(t);
+			newcpu = thread_wakeup_cpu(t);
+			if (newcpu != c) {
+				t->t_cpu = newcpu;
+				threadlist_addtail(moved, t);
+				continue;
+			}
+		}
+		t->t_state = S_READY;
+		runqueue_insert(c, t);
+		added = true;
+	}
+	if (added) {
+		thread_kick(c);
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+/*
+ * Common code for thread_fork and thread_fork_bound. If CPU is not
+ * null the new thread is started on it and bound there.
  */
+static
 int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+thread_fork_common(const char *name,
+		   struct proc *proc, struct cpu *cpu,
+		   void (*entrypoint)(void *data1, unsigned long data2),
+		   void *data1, unsigned long data2)
 {
 	struct thread *newthread;
 	int result;
 
-	newthread = thread_create(name);
+	newthread = thread_create_cached(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
 	 */
 
 	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+	if (cpu != NULL) {
+		newthread->t_cpu = cpu;
+		newthread->t_bound = true;
+	}
+	else {
+		newthread->t_cpu = curthread->t_cpu;
+	}
+
+	/* Scheduler fields: start at the top allowed by our niceness */
+	newthread->t_nice = curthread->t_nice;
+	newthread->t_priority = thread_pri_ceiling(newthread);
+	newthread->t_quantum = QUANTUM_HARDCLOCKS(newthread->t_priority);
+	/* The parent just touched its stack here; treat it as warm */
+	newthread->t_lastrun = curcpu->c_hardclocks;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -538,12 +1073,153 @@ thread_fork(const char *name,
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
-	/* Lock the current cpu's run queue and make the new thread runnable */
-	thread_make_runnable(newthread, false);
+	/* Lock the new thread's cpu's run queue and make it runnable */
+	thread_make_runnable(newthread, false, false);
 
 	return 0;
 }
 
+/*
+ * Create a new thread based on an existing one.
+ *
+ * The new thread has name NAME, and starts executing in function
+ * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
+ *
+ * The new thread is created in the process P. If P is null, the
+ * process is inherited from the caller. It will start on the same CPU
+ * as the caller, unless the scheduler intervenes first.
+ */
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	return thread_fork_common(name, proc, NULL, entrypoint, data1, data2);
+}
+
+/*
+ * Like thread_fork, but the new thread is in the kernel process and
+ * runs only on CPU: it starts there, and is never moved by wakeup
+ * placement or work stealing. This is for per-cpu service threads.
+ */
+int
+thread_fork_bound(const char *name, struct cpu *cpu,
+		  void (*entrypoint)(void *data1, unsigned long data2),
+		  void *data1, unsigned long data2)
+{
+	KASSERT(cpu != NULL);
+	return thread_fork_common(name, kproc, cpu, entrypoint, data1, data2);
+}
+
+/*
+ * Thread migration.
+ *
+ * Load balancing is done by work stealing: a cpu that runs out of
+ * things to do looks for the busiest other cpu and takes a thread
+ * off its run queue. This is called from the idle loop in
+ * thread_switch, so an idle cpu picks up work as soon as it next
+ * wakes up (at the latest, on its next timer interrupt) rather than
+ * waiting for a busy cpu to get around to pushing work at it.
+ *
+ * To find the busiest cpu we read the run queue counts without
+ * locking; they're only a hint. We then lock just the victim's run
+ * queue and recheck. We never hold two run queue locks at once, so
+ * there are no lock ordering issues between cpus, and the cost of
+ * looking doesn't involve locking every cpu in the system.
+ *
+ * We take the thread at the head of the victim's queue, that is, the
+ * most important one waiting, since that's the one whose latency we
+ * care most about. It is returned to the caller, to be run directly.
+ *
+ * Migrating threads isn't free because of cache affinity; a thread's
+ * working cache set will end up having to be moved to the other CPU,
+ * which is fairly slow. So we prefer the first thread that hasn't run
+ * on the victim recently. If they're all cache-hot we take the head
+ * of the queue anyway: an idle cpu costs more than some cache misses.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t, *hot;
+	unsigned i, numcpus, count, best;
+
+	victim = NULL;
+	best = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		/*
+		 * Unlocked read. A cpu that is idle is about to run
+		 * its first queued thread itself, so that one doesn't
+		 * count.
+		 */
+		count = c->c_runqueue.tl_count;
+		if (c->c_isidle && count > 0) {
+			count--;
+		}
+		if (count > best) {
+			best = count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	hot = NULL;
+	spinlock_acquire(&victim->c_runqueue_lock);
+	THREADLIST_FORALL(t, victim->c_runqueue) {
+		/*
+		 * Ordinarily, a cpu's curthread will not appear on
+		 * its run queue. However, it can under the following
+		 * circumstances:
+		 *   - it went to sleep;
+		 *   - the processor became idle, so it
+		 *     remained curthread;
+		 *   - it was reawakened, so it was put on the
+		 *     run queue;
+		 *   - and the processor hasn't fully unidled
+		 *     yet, so all these things are still true.
+		 *
+		 * *Migrating* such a thread can cause bad things to
+		 * happen (Exercise: Why? And what?) so skip it.
+		 */
+		if (t == victim->c_curthread || t->t_bound) {
+			continue;
+		}
+		if (thread_cachehot(t)) {
+			if (hot == NULL) {
+				hot = t;
+			}
+			continue;
+		}
+		break;
+	}
+	if (t == NULL) {
+		t = hot;
+	}
+	if (t != NULL && victim->c_isidle && victim->c_runqueue.tl_count < 2) {
+		/* leave the victim its only thread */
+		t = NULL;
+	}
+	if (t != NULL) {
+		threadlist_remove(&victim->c_runqueue, t);
+		t->t_cpu = curcpu->c_self;
+		DEBUG(DB_THREADS,
+		      "Migrated thread %s: cpu %u -> %u",
+		      t->t_name, victim->c_number, curcpu->c_number);
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	return t;
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -591,12 +1267,36 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		return;
 	}
 
+	/*
+	 * Remember when we stopped running, for cache affinity.
+	 * Wakers read this holding our run queue lock.
+	 */
+	cur->t_lastrun = thread_hardclocks();
+
+	/* Switching is a quiescent state for RCU. */
+	curcpu->c_rcu_qs++;
+
+	/*
+	 * Charge our time so far, and count the switch. A thread that
+	 * stays runnable but switches in the middle of an interrupt
+	 * is being preempted; anything else is voluntary.
+	 */
+	cur->t_cpustate = cputime_enter(CPUSTATE_SYS);
+	if (newstate == S_READY && cur->t_in_interrupt) {
+		cur->t_times.ct_nivcsw++;
+		curcpu->c_times.ct_nivcsw++;
+	}
+	else if (newstate != S_ZOMBIE) {
+		cur->t_times.ct_nvcsw++;
+		curcpu->c_times.ct_nvcsw++;
+	}
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
-		thread_make_runnable(cur, true /*have lock*/);
+		thread_make_runnable(cur, true /*have lock*/, false);
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
@@ -633,6 +1333,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * Before idling, try to steal work from another cpu. This is
+	 * done with our own runqueue unlocked; see thread_steal.
 	 */
 
 	/* The current cpu is now idle. */
@@ -640,12 +1343,23 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	do {
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
+#if OPT_TICKLESS
+			/* Don't take timer interrupts while idle */
+			thread_tickcheck();
+#endif
+			cputime_enter(CPUSTATE_IDLE);
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+#if OPT_TICKLESS
+	thread_tickcheck();
+#endif
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -711,6 +1425,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	cur->t_wchan_name = NULL;
 	cur->t_state = S_RUN;
 
+	/* Charge our time from here on, in the state we left off in. */
+	cputime_enter(cur->t_cpustate);
+
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
@@ -744,6 +1461,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	cur->t_wchan_name = NULL;
 	cur->t_state = S_RUN;
 
+	/* Charge our time from here on, in the state we left off in. */
+	cputime_enter(cur->t_cpustate);
+
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
@@ -813,141 +1533,196 @@ thread_yield(void)
 ////////////////////////////////////////////////////////////
 
 /*
- * Scheduler.
+ * Change the nice value of thread T, which need not be current, and
+ * clamp its current level to the new bounds. T's position on its run
+ * queue, if it's on one, is not changed; that happens next time it
+ * is queued.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * The caller must keep T from exiting (e.g. by holding its process's
+ * p_lock).
  */
-
 void
-schedule(void)
+thread_setnice(struct thread *t, int nice)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct cpu *c;
+
+	KASSERT(nice >= PRIO_MIN && nice <= PRIO_MAX);
+
+	/* Lock t's cpu, rechecking in case it gets migrated meanwhile. */
+	while (1) {
+		c = t->t_cpu;
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (c == t->t_cpu) {
+			break;
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	}
+
+	t->t_nice = nice;
+	if (t->t_priority > thread_pri_ceiling(t)) {
+		t->t_priority = thread_pri_ceiling(t);
+	}
+	if (t->t_priority < thread_pri_floor(t)) {
+		t->t_priority = thread_pri_floor(t);
+	}
+	if (t->t_quantum > QUANTUM_HARDCLOCKS(t->t_priority)) {
+		t->t_quantum = QUANTUM_HARDCLOCKS(t->t_priority);
+	}
+
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+int
+thread_getnice(struct thread *t)
+{
+	return t->t_nice;
 }
 
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * Unlocked; a hint, unless T is curthread.
+ */
+int
+thread_getpri(struct thread *t)
+{
+	return thread_effpri(t);
+}
+
+/*
+ * Set the level T inherits through locks. If T is waiting on a run
+ * queue it's moved to its new place there. A more important thread
+ * queued behind a running one preempts it at the next tick.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * The caller must keep T from exiting; synch.c does, because T holds
+ * a lock someone is waiting for.
  */
 void
-thread_consider_migration(void)
+thread_setinherited(struct thread *t, int pri)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
 	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
+	KASSERT(pri >= THREAD_PRI_MIN && pri <= THREAD_PRI_MAX);
+
+	/* Lock t's cpu, rechecking in case it gets migrated meanwhile. */
+	while (1) {
+		c = t->t_cpu;
 		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		if (c == t->t_cpu) {
+			break;
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	/*
+	 * A ready thread is usually on the run queue, but not while
+	 * thread_steal is handing it to its new cpu: then it's on no
+	 * list, and will be run next without being queued anyway.
+	 */
+	if (t->t_state == S_READY && t->t_listnode.tln_prev != NULL) {
+		threadlist_remove(&c->c_runqueue, t);
+		t->t_inherited = pri;
+		runqueue_insert(c, t);
 	}
+	else {
+		t->t_inherited = pri;
+	}
+
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+/*
+ * Time slicing.
+ *
+ * This is called from hardclock() on every tick. A thread that runs
+ * for its whole time slice is taken to be CPU-bound and drops one
+ * feedback queue level; it then yields to anyone else at its new
+ * level or above. A thread is also preempted as soon as something
+ * more important is queued on its cpu.
+ */
+bool
+thread_tick(void)
+{
+	struct thread *cur, *next;
+	bool preempt;
+
+	cur = curthread;
+	preempt = false;
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+
+	if (curcpu->c_isidle) {
+		/* Nobody's running; nothing to charge. */
+#if OPT_TICKLESS
+		thread_tickcheck();
+#endif
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return false;
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
+	KASSERT(cur->t_quantum > 0);
+	cur->t_quantum--;
+	if (cur->t_quantum == 0) {
+		if (cur->t_priority > thread_pri_floor(cur)) {
+			cur->t_priority--;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+		cur->t_quantum = QUANTUM_HARDCLOCKS(cur->t_priority);
+		preempt = true;
+	}
+	else if (!threadlist_isempty(&curcpu->c_runqueue)) {
+		next = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+		if (thread_effpri(next) > thread_effpri(cur)) {
+			preempt = true;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+#if OPT_TICKLESS
+	/* If we're the only thread left, stop ticking */
+	thread_tickcheck();
+#endif
+
+	spinlock_release(&curcpu->c_runqueue_lock);
+	return preempt;
+}
+
+/*
+ * Scheduler.
+ *
+ * This is called periodically from hardclock(). It should reshuffle
+ * the current CPU's run queue by job priority.
+ *
+ * Because CPU-bound threads only ever sink, a steady stream of more
+ * important work could starve them, and a thread that stops being
+ * CPU-bound would stay stuck at the bottom. So, periodically, put
+ * every thread on this cpu back at the top level its nice value
+ * allows. The run queue is then re-sorted.
+ */
+void
+schedule(void)
+{
+	struct threadlist boosted;
+	struct thread *t;
+
+	threadlist_init(&boosted);
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+
+	if (!curcpu->c_isidle) {
+		t = curthread;
+		t->t_priority = thread_pri_ceiling(t);
+		t->t_quantum = QUANTUM_HARDCLOCKS(t->t_priority);
+	}
+
+	while ((t = threadlist_remhead(&curcpu->c_runqueue)) != NULL) {
+		t->t_priority = thread_pri_ceiling(t);
+		t->t_quantum = QUANTUM_HARDCLOCKS(t->t_priority);
+		threadlist_addtail(&boosted, t);
 	}
+	while ((t = threadlist_remhead(&boosted)) != NULL) {
+		runqueue_insert(curcpu->c_self, t);
+	}
+
+	spinlock_release(&curcpu->c_runqueue_lock);
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	threadlist_cleanup(&boosted);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1013,6 +1788,87 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(lk);
 }
 
+/*
+ * Timeout state for wchan_sleep_until, on the sleeper's stack.
+ */
+struct wchan_timeout {
+	struct wchan *wt_wc;
+	struct spinlock *wt_lk;
+	struct thread *wt_thread;
+	bool wt_timedout;		/* We took the sleeper off wt_wc */
+	volatile bool wt_done;		/* wchan_timeout has finished */
+};
+
+/*
+ * Timer function for wchan_sleep_until. If the sleeper is still on
+ * the channel, take it off and wake it. Runs in interrupt context.
+ */
+static
+void
+wchan_timeout(void *data)
+{
+	struct wchan_timeout *wt = data;
+	struct thread *t;
+
+	spinlock_acquire(wt->wt_lk);
+	THREADLIST_FORALL(t, wt->wt_wc->wc_threads) {
+		if (t == wt->wt_thread) {
+			threadlist_remove(&wt->wt_wc->wc_threads, t);
+			thread_make_runnable(t, false, true);
+			wt->wt_timedout = true;
+			break;
+		}
+	}
+	wt->wt_done = true;
+	spinlock_release(wt->wt_lk);
+}
+
+/*
+ * Sleep as in wchan_sleep, with a timer to wake us at WHEN. The timer
+ * is started holding LK, so it can't go off before we're on the
+ * channel.
+ *
+ * If we're woken but the timer can't be stopped, it has gone off and
+ * wchan_timeout is running or about to run on cpu 0; it uses WT, so
+ * wait for it to finish before returning. Whether it got to us first
+ * decides the result.
+ */
+int
+wchan_sleep_until(struct wchan *wc, struct spinlock *lk,
+		  const struct timespec *when)
+{
+	struct wchan_timeout wt;
+	struct timer tm;
+
+	/* may not sleep in an interrupt handler */
+	KASSERT(!curthread->t_in_interrupt);
+
+	/* must hold the spinlock */
+	KASSERT(spinlock_do_i_hold(lk));
+
+	/* must not hold other spinlocks */
+	KASSERT(curcpu->c_spinlocks == 1);
+
+	wt.wt_wc = wc;
+	wt.wt_lk = lk;
+	wt.wt_thread = curthread;
+	wt.wt_timedout = false;
+	wt.wt_done = false;
+	timer_init(&tm, wchan_timeout, &wt);
+	timer_start(&tm, when);
+
+	thread_switch(S_SLEEP, wc, lk);
+	spinlock_acquire(lk);
+
+	if (!timer_stop(&tm)) {
+		while (!wt.wt_done) {
+			spinlock_release(lk);
+			spinlock_acquire(lk);
+		}
+	}
+	return wt.wt_timedout ? ETIMEDOUT : 0;
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1039,21 +1895,27 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	 * in thread_switch.
 	 */
 
-	thread_make_runnable(target, false);
+	thread_make_runnable(target, false, true);
 }
 
 /*
  * Wake up all threads sleeping on a wait channel.
+ *
+ * The threads are made runnable a cpu at a time: one pass per cpu
+ * the sleepers last ran on, and one per cpu that some of them were
+ * moved to. So a broadcast costs one run queue lock round-trip and
+ * at most one IPI per cpu involved rather than per thread.
  */
 void
 wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *target;
-	struct threadlist list;
+	struct threadlist list, moved;
 
 	KASSERT(spinlock_do_i_hold(lk));
 
 	threadlist_init(&list);
+	threadlist_init(&moved);
 
 	/*
 	 * Grab all the threads from the channel, moving them to a
@@ -1064,14 +1926,19 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	}
 
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * As in wchan_wakeone, we take run queue locks while holding
+	 * LK; and thread_make_runnable_batch takes only one at a time.
 	 */
-	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+	while (!threadlist_isempty(&list)) {
+		target = list.tl_head.tln_next->tln_self;
+		thread_make_runnable_batch(target->t_cpu, &list, &moved);
+	}
+	while (!threadlist_isempty(&moved)) {
+		target = moved.tl_head.tln_next->tln_self;
+		thread_make_runnable_batch(target->t_cpu, &moved, NULL);
 	}
 
+	threadlist_cleanup(&moved);
 	threadlist_cleanup(&list);
 }
 
@@ -1170,6 +2037,9 @@ interprocessor_interrupt(void)
 	uint32_t bits;
 	unsigned i;
 
+	/* No RCU reader can be running here; see rcu.h. */
+	curcpu->c_rcu_qs++;
+
 	spinlock_acquire(&curcpu->c_ipi_lock);
 	bits = curcpu->c_ipi_pending;
 
@@ -1193,7 +2063,8 @@ interprocessor_interrupt(void)
 	if (bits & (1U << IPI_UNIDLE)) {
 		/*
 		 * The cpu has already unidled itself to take the
-		 * interrupt; don't need to do anything else.
+		 * interrupt; don't need to do anything else. (Except
+		 * with the tickless option; see below.)
 		 */
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
@@ -1210,4 +2081,18 @@ interprocessor_interrupt(void)
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+#if OPT_TICKLESS
+	if (bits & (1U << IPI_UNIDLE)) {
+		/*
+		 * If we're busy, someone queued a thread for us while
+		 * our hardclock was off; turn it back on. This must be
+		 * done without the ipi lock, since thread_make_runnable
+		 * sends IPIs holding our run queue lock.
+		 */
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		thread_tickcheck();
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
+#endif
 }
\ No newline at end of file
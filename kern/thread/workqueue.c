@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Per-cpu deferred work queues. See workqueue.h for the interface.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <workqueue.h>
+
+/* Worker threads per cpu. */
+#define WQ_NWORKERS	2
+
+/*
+ * A work queue. The queue is a singly-linked list with a tail pointer
+ * so work runs in submission order. wq_nidle counts the workers
+ * asleep on wq_wchan, so submitters only issue a wakeup when someone
+ * is there to get it.
+ */
+struct workqueue {
+	struct spinlock wq_lock;
+	struct wchan *wq_wchan;
+	struct work *wq_head;
+	struct work **wq_tailp;
+	unsigned wq_nidle;
+};
+
+/*
+ * Create a work queue.
+ */
+static
+struct workqueue *
+workqueue_create(void)
+{
+	struct workqueue *wq;
+
+	wq = kmalloc(sizeof(*wq));
+	if (wq == NULL) {
+		return NULL;
+	}
+	wq->wq_wchan = wchan_create("workq");
+	if (wq->wq_wchan == NULL) {
+		kfree(wq);
+		return NULL;
+	}
+	spinlock_init(&wq->wq_lock);
+	spinlock_setname(&wq->wq_lock, "workq");
+	wq->wq_head = NULL;
+	wq->wq_tailp = &wq->wq_head;
+	wq->wq_nidle = 0;
+	return wq;
+}
+
+/*
+ * Worker thread. Takes the whole queue at once and runs it, then
+ * sleeps until something more is submitted. Never exits.
+ */
+static
+void
+workqueue_worker(void *data, unsigned long num)
+{
+	struct workqueue *wq = data;
+	struct work *batch, *w;
+	void (*func)(void *);
+	void *funcdata;
+
+	(void)num;
+
+	spinlock_acquire(&wq->wq_lock);
+	while (1) {
+		while (wq->wq_head == NULL) {
+			wq->wq_nidle++;
+			wchan_sleep(wq->wq_wchan, &wq->wq_lock);
+			wq->wq_nidle--;
+		}
+
+		batch = wq->wq_head;
+		wq->wq_head = NULL;
+		wq->wq_tailp = &wq->wq_head;
+
+		/*
+		 * Each item stays marked queued until just before its
+		 * function is called; until then it's still on our
+		 * private batch list and can't be resubmitted. Fetch
+		 * the function first, since once w_queued is clear the
+		 * item may be reused.
+		 */
+		spinlock_release(&wq->wq_lock);
+		while (batch != NULL) {
+			w = batch;
+			batch = w->w_next;
+			func = w->w_func;
+			funcdata = w->w_data;
+
+			spinlock_acquire(&wq->wq_lock);
+			w->w_next = NULL;
+			w->w_queued = false;
+			spinlock_release(&wq->wq_lock);
+
+			func(funcdata);
+		}
+		spinlock_acquire(&wq->wq_lock);
+	}
+}
+
+void
+work_init(struct work *w, void (*func)(void *), void *data)
+{
+	w->w_func = func;
+	w->w_data = data;
+	w->w_next = NULL;
+	w->w_queued = false;
+}
+
+bool
+work_submit_cpu(struct work *w, struct cpu *c)
+{
+	struct workqueue *wq;
+	bool wake;
+
+	wq = c->c_workqueue;
+	KASSERT(wq != NULL);
+
+	spinlock_acquire(&wq->wq_lock);
+	if (w->w_queued) {
+		spinlock_release(&wq->wq_lock);
+		return false;
+	}
+	w->w_queued = true;
+	w->w_next = NULL;
+
+	/*
+	 * Only wake a worker if the queue was empty; otherwise one
+	 * has already been woken and will take this in the same batch.
+	 */
+	wake = (wq->wq_head == NULL && wq->wq_nidle > 0);
+	*wq->wq_tailp = w;
+	wq->wq_tailp = &w->w_next;
+	if (wake) {
+		wchan_wakeone(wq->wq_wchan, &wq->wq_lock);
+	}
+	spinlock_release(&wq->wq_lock);
+	return true;
+}
+
+bool
+work_submit(struct work *w)
+{
+	return work_submit_cpu(w, curcpu->c_self);
+}
+
+/*
+ * Create the work queues and start their workers.
+ */
+void
+workqueue_bootstrap(void)
+{
+	struct cpu *c;
+	char name[16];
+	unsigned i, j;
+	int result;
+
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_bynumber(i);
+		KASSERT(c->c_workqueue == NULL);
+		c->c_workqueue = workqueue_create();
+		if (c->c_workqueue == NULL) {
+			panic("workqueue_bootstrap: Out of memory\n");
+		}
+		for (j=0; j<WQ_NWORKERS; j++) {
+			snprintf(name, sizeof(name), "worker%u.%u", i, j);
+			result = thread_fork_bound(name, c, workqueue_worker,
+						   c->c_workqueue, j);
+			if (result) {
+				panic("workqueue_bootstrap: thread_fork: %s\n",
+				      strerror(result));
+			}
+		}
+	}
+}
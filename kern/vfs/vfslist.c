@@ -60,6 +60,11 @@
  * kd_fs      - Filesystem object mounted on, or associated with, this
  *              device. NULL if there is no filesystem.
  *
+ * kd_busy    - Set while a mount or unmount of this device is doing
+ *              its I/O. Lookups treat the device as having no
+ *              filesystem meanwhile, and other mounts and unmounts
+ *              of it fail with EBUSY.
+ *
  * A filesystem can be associated with a device without having been
  * mounted if the device was created that way. In this case,
  * kd_rawname is NULL (prohibiting mount/unmount), and, as there is
@@ -80,6 +85,7 @@ struct knowndev {
 	struct device *kd_device;
 	struct vnode *kd_vnode;
 	struct fs *kd_fs;
+	bool kd_busy;
 };
 
 /* A placeholder for kd_fs for devices used as swap */
@@ -90,6 +96,21 @@ DEFARRAY(knowndev, static __UNUSED inline);
 
 static struct knowndevarray *knowndevs;
 
+/*
+ * Lock for knowndevs and the kd_fs fields. Changes are made holding
+ * it for writing, and always also holding vfs_biglock, as they go
+ * with filesystem operations; so they can be read holding either.
+ * Lookups don't take the big lock, but use this one for reading, and
+ * can then run side by side; holding it also keeps the filesystems in
+ * the table mounted. knowndevs_lock comes first, since a filesystem
+ * may take the big lock to get its root.
+ *
+ * Mount and unmount don't hold it for writing while they do I/O: they
+ * mark the device kd_busy, do the I/O holding just the big lock, and
+ * then take the write lock again to publish the result.
+ */
+static struct rwlock *knowndevs_lock;
+
 /* The big lock for all FS ops. Remove for filesystem assignment. */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
@@ -112,6 +133,11 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	knowndevs_lock = rwlock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
+	}
+
 	devnull_create();
 	semfs_bootstrap();
 }
@@ -180,7 +206,8 @@ vfs_sync(void)
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		dev = knowndevarray_get(knowndevs, i);
-		if (dev->kd_fs != NULL && dev->kd_fs != SWAP_FS) {
+		if (dev->kd_fs != NULL && dev->kd_fs != SWAP_FS &&
+		    !dev->kd_busy) {
 			/*result =*/ FSOP_SYNC(dev->kd_fs);
 		}
 	}
@@ -198,10 +225,17 @@ int
 vfs_getroot(const char *devname, struct vnode **ret)
 {
 	struct knowndev *kd;
+	struct fs *fs;
 	unsigned i, num;
+	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	/* knowndevs_lock comes first */
+	KASSERT(!vfs_biglock_do_i_hold());
 
+	fs = NULL;
+	result = ENODEV;
+
+	rwlock_acquire_read(knowndevs_lock);
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -215,19 +249,23 @@ vfs_getroot(const char *devname, struct vnode **ret)
 		 * and DEVNAME names the device, return ENXIO.
 		 */
 
-		if (kd->kd_fs != NULL && kd->kd_fs != SWAP_FS) {
+		if (kd->kd_fs != NULL && kd->kd_fs != SWAP_FS &&
+		    !kd->kd_busy) {
 			const char *volname;
 			volname = FSOP_GETVOLNAME(kd->kd_fs);
 
 			if (!strcmp(kd->kd_name, devname) ||
 			    (volname!=NULL && !strcmp(volname, devname))) {
-				return FSOP_GETROOT(kd->kd_fs, ret);
+				/* Get the root after the loop, below */
+				fs = kd->kd_fs;
+				break;
 			}
 		}
 		else {
 			if (kd->kd_rawname!=NULL &&
 			    !strcmp(kd->kd_name, devname)) {
-				return ENXIO;
+				result = ENXIO;
+				break;
 			}
 		}
 
@@ -242,7 +280,8 @@ vfs_getroot(const char *devname, struct vnode **ret)
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
 			*ret = kd->kd_vnode;
-			return 0;
+			result = 0;
+			break;
 		}
 
 		/*
@@ -253,7 +292,8 @@ vfs_getroot(const char *devname, struct vnode **ret)
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
 			*ret = kd->kd_vnode;
-			return 0;
+			result = 0;
+			break;
 		}
 
 		/*
@@ -262,12 +302,17 @@ vfs_getroot(const char *devname, struct vnode **ret)
 		 * next one.
 		 */
 	}
+	if (fs != NULL) {
+		/* The read lock keeps it from being unmounted meanwhile */
+		result = FSOP_GETROOT(fs, ret);
+	}
+	rwlock_release_read(knowndevs_lock);
 
 	/*
-	 * If we got here, the device specified by devname doesn't exist.
+	 * If we found nothing, the device specified by devname
+	 * doesn't exist, and result is still ENODEV.
 	 */
-
-	return ENODEV;
+	return result;
 }
 
 /*
@@ -277,12 +322,14 @@ const char *
 vfs_getdevname(struct fs *fs)
 {
 	struct knowndev *kd;
+	const char *name;
 	unsigned i, num;
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
+	name = NULL;
 
+	rwlock_acquire_read(knowndevs_lock);
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -294,11 +341,13 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
-			return kd->kd_name;
+			name = kd->kd_name;
+			break;
 		}
 	}
+	rwlock_release_read(knowndevs_lock);
 
-	return NULL;
+	return name;
 }
 
 /*
@@ -364,7 +413,8 @@ badnames(const char *n1, const char *n2, const char *n3)
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
 
-		if (kd->kd_fs != NULL && kd->kd_fs != SWAP_FS) {
+		if (kd->kd_fs != NULL && kd->kd_fs != SWAP_FS &&
+		    !kd->kd_busy) {
 			volname = FSOP_GETVOLNAME(kd->kd_fs);
 			if (samestring3(volname, n1, n2, n3)) {
 				return 1;
@@ -401,6 +451,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	/* Silence warning with gcc 4.8 -Og (but not -O2) */
 	index = 0;
 
+	rwlock_acquire_write(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	name = kstrdup(dname);
@@ -433,6 +484,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	kd->kd_device = dev;
 	kd->kd_vnode = vnode;
 	kd->kd_fs = fs;
+	kd->kd_busy = false;
 
 	if (fs!=NULL) {
 		volname = FSOP_GETVOLNAME(fs);
@@ -454,6 +506,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	}
 
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return 0;
 
  fail:
@@ -471,6 +524,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	}
 
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return result;
 }
 
@@ -543,24 +597,39 @@ vfs_mount(const char *devname, void *data,
 	struct fs *fs;
 	int result;
 
+	rwlock_acquire_write(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
 	if (result) {
 		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return result;
 	}
 
-	if (kd->kd_fs != NULL) {
+	if (kd->kd_fs != NULL || kd->kd_busy) {
 		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return EBUSY;
 	}
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* Do the I/O without holding up lookups */
+	kd->kd_busy = true;
+	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
+
+	vfs_biglock_acquire();
 	result = mountfunc(data, kd->kd_device, &fs);
+	vfs_biglock_release();
+
+	rwlock_acquire_write(knowndevs_lock);
+	vfs_biglock_acquire();
+	kd->kd_busy = false;
 	if (result) {
 		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return result;
 	}
 
@@ -574,6 +643,7 @@ vfs_mount(const char *devname, void *data,
 		volname ? volname : kd->kd_name, kd->kd_name);
 
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return 0;
 }
 
@@ -601,6 +671,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 		devname = myname;
 	}
 
+	rwlock_acquire_write(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
@@ -608,7 +679,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 		goto out;
 	}
 
-	if (kd->kd_fs != NULL) {
+	if (kd->kd_fs != NULL || kd->kd_busy) {
 		result = EBUSY;
 		goto out;
 	}
@@ -623,6 +694,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 
  out:
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	if (myname != NULL) {
 		kfree(myname);
 	}
@@ -638,8 +710,10 @@ int
 vfs_unmount(const char *devname)
 {
 	struct knowndev *kd;
+	struct fs *fs;
 	int result;
 
+	rwlock_acquire_write(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
@@ -647,6 +721,10 @@ vfs_unmount(const char *devname)
 		goto fail;
 	}
 
+	if (kd->kd_busy) {
+		result = EBUSY;
+		goto fail;
+	}
 	if (kd->kd_fs == NULL || kd->kd_fs == SWAP_FS) {
 		result = EINVAL;
 		goto fail;
@@ -654,13 +732,27 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/*
+	 * Do the I/O without holding up lookups. Once the write lock
+	 * is dropped, new lookups skip the device; ones already under
+	 * way finished before we got the write lock.
+	 */
+	fs = kd->kd_fs;
+	kd->kd_busy = true;
+	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
+
+	vfs_biglock_acquire();
 	/* sync the fs */
-	result = FSOP_SYNC(kd->kd_fs);
-	if (result) {
-		goto fail;
+	result = FSOP_SYNC(fs);
+	if (result == 0) {
+		result = FSOP_UNMOUNT(fs);
 	}
+	vfs_biglock_release();
 
-	result = FSOP_UNMOUNT(kd->kd_fs);
+	rwlock_acquire_write(knowndevs_lock);
+	vfs_biglock_acquire();
+	kd->kd_busy = false;
 	if (result) {
 		goto fail;
 	}
@@ -674,6 +766,7 @@ vfs_unmount(const char *devname)
 
  fail:
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return result;
 }
 
@@ -690,6 +783,7 @@ vfs_swapoff(const char *devname)
 	struct knowndev *kd;
 	int result;
 
+	rwlock_acquire_write(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
@@ -711,6 +805,7 @@ vfs_swapoff(const char *devname)
 
  fail:
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return result;
 }
 
@@ -724,6 +819,7 @@ vfs_unmountall(void)
 	unsigned i, num;
 	int result;
 
+	rwlock_acquire_write(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	num = knowndevarray_num(knowndevs);
@@ -742,6 +838,12 @@ vfs_unmountall(void)
 			dev->kd_fs = NULL;
 			continue;
 		}
+		if (dev->kd_busy) {
+			/* being unmounted already */
+			kprintf("vfs: Cannot unmount %s: (busy)\n",
+				dev->kd_name);
+			continue;
+		}
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
@@ -781,6 +883,7 @@ vfs_unmountall(void)
 	}
 
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 
 	return 0;
 }
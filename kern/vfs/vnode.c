@@ -50,6 +50,7 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	vn->vn_ops = ops;
 	vn->vn_refcount = 1;
 	spinlock_init(&vn->vn_countlock);
+	spinlock_setname(&vn->vn_countlock, "vnode count");
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
 	return 0;
@@ -180,3 +180,26 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_define_tstack(struct addrspace *as, int *slotret, vaddr_t *stackptr)
+{
+	/*
+	 * Write this.
+	 */
+
+	(void)as;
+	(void)slotret;
+	(void)stackptr;
+	return ENOSYS;
+}
+
+void
+as_release_tstack(struct addrspace *as, int slot)
+{
+	/*
+	 * Write this.
+	 */
+
+	(void)as;
+	(void)slot;
+}
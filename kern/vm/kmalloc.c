@@ -30,6 +30,7 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <clock.h>
 #include <vm.h>
 
 /*
@@ -111,6 +112,11 @@ fill_deadbeef(void *vptr, size_t len)
  * CHECKGUARDS checks that allocated blocks' guard bands are intact
  * when checking kernel heap pages with SLOW and SLOWER. This is also
  * quite slow in its own right.
+ *
+ * PROFILE samples one allocation in PROF_PERIOD and aggregates live
+ * bytes, peak bytes, and allocation rate per allocation site. It uses
+ * the LABELS machinery to remember the site of each block, so it
+ * turns LABELS on as well. See kheap_printprofile().
  */
 
 #undef  SLOW
@@ -121,6 +127,14 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+#undef PROFILE
+
+#ifdef PROFILE
+#ifndef LABELS
+#define LABELS
+#endif
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
@@ -166,7 +180,7 @@ struct pageref {
  * OS/161 performance and scalability aren't super-critical.
  */
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static struct spinlock kmalloc_spinlock = SPINLOCK_NAMED_INITIALIZER("kmalloc");
 
 ////////////////////////////////////////
 
@@ -617,6 +631,9 @@ struct malloclabel {
 	unsigned generation;
 };
 
+/* High bit of the generation: block was sampled by the profiler. */
+#define LABEL_SAMPLED 0x80000000U
+
 static unsigned mallocgeneration;
 
 /*
@@ -668,7 +685,7 @@ dump_subpage(struct pageref *pr, unsigned generation)
 		}
 		blockaddr = prpage + i * blocksize;
 		ml = (struct malloclabel *)blockaddr;
-		if (ml->generation != generation) {
+		if ((ml->generation & ~LABEL_SAMPLED) != generation) {
 			continue;
 		}
 		kprintf("%5zu bytes at %p, allocated at %p\n",
@@ -697,6 +714,233 @@ dump_subpages(unsigned generation)
 
 #endif /* LABELS */
 
+////////////////////////////////////////
+
+#ifdef PROFILE
+
+/*
+ * Heap profiler.
+ *
+ * Every PROF_PERIOD-th allocation is charged to its allocation site
+ * in profsites[], a small open-addressed hash table keyed by the
+ * label (return address of the kmalloc call). Subpage blocks that
+ * were sampled are marked with LABEL_SAMPLED so kfree knows to
+ * credit them back; whole-page blocks carry no label, so sampled
+ * ones are remembered in profbigs[] instead.
+ *
+ * We can't call kmalloc from in here, so all the tables are static.
+ * If either fills up further samples are dropped and counted in
+ * profdropped. Everything is protected by kmalloc_spinlock.
+ *
+ * The numbers printed are scaled back up by PROF_PERIOD, so they are
+ * estimates; the longer things run the better they get.
+ */
+
+#define PROF_PERIOD	8	/* sample 1 allocation in this many */
+#define PROF_NSITES	128	/* max allocation sites; power of 2 */
+#define PROF_NBIG	64	/* max sampled whole-page blocks */
+#define PROF_NPRINT	20	/* sites shown by kheap_printprofile */
+
+struct profsite {
+	vaddr_t ps_label;	/* allocation site, or 0 if slot unused */
+	unsigned ps_allocs;	/* sampled allocations since reset */
+	unsigned ps_frees;	/* sampled frees since reset */
+	unsigned ps_lastallocs;	/* ps_allocs at the last printout */
+	size_t ps_live;		/* sampled bytes currently allocated */
+	size_t ps_peak;		/* high-water mark of ps_live since reset */
+};
+
+struct profbig {
+	vaddr_t pb_addr;	/* block address, or 0 if slot unused */
+	struct profsite *pb_site;
+	size_t pb_size;
+};
+
+static struct profsite profsites[PROF_NSITES];
+static struct profbig profbigs[PROF_NBIG];
+static unsigned profcount;		/* allocations seen, for sampling */
+static unsigned profdropped;		/* samples lost to full tables */
+static struct timespec profstamp;	/* time of last printout */
+
+/*
+ * Decide whether to sample the current allocation.
+ */
+static
+bool
+prof_sample(void)
+{
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	return (profcount++ % PROF_PERIOD) == 0;
+}
+
+/*
+ * Find the entry for allocation site LABEL, creating it if needed.
+ * Returns NULL if the table is full.
+ */
+static
+struct profsite *
+prof_getsite(vaddr_t label)
+{
+	unsigned i, n;
+	struct profsite *ps;
+
+	KASSERT(label != 0);
+
+	/* return addresses are word-aligned, so drop the low bits */
+	i = (label >> 2) & (PROF_NSITES - 1);
+	for (n=0; n<PROF_NSITES; n++) {
+		ps = &profsites[i];
+		if (ps->ps_label == label) {
+			return ps;
+		}
+		if (ps->ps_label == 0) {
+			ps->ps_label = label;
+			return ps;
+		}
+		i = (i + 1) & (PROF_NSITES - 1);
+	}
+	profdropped++;
+	return NULL;
+}
+
+static
+void
+prof_charge(struct profsite *ps, size_t size)
+{
+	ps->ps_allocs++;
+	ps->ps_live += size;
+	if (ps->ps_live > ps->ps_peak) {
+		ps->ps_peak = ps->ps_live;
+	}
+}
+
+static
+void
+prof_credit(struct profsite *ps, size_t size)
+{
+	KASSERT(ps->ps_live >= size);
+	ps->ps_frees++;
+	ps->ps_live -= size;
+}
+
+/*
+ * Subpage allocation of a block of size BLOCKSIZE whose label is ML.
+ */
+static
+void
+prof_subpage_alloc(struct malloclabel *ml, size_t blocksize)
+{
+	struct profsite *ps;
+
+	if (!prof_sample()) {
+		return;
+	}
+	ps = prof_getsite(ml->label);
+	if (ps == NULL) {
+		return;
+	}
+	prof_charge(ps, blocksize);
+	ml->generation |= LABEL_SAMPLED;
+}
+
+/*
+ * Subpage free; ML is the label of the block being freed.
+ */
+static
+void
+prof_subpage_free(struct malloclabel *ml, size_t blocksize)
+{
+	struct profsite *ps;
+
+	if ((ml->generation & LABEL_SAMPLED) == 0) {
+		return;
+	}
+	/* The site must exist; entries are never removed. */
+	ps = prof_getsite(ml->label);
+	KASSERT(ps != NULL);
+	prof_credit(ps, blocksize);
+}
+
+/*
+ * Whole-page allocation.
+ */
+static
+void
+prof_big_alloc(vaddr_t addr, vaddr_t label, size_t size)
+{
+	struct profsite *ps;
+	unsigned i;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (!prof_sample()) {
+		spinlock_release(&kmalloc_spinlock);
+		return;
+	}
+	for (i=0; i<PROF_NBIG; i++) {
+		if (profbigs[i].pb_addr == 0) {
+			break;
+		}
+	}
+	if (i == PROF_NBIG) {
+		profdropped++;
+		spinlock_release(&kmalloc_spinlock);
+		return;
+	}
+	ps = prof_getsite(label);
+	if (ps != NULL) {
+		prof_charge(ps, size);
+		profbigs[i].pb_addr = addr;
+		profbigs[i].pb_site = ps;
+		profbigs[i].pb_size = size;
+	}
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Whole-page free.
+ */
+static
+void
+prof_big_free(vaddr_t addr)
+{
+	unsigned i;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<PROF_NBIG; i++) {
+		if (profbigs[i].pb_addr == addr) {
+			prof_credit(profbigs[i].pb_site, profbigs[i].pb_size);
+			profbigs[i].pb_addr = 0;
+			break;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Print one line of the profile. ELAPSEDMS is the time since the
+ * previous printout in milliseconds, or 0 if there wasn't one.
+ */
+static
+void
+prof_printsite(struct profsite *ps, uint64_t elapsedms)
+{
+	uint64_t rate;
+
+	kprintf("  %p %10lu %10lu %8u %8u ", (void *)ps->ps_label,
+		(unsigned long)ps->ps_live * PROF_PERIOD,
+		(unsigned long)ps->ps_peak * PROF_PERIOD,
+		ps->ps_allocs * PROF_PERIOD, ps->ps_frees * PROF_PERIOD);
+	if (elapsedms == 0) {
+		kprintf("%10s\n", "-");
+		return;
+	}
+	rate = (uint64_t)(ps->ps_allocs - ps->ps_lastallocs) * PROF_PERIOD;
+	rate = rate * 1000 / elapsedms;
+	kprintf("%10llu\n", (unsigned long long)rate);
+}
+
+#endif /* PROFILE */
+
 void
 kheap_nextgeneration(void)
 {
@@ -737,6 +981,103 @@ kheap_dumpall(void)
 #endif
 }
 
+/*
+ * Print the heap profile: the PROF_NPRINT allocation sites holding
+ * the most memory, biggest first. The allocation rate is measured
+ * since the previous call.
+ */
+void
+kheap_printprofile(void)
+{
+#ifdef PROFILE
+	struct timespec now, diff;
+	uint64_t elapsedms;
+	struct profsite *ps;
+	size_t lastlive;
+	int i, best, lastbest, n;
+
+	/* fetch the time before going to splhigh */
+	gettime(&now);
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	elapsedms = 0;
+	if (profstamp.tv_sec != 0) {
+		timespec_sub(&now, &profstamp, &diff);
+		elapsedms = (uint64_t)diff.tv_sec * 1000
+			+ diff.tv_nsec / 1000000;
+	}
+
+	kprintf("Kernel heap profile (1 in %u allocations sampled, "
+		"%u samples dropped):\n", PROF_PERIOD, profdropped);
+	kprintf("  %-10s %10s %10s %8s %8s %10s\n", "site", "live",
+		"peak", "allocs", "frees", "allocs/s");
+
+	/*
+	 * Selection sort by (ps_live descending, index ascending);
+	 * there's no room to sort a copy.
+	 */
+	lastlive = (size_t)-1;
+	lastbest = -1;
+	for (n=0; n<PROF_NPRINT; n++) {
+		best = -1;
+		for (i=0; i<PROF_NSITES; i++) {
+			ps = &profsites[i];
+			if (ps->ps_label == 0) {
+				continue;
+			}
+			if (ps->ps_live > lastlive ||
+			    (ps->ps_live == lastlive && i <= lastbest)) {
+				/* already printed */
+				continue;
+			}
+			if (best < 0 || ps->ps_live > profsites[best].ps_live) {
+				best = i;
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+		prof_printsite(&profsites[best], elapsedms);
+		lastlive = profsites[best].ps_live;
+		lastbest = best;
+	}
+
+	for (i=0; i<PROF_NSITES; i++) {
+		profsites[i].ps_lastallocs = profsites[i].ps_allocs;
+	}
+	profstamp = now;
+
+	spinlock_release(&kmalloc_spinlock);
+#else
+	kprintf("Enable PROFILE in kmalloc.c to use this functionality.\n");
+#endif
+}
+
+/*
+ * Restart the heap profile. Live byte counts reflect blocks that are
+ * still allocated and so are kept; everything else is zeroed.
+ */
+void
+kheap_resetprofile(void)
+{
+#ifdef PROFILE
+	unsigned i;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<PROF_NSITES; i++) {
+		profsites[i].ps_allocs = 0;
+		profsites[i].ps_frees = 0;
+		profsites[i].ps_lastallocs = 0;
+		profsites[i].ps_peak = profsites[i].ps_live;
+	}
+	profdropped = 0;
+	profstamp.tv_sec = 0;
+	profstamp.tv_nsec = 0;
+	spinlock_release(&kmalloc_spinlock);
+#endif
+}
+
 ////////////////////////////////////////
 
 /*
@@ -946,6 +1287,10 @@ subpage_kmalloc(size_t sz
 #ifdef LABELS
 			retptr = establishlabel(retptr, label);
 #endif
+#ifdef PROFILE
+			prof_subpage_alloc((struct malloclabel *)retptr - 1,
+					   sizes[blktype]);
+#endif
 
 			checksubpages();
 
@@ -1102,6 +1447,11 @@ subpage_kfree(void *ptr)
 	checkguardband(ptraddr, smallerblocksize, blocksize);
 #endif
 
+#ifdef PROFILE
+	/* the label sits just below the client pointer */
+	prof_subpage_free((struct malloclabel *)ptr - 1, sizes[blktype]);
+#endif
+
 	/*
 	 * Clear the block to 0xdeadbeef to make it easier to detect
 	 * uses of dangling pointers.
@@ -1194,6 +1544,9 @@ kmalloc(size_t sz)
 			return NULL;
 		}
 		KASSERT(address % PAGE_SIZE == 0);
+#ifdef PROFILE
+		prof_big_alloc(address, label, npages * PAGE_SIZE);
+#endif
 
 		return (void *)address;
 	}
@@ -1218,6 +1571,9 @@ kfree(void *ptr)
 		return;
 	} else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+#ifdef PROFILE
+		prof_big_free((vaddr_t)ptr);
+#endif
 		free_kpages((vaddr_t)ptr);
 	}
 }